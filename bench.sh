@@ -0,0 +1,149 @@
+#!/bin/bash
+# Benchmark harness: builds synthetic EXT2 images of several shapes and
+# times myfs_bench against each of them
+#
+# Usage: ./bench.sh [options] [-- myfs_bench options]
+#   -o <dir>      Directory for the generated images (default bench_images)
+#   -s <shapes>   Comma list of shapes to run (default files,large,deep,wide)
+#                   files - many small files spread over 50 directories
+#                   large - one dense file and two large sparse files
+#                   deep  - a chain of nested directories
+#                   wide  - one huge directory, hash indexed when e2fsck allows
+#   -b <sizes>    Comma list of block sizes (default 1024,4096)
+#   -n <count>    Files in the "files" shape (default 5000)
+#   -m <mb>       Size of the dense file in MiB; sparse files are 16x that
+#                 apparent size (default 64)
+#   -d <depth>    Depth of the "deep" shape (default 200)
+#   -w <count>    Entries in the "wide" directory (default 20000)
+#   -r            Rebuild images that already exist
+#
+# Images are named after their shape and parameters, so they are reused
+# between runs until a parameter changes.
+
+set -e
+
+OUT=bench_images
+SHAPES=files,large,deep,wide
+BLOCK_SIZES=1024,4096
+FILES=5000
+LARGE_MB=64
+DEPTH=200
+WIDE=20000
+REBUILD=0
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+        -o) OUT="$2"; shift 2 ;;
+        -s) SHAPES="$2"; shift 2 ;;
+        -b) BLOCK_SIZES="$2"; shift 2 ;;
+        -n) FILES="$2"; shift 2 ;;
+        -m) LARGE_MB="$2"; shift 2 ;;
+        -d) DEPTH="$2"; shift 2 ;;
+        -w) WIDE="$2"; shift 2 ;;
+        -r) REBUILD=1; shift ;;
+        --) shift; break ;;
+        *) echo "Unknown option: $1" >&2; exit 1 ;;
+    esac
+done
+
+if ! command -v mkfs.ext2 >/dev/null 2>&1; then
+    echo "mkfs.ext2 not found; install e2fsprogs" >&2
+    exit 1
+fi
+
+# Fills $1 with the files of shape $2
+populate() {
+    local root="$1"
+    local shape="$2"
+    local i
+
+    case "$shape" in
+        files)
+            # ~3 KiB files: more than one block at 1K, a partial block at 4K
+            local per_dir=$(( (FILES + 49) / 50 ))
+            for i in $(seq -w 1 50); do
+                mkdir "$root/dir$i"
+                head -c $(( per_dir * 3000 )) /dev/urandom | split -b 3000 -a 4 - "$root/dir$i/f"
+            done
+            ;;
+        large)
+            head -c $(( LARGE_MB * 1024 * 1024 )) /dev/urandom > "$root/dense.bin"
+            for i in 1 2; do
+                truncate -s $(( LARGE_MB * 16 ))M "$root/sparse$i.bin"
+                # A few scattered extents, so the indirect blocks have holes
+                for seek in 1 997 5003 40009; do
+                    dd if=/dev/urandom of="$root/sparse$i.bin" bs=64k count=4 \
+                       seek=$(( seek * i % (LARGE_MB * 256) )) conv=notrunc 2>/dev/null
+                done
+            done
+            ;;
+        deep)
+            local dir="$root"
+            for i in $(seq 1 "$DEPTH"); do
+                dir="$dir/d$i"
+                mkdir "$dir"
+                echo "level $i" > "$dir/file"
+            done
+            ;;
+        wide)
+            mkdir "$root/wide"
+            head -c $(( WIDE * 100 )) /dev/urandom | split -b 100 -a 6 - "$root/wide/entry_"
+            ;;
+    esac
+}
+
+# Image size in MiB with room for metadata at either block size
+image_mb() {
+    case "$1" in
+        files) echo $(( FILES * 8 / 1024 + 64 )) ;;
+        large) echo $(( LARGE_MB + LARGE_MB / 8 + 64 )) ;;
+        deep) echo $(( DEPTH * 16 / 1024 + 32 )) ;;
+        wide) echo $(( WIDE * 4 / 1024 + 64 )) ;;
+    esac
+}
+
+# Inodes needed by the shape, with headroom
+image_inodes() {
+    case "$1" in
+        files) echo $(( FILES + 1024 )) ;;
+        large) echo 1024 ;;
+        deep) echo $(( DEPTH * 2 + 1024 )) ;;
+        wide) echo $(( WIDE + 1024 )) ;;
+    esac
+}
+
+mkdir -p "$OUT"
+IMAGES=()
+
+for shape in ${SHAPES//,/ }; do
+    case "$shape" in
+        files) params="n$FILES" ;;
+        large) params="m$LARGE_MB" ;;
+        deep) params="d$DEPTH" ;;
+        wide) params="w$WIDE" ;;
+        *) echo "Unknown shape: $shape" >&2; exit 1 ;;
+    esac
+
+    for bs in ${BLOCK_SIZES//,/ }; do
+        img="$OUT/$shape-$params-b$bs.img"
+        IMAGES+=("$img")
+        if [ -f "$img" ] && [ "$REBUILD" = 0 ]; then
+            continue
+        fi
+
+        echo "Building $img..."
+        staging=$(mktemp -d)
+        populate "$staging" "$shape"
+        rm -f "$img"
+        mkfs.ext2 -q -F -b "$bs" -N "$(image_inodes "$shape")" -d "$staging" \
+                  "$img" "$(image_mb "$shape")M"
+        rm -rf "$staging"
+
+        # mkfs -d writes linear directories; let e2fsck hash index them
+        if command -v e2fsck >/dev/null 2>&1; then
+            e2fsck -fyD "$img" >/dev/null 2>&1 || true
+        fi
+    done
+done
+
+./myfs_bench "$@" "${IMAGES[@]}"
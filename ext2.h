@@ -7,6 +7,7 @@
 #define EXT2_BLOCK_SIZE 1024
 #define EXT2_INODE_SIZE 128
 #define EXT2_ROOT_INODE 2
+#define EXT2_NAME_LEN 255
 
 /* EXT2 Superblock (1024 bytes, located at offset 1024) */
 typedef struct {
@@ -47,12 +48,26 @@ typedef struct {
     uint32_t s_algo_usage_bitmap;      /* For compression */
     uint8_t s_prealloc_blocks;         /* Prealloc blocks for files */
     uint8_t s_prealloc_dir_blocks;     /* Prealloc blocks for dirs */
-    uint16_t s_padding;
+    uint16_t s_reserved_gdt_blocks;    /* Blocks reserved for GDT growth */
     char s_journal_uuid[16];           /* Journal UUID */
     uint32_t s_journal_inum;           /* Journal inode */
     uint32_t s_journal_dev;            /* Journal device */
     uint32_t s_last_orphan;            /* Last orphan inode */
-    uint32_t s_reserved[197];          /* Reserved space */
+    uint32_t s_hash_seed[4];           /* HTree hash seed */
+    uint8_t s_def_hash_version;        /* Default hash version for directories */
+    uint8_t s_jnl_backup_type;
+    uint16_t s_desc_size;              /* Group descriptor size (64-bit only) */
+    uint32_t s_default_mount_opts;
+    uint32_t s_first_meta_bg;          /* First metablock block group */
+    uint32_t s_mkfs_time;              /* When the file system was created */
+    uint32_t s_jnl_blocks[17];         /* Backup of the journal inode */
+    uint32_t s_blocks_count_hi;
+    uint32_t s_r_blocks_count_hi;
+    uint32_t s_free_blocks_hi;
+    uint16_t s_min_extra_isize;
+    uint16_t s_want_extra_isize;
+    uint32_t s_flags;                  /* Miscellaneous flags (hash signedness) */
+    uint32_t s_reserved[167];          /* Reserved space */
 } ext2_superblock_t;
 
 /* EXT2 Block Group Descriptor */
@@ -89,6 +104,27 @@ typedef struct {
     uint8_t i_osd2[12];                /* OS dependent 2 */
 } ext2_inode_t;
 
+/* HTree root information, follows the "." and ".." entries in block 0 */
+typedef struct {
+    uint32_t reserved_zero;
+    uint8_t hash_version;              /* Hash used for this directory */
+    uint8_t info_length;               /* Size of this structure (8) */
+    uint8_t indirect_levels;           /* Index levels below the root */
+    uint8_t unused_flags;
+} ext2_dx_root_info_t;
+
+/* HTree index entry; the first one of a block holds a count/limit pair
+ * in place of its hash */
+typedef struct {
+    uint32_t hash;                     /* Lowest hash stored under block */
+    uint32_t block;                    /* Logical directory block */
+} ext2_dx_entry_t;
+
+typedef struct {
+    uint16_t limit;                    /* Entries that fit in the block */
+    uint16_t count;                    /* Entries in use */
+} ext2_dx_countlimit_t;
+
 /* EXT2 Directory Entry (variable length) */
 typedef struct {
     uint32_t inode;                    /* Inode number */
@@ -123,6 +159,22 @@ typedef struct {
 #define EXT2_S_IWOTH 0x0002             /* Others write */
 #define EXT2_S_IXOTH 0x0001             /* Others execute */
 
+/* Feature and flag bits */
+#define EXT2_FEATURE_COMPAT_RESIZE_INODE 0x0010
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x0020
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT2_INDEX_FL 0x00001000        /* Directory has an HTree index */
+#define EXT2_FLAGS_SIGNED_HASH 0x0001   /* s_flags: hash names as signed chars */
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002 /* s_flags: hash names as unsigned chars */
+
+/* HTree hash versions */
+#define EXT2_HASH_LEGACY 0
+#define EXT2_HASH_HALF_MD4 1
+#define EXT2_HASH_TEA 2
+#define EXT2_HASH_LEGACY_UNSIGNED 3
+#define EXT2_HASH_HALF_MD4_UNSIGNED 4
+#define EXT2_HASH_TEA_UNSIGNED 5
+
 /* Magic number */
 #define EXT2_MAGIC 0xEF53
 
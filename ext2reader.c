@@ -0,0 +1,999 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "ext2reader.h"
+
+/* An open image. Nothing here changes after ext2r_open, which is what
+ * lets threads share a handle without locks. */
+struct ext2r_fs {
+    int fd;
+    int owns_fd;                        /* Opened by ext2r_open, closed by ext2r_close */
+    ext2r_allocator_t alloc;
+    ext2_superblock_t sb;
+    uint32_t block_size;
+    uint32_t inode_size;                /* On-disk inode record size */
+    uint32_t num_groups;
+    ext2_group_desc_t group_descs[];
+};
+
+/* State for reading a directory's blocks during an HTree descent */
+typedef struct {
+    const ext2r_fs_t *fs;
+    const ext2_inode_t *inode;
+    ext2r_map_t map;
+    uint8_t *ind_buf;                   /* Three blocks behind map */
+} ext2r_dx_ctx_t;
+
+/*
+ * Default allocator, used when the caller passes none
+ */
+static void *ext2r_malloc(void *ctx, size_t size) {
+    (void)ctx;
+    return malloc(size);
+}
+
+static void ext2r_free(void *ctx, void *ptr) {
+    (void)ctx;
+    free(ptr);
+}
+
+/*
+ * Returns a short description of an EXT2R_E* code
+ */
+const char *ext2r_strerror(int err) {
+    switch (err) {
+    case EXT2R_OK:
+        return "Success";
+    case EXT2R_EIO:
+        return "I/O error reading the image";
+    case EXT2R_EBADFS:
+        return "Not a valid EXT2 image";
+    case EXT2R_ENOMEM:
+        return "Out of memory";
+    case EXT2R_ENOENT:
+        return "No such file or directory";
+    case EXT2R_ENOTDIR:
+        return "Not a directory";
+    case EXT2R_EINVAL:
+        return "Invalid argument";
+    case EXT2R_ECORRUPT:
+        return "Corrupt metadata";
+    case EXT2R_ENAMETOOLONG:
+        return "File name too long";
+    case EXT2R_EBADINDEX:
+        return "Unusable directory index";
+    default:
+        return "Unknown error";
+    }
+}
+
+/*
+ * Reads exactly length bytes at offset. A read past the end of the image
+ * counts as an I/O error.
+ */
+static int ext2r_pread_full(int fd, void *buffer, size_t length, off_t offset) {
+    uint8_t *p = (uint8_t *)buffer;
+    while (length > 0) {
+        ssize_t n = pread(fd, p, length, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            return EXT2R_EIO;
+        }
+        p += n;
+        length -= (size_t)n;
+        offset += n;
+    }
+    return EXT2R_OK;
+}
+
+/*
+ * Reads the superblock at offset 1024 and checks that its geometry is
+ * usable, so later arithmetic cannot divide by zero or overflow.
+ */
+int ext2r_read_superblock(int fd, ext2_superblock_t *sb) {
+    int err = ext2r_pread_full(fd, sb, sizeof(*sb), 1024);
+    if (err != EXT2R_OK) {
+        return err;
+    }
+    
+    if (sb->s_magic != EXT2_MAGIC) {
+        return EXT2R_EBADFS;
+    }
+    if (sb->s_log_block_size > 6 || sb->s_blocks_count == 0 || sb->s_inodes_count == 0 ||
+        sb->s_blocks_per_group == 0 || sb->s_inodes_per_group == 0 ||
+        sb->s_first_data_block >= sb->s_blocks_count) {
+        return EXT2R_EBADFS;
+    }
+    if (sb->s_rev_level >= 1) {
+        uint32_t inode_size = sb->s_inode_size;
+        if (inode_size < EXT2_INODE_SIZE || (inode_size & (inode_size - 1)) != 0 ||
+            inode_size > (1024U << sb->s_log_block_size)) {
+            return EXT2R_EBADFS;
+        }
+    }
+    return EXT2R_OK;
+}
+
+/*
+ * Number of block groups described by a superblock
+ */
+uint32_t ext2r_group_count(const ext2_superblock_t *sb) {
+    return (sb->s_blocks_count - sb->s_first_data_block + sb->s_blocks_per_group - 1) /
+           sb->s_blocks_per_group;
+}
+
+/*
+ * Whether a symbolic link keeps its target in i_block. An extended
+ * attribute block is charged to i_blocks too and does not count, as in
+ * the kernel's ext2_inode_is_fast_symlink.
+ */
+int ext2r_fast_symlink(const ext2_superblock_t *sb, const ext2_inode_t *inode) {
+    uint32_t ea_blocks = inode->i_file_acl ? (1024u << sb->s_log_block_size) / 512 : 0;
+    return (inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFLNK && inode->i_blocks == ea_blocks;
+}
+
+/*
+ * Reads the first count group descriptors into descs. They start in the
+ * block after the superblock.
+ */
+int ext2r_read_group_descs(int fd, const ext2_superblock_t *sb, ext2_group_desc_t *descs,
+                           uint32_t count) {
+    uint32_t block_size = 1024U << sb->s_log_block_size;
+    uint32_t group_desc_block = (block_size == 1024) ? 2 : 1;
+    
+    return ext2r_pread_full(fd, descs, (size_t)count * sizeof(ext2_group_desc_t),
+                            (off_t)group_desc_block * block_size);
+}
+
+/*
+ * Opens an image file. The descriptor is owned by the handle.
+ */
+int ext2r_open(const char *img_path, const ext2r_allocator_t *alloc, ext2r_fs_t **out) {
+    int fd = open(img_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return EXT2R_EIO;
+    }
+    
+    int err = ext2r_open_fd(fd, alloc, out);
+    if (err != EXT2R_OK) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return err;
+    }
+    (*out)->owns_fd = 1;
+    return EXT2R_OK;
+}
+
+/*
+ * Opens an image through a descriptor the caller keeps ownership of; it
+ * must stay open until ext2r_close. Only pread is used on it, so its file
+ * offset is never touched.
+ */
+int ext2r_open_fd(int fd, const ext2r_allocator_t *alloc, ext2r_fs_t **out) {
+    ext2_superblock_t sb;
+    
+    *out = NULL;
+    int err = ext2r_read_superblock(fd, &sb);
+    if (err != EXT2R_OK) {
+        return err;
+    }
+    
+    uint32_t num_groups = ext2r_group_count(&sb);
+    ext2r_allocator_t a = { ext2r_malloc, ext2r_free, NULL };
+    if (alloc) {
+        a = *alloc;
+    }
+    
+    ext2r_fs_t *fs = (ext2r_fs_t *)a.alloc(a.ctx, sizeof(*fs) +
+                                           (size_t)num_groups * sizeof(ext2_group_desc_t));
+    if (!fs) {
+        return EXT2R_ENOMEM;
+    }
+    fs->fd = fd;
+    fs->owns_fd = 0;
+    fs->alloc = a;
+    fs->sb = sb;
+    fs->block_size = 1024U << sb.s_log_block_size;
+    fs->inode_size = sb.s_rev_level >= 1 ? sb.s_inode_size : EXT2_INODE_SIZE;
+    fs->num_groups = num_groups;
+    
+    err = ext2r_read_group_descs(fd, &sb, fs->group_descs, num_groups);
+    if (err != EXT2R_OK) {
+        a.free(a.ctx, fs);
+        return err;
+    }
+    
+    *out = fs;
+    return EXT2R_OK;
+}
+
+/*
+ * Releases a handle, closing the image if ext2r_open opened it
+ */
+void ext2r_close(ext2r_fs_t *fs) {
+    if (!fs) {
+        return;
+    }
+    if (fs->owns_fd) {
+        close(fs->fd);
+    }
+    fs->alloc.free(fs->alloc.ctx, fs);
+}
+
+const ext2_superblock_t *ext2r_superblock(const ext2r_fs_t *fs) {
+    return &fs->sb;
+}
+
+uint32_t ext2r_block_size(const ext2r_fs_t *fs) {
+    return fs->block_size;
+}
+
+/*
+ * Bytes of scratch space a thread must pass to the calls that take one.
+ * A single buffer of this size serves every call.
+ */
+size_t ext2r_scratch_size(const ext2r_fs_t *fs) {
+    return (size_t)fs->block_size * EXT2R_SCRATCH_BLOCKS;
+}
+
+/*
+ * Reads one block of the image into buf
+ */
+int ext2r_read_block(const ext2r_fs_t *fs, uint32_t block_num, void *buf) {
+    if (block_num >= fs->sb.s_blocks_count) {
+        return EXT2R_EINVAL;
+    }
+    return ext2r_pread_full(fs->fd, buf, fs->block_size, (off_t)block_num * fs->block_size);
+}
+
+/*
+ * Reads the fixed 128-byte part of an inode
+ */
+int ext2r_read_inode(const ext2r_fs_t *fs, uint32_t ino, ext2_inode_t *inode) {
+    if (ino < 1 || ino > fs->sb.s_inodes_count) {
+        return EXT2R_EINVAL;
+    }
+    
+    uint32_t group = (ino - 1) / fs->sb.s_inodes_per_group;
+    uint32_t index = (ino - 1) % fs->sb.s_inodes_per_group;
+    if (group >= fs->num_groups) {
+        return EXT2R_ECORRUPT;
+    }
+    
+    uint32_t table = fs->group_descs[group].bg_inode_table;
+    if (table == 0 || table >= fs->sb.s_blocks_count) {
+        return EXT2R_ECORRUPT;
+    }
+    
+    off_t offset = (off_t)table * fs->block_size + (off_t)index * fs->inode_size;
+    return ext2r_pread_full(fs->fd, inode, sizeof(*inode), offset);
+}
+
+/*
+ * Size of a file in bytes. Revision 1 keeps the upper 32 bits of a
+ * regular file's size in i_dir_acl.
+ */
+uint64_t ext2r_inode_size(const ext2r_fs_t *fs, const ext2_inode_t *inode) {
+    uint64_t size = inode->i_size;
+    if (fs->sb.s_rev_level >= 1 && (inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFREG) {
+        size |= (uint64_t)inode->i_dir_acl << 32;
+    }
+    return size;
+}
+
+/*
+ * Maps a logical file block to its disk block through the indirect
+ * tree. Holes map to 0, and hole_run is set to the number of blocks from
+ * logical onwards that are known to be holes because a whole indirect
+ * subtree is missing. Indirect blocks come from read unless map already
+ * holds them, so a walk over neighbouring blocks reads each one once.
+ * Returns EXT2R_EINVAL past the largest file and EXT2R_EIO when read
+ * fails.
+ */
+int ext2r_map_walk(ext2r_map_t *map, const uint32_t i_block[15], uint32_t ptrs_per_block,
+                   uint32_t logical, uint32_t *physical, uint64_t *hole_run,
+                   ext2r_ind_read_fn read, void *ctx) {
+    uint64_t n = ptrs_per_block;
+    uint64_t index = logical;
+    uint32_t block;
+    int levels;
+    
+    *hole_run = 1;
+    
+    /* Work out which tree the block lives in and its index within it */
+    if (index < 12) {
+        *physical = i_block[index];
+        return EXT2R_OK;
+    }
+    index -= 12;
+    if (index < n) {
+        block = i_block[12];
+        levels = 1;
+    } else if ((index -= n) < n * n) {
+        block = i_block[13];
+        levels = 2;
+    } else if ((index -= n * n) < n * n * n) {
+        block = i_block[14];
+        levels = 3;
+    } else {
+        return EXT2R_EINVAL;
+    }
+    
+    /* Walk down the tree, one indirect block per level */
+    uint64_t span = 1;
+    for (int i = 1; i < levels; i++) {
+        span *= n;
+    }
+    uint32_t next = 0;
+    for (int depth = 0; depth < levels; depth++) {
+        if (block == 0) {
+            /* Whole subtree is a hole: skip to its end */
+            *hole_run = span * n - index % (span * n);
+            break;
+        }
+        
+        const uint32_t *ptrs = map->ind[depth];
+        if (!ptrs || map->ind_num[depth] != block) {
+            map->ind[depth] = NULL;  /* The loader may reuse its buffer */
+            ptrs = read(ctx, depth, block, next);
+            if (!ptrs) {
+                return EXT2R_EIO;
+            }
+            map->ind[depth] = ptrs;
+            map->ind_num[depth] = block;
+        }
+        
+        uint32_t slot = (uint32_t)((index / span) % n);
+        block = ptrs[slot];
+        next = (slot + 1 < n) ? ptrs[slot + 1] : 0;
+        span /= n;
+    }
+    
+    *physical = block;
+    return EXT2R_OK;
+}
+
+/* Where ext2r_map reads indirect blocks: one scratch block per depth */
+typedef struct {
+    const ext2r_fs_t *fs;
+    uint8_t *bufs;
+    int err;                            /* Why the last read failed */
+} ext2r_ind_ctx_t;
+
+/*
+ * Loader for ext2r_map_walk that reads into the scratch block for depth
+ */
+static const uint32_t *ext2r_ind_read(void *ctx, int depth, uint32_t block_num, uint32_t next) {
+    ext2r_ind_ctx_t *ic = (ext2r_ind_ctx_t *)ctx;
+    uint8_t *buf = ic->bufs + (size_t)depth * ic->fs->block_size;
+    (void)next;
+    
+    if (block_num >= ic->fs->sb.s_blocks_count) {
+        ic->err = EXT2R_ECORRUPT;
+        return NULL;
+    }
+    ic->err = ext2r_read_block(ic->fs, block_num, buf);
+    return ic->err == EXT2R_OK ? (const uint32_t *)buf : NULL;
+}
+
+/*
+ * Maps a logical block of inode with the indirect blocks kept in map,
+ * backed by the three scratch blocks at bufs
+ */
+static int ext2r_map(const ext2r_fs_t *fs, const ext2_inode_t *inode, ext2r_map_t *map,
+                     uint8_t *bufs, uint32_t logical, uint32_t *physical, uint64_t *hole_run) {
+    ext2r_ind_ctx_t ic = { fs, bufs, EXT2R_OK };
+    int err = ext2r_map_walk(map, inode->i_block, fs->block_size / sizeof(uint32_t), logical,
+                             physical, hole_run, ext2r_ind_read, &ic);
+    return (err == EXT2R_EIO) ? ic.err : err;
+}
+
+/*
+ * Maps a logical file block to its disk block. Holes map to 0. Uses the
+ * first three blocks of scratch.
+ */
+int ext2r_bmap(const ext2r_fs_t *fs, const ext2_inode_t *inode, uint32_t logical,
+               uint32_t *physical, void *scratch) {
+    ext2r_map_t map;
+    uint64_t hole_run;
+    
+    memset(&map, 0, sizeof(map));
+    return ext2r_map(fs, inode, &map, (uint8_t *)scratch, logical, physical, &hole_run);
+}
+
+/*
+ * Reads up to count bytes of a file at offset into buf; holes read as
+ * zeros and reads stop at the end of the file. *done is set to the bytes
+ * stored, also when an error cuts the read short. Each indirect block is
+ * read once into scratch, and each run of blocks that is contiguous on
+ * disk is fetched with one pread straight into buf.
+ */
+int ext2r_pread(const ext2r_fs_t *fs, const ext2_inode_t *inode, void *buf, size_t count,
+                uint64_t offset, size_t *done, void *scratch) {
+    uint32_t block_size = fs->block_size;
+    uint64_t size = ext2r_inode_size(fs, inode);
+    uint8_t *out = (uint8_t *)buf;
+    ext2r_map_t map;
+    
+    memset(&map, 0, sizeof(map));
+    *done = 0;
+    if (offset >= size) {
+        return EXT2R_OK;
+    }
+    if (count > size - offset) {
+        count = (size_t)(size - offset);
+    }
+    
+    while (*done < count) {
+        uint64_t pos = offset + *done;
+        uint32_t logical = (uint32_t)(pos / block_size);
+        uint32_t within = (uint32_t)(pos % block_size);
+        uint64_t wanted = (within + (uint64_t)(count - *done) + block_size - 1) / block_size;
+        
+        uint32_t physical;
+        uint64_t hole_run;
+        int err = ext2r_map(fs, inode, &map, (uint8_t *)scratch, logical, &physical, &hole_run);
+        if (err != EXT2R_OK) {
+            return err;
+        }
+        
+        /* Extend the run while the next block continues it */
+        uint64_t run = (physical == 0) ? hole_run : 1;
+        while (run < wanted) {
+            uint32_t next;
+            uint64_t next_hole;
+            err = ext2r_map(fs, inode, &map, (uint8_t *)scratch, logical + (uint32_t)run,
+                            &next, &next_hole);
+            if (err != EXT2R_OK) {
+                return err;
+            }
+            if (physical == 0 && next == 0) {
+                run += next_hole;
+            } else if (physical != 0 && next == physical + run) {
+                run++;
+            } else {
+                break;
+            }
+        }
+        
+        size_t n = (run * block_size - within > count - *done) ? count - *done
+                                                               : (size_t)(run * block_size - within);
+        
+        if (physical == 0) {
+            memset(out + *done, 0, n);
+        } else if ((uint64_t)physical + run > fs->sb.s_blocks_count) {
+            return EXT2R_ECORRUPT;
+        } else {
+            err = ext2r_pread_full(fs->fd, out + *done, n,
+                                   (off_t)physical * block_size + within);
+            if (err != EXT2R_OK) {
+                return err;
+            }
+        }
+        *done += n;
+    }
+    
+    return EXT2R_OK;
+}
+
+/*
+ * Reads the target of a symbolic link into buf, NUL-terminated and
+ * truncated to fit, and sets *len to its length. Short targets are
+ * stored in i_block itself.
+ */
+int ext2r_readlink(const ext2r_fs_t *fs, const ext2_inode_t *inode, char *buf, size_t size,
+                   size_t *len, void *scratch) {
+    uint64_t length = ext2r_inode_size(fs, inode);
+    
+    if ((inode->i_mode & EXT2_S_IFMT) != EXT2_S_IFLNK || size == 0) {
+        return EXT2R_EINVAL;
+    }
+    if (length > size - 1) {
+        length = size - 1;
+    }
+    
+    if (ext2r_fast_symlink(&fs->sb, inode) && length <= sizeof(inode->i_block)) {
+        memcpy(buf, inode->i_block, (size_t)length);
+    } else {
+        size_t n;
+        int err = ext2r_pread(fs, inode, buf, (size_t)length, 0, &n, scratch);
+        if (err != EXT2R_OK) {
+            return err;
+        }
+        length = n;
+    }
+    
+    buf[length] = '\0';
+    *len = (size_t)length;
+    return EXT2R_OK;
+}
+
+/*
+ * Decodes the next live entry of a directory block at or after *offset
+ * and moves *offset past it. Returns 0 at the end of the block; a
+ * corrupt record also ends the block.
+ */
+int ext2r_dirent_parse(const uint8_t *data, uint32_t block_size, uint32_t *offset,
+                       ext2r_dirent_t *ent) {
+    while (*offset + sizeof(ext2_dir_entry_t) <= block_size) {
+        const ext2_dir_entry_t *entry = (const ext2_dir_entry_t *)(data + *offset);
+        
+        if (entry->rec_len < sizeof(ext2_dir_entry_t) || *offset + entry->rec_len > block_size) {
+            break;
+        }
+        *offset += entry->rec_len;
+        
+        if (entry->inode != 0) {
+            size_t max_name_len = entry->rec_len - sizeof(ext2_dir_entry_t);
+            ent->ino = entry->inode;
+            ent->file_type = entry->file_type;
+            ent->name = (const char *)(entry + 1);
+            ent->name_len = entry->name_len < max_name_len ? entry->name_len : max_name_len;
+            return 1;
+        }
+    }
+    
+    *offset = block_size;
+    return 0;
+}
+
+/*
+ * Scans one directory block for a name. Returns its inode number or 0.
+ */
+uint32_t ext2r_block_find(const uint8_t *data, uint32_t block_size, const char *name,
+                          size_t name_len) {
+    ext2r_dirent_t ent;
+    uint32_t offset = 0;
+    
+    while (ext2r_dirent_parse(data, block_size, &offset, &ent)) {
+        if (ent.name_len == name_len && memcmp(ent.name, name, name_len) == 0) {
+            return ent.ino;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Starts iterating over a directory. The first four blocks of scratch
+ * hold the current directory block and the block map's indirect blocks;
+ * inode must stay valid until the iteration ends.
+ */
+int ext2r_dir_open(ext2r_dir_t *dir, const ext2r_fs_t *fs, const ext2_inode_t *inode,
+                   void *scratch) {
+    if ((inode->i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR) {
+        return EXT2R_ENOTDIR;
+    }
+    
+    memset(dir, 0, sizeof(*dir));
+    dir->fs = fs;
+    dir->inode = inode;
+    dir->block_size = fs->block_size;
+    dir->block = (uint8_t *)scratch;
+    dir->ind_buf = dir->block + fs->block_size;
+    dir->nblocks = (uint32_t)((inode->i_size + fs->block_size - 1) / fs->block_size);
+    dir->offset = fs->block_size;
+    return EXT2R_OK;
+}
+
+/*
+ * Fetches the next entry. Returns 1 with ent filled in, 0 at the end of
+ * the directory or a negative error code.
+ */
+int ext2r_dir_next(ext2r_dir_t *dir, ext2r_dirent_t *ent) {
+    for (;;) {
+        if (ext2r_dirent_parse(dir->block, dir->block_size, &dir->offset, ent)) {
+            return 1;
+        }
+        if (dir->lblk >= dir->nblocks) {
+            return 0;
+        }
+        
+        uint32_t physical;
+        uint64_t hole_run;
+        int err = ext2r_map(dir->fs, dir->inode, &dir->map, dir->ind_buf, dir->lblk, &physical,
+                            &hole_run);
+        if (err != EXT2R_OK) {
+            return err;
+        }
+        if (physical == 0) {
+            /* Holes in a directory hold no entries */
+            dir->lblk = (hole_run < dir->nblocks - dir->lblk) ? dir->lblk + (uint32_t)hole_run
+                                                              : dir->nblocks;
+            continue;
+        }
+        dir->lblk++;
+        err = ext2r_read_block(dir->fs, physical, dir->block);
+        if (err != EXT2R_OK) {
+            return err == EXT2R_EINVAL ? EXT2R_ECORRUPT : err;
+        }
+        dir->offset = 0;
+    }
+}
+
+#define EXT2R_ROL32(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+
+/*
+ * The original ext3 directory hash
+ */
+static uint32_t ext2r_dx_hack_hash(const char *name, size_t len, int is_unsigned) {
+    uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+    
+    for (size_t i = 0; i < len; i++) {
+        int c = is_unsigned ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+        hash = hash1 + (hash0 ^ (uint32_t)(c * 7152373));
+        if (hash & 0x80000000) {
+            hash -= 0x7fffffff;
+        }
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+/*
+ * Packs up to num words of a name into buf, padding with the length the
+ * way the kernel does
+ */
+static void ext2r_dx_str2hashbuf(const char *msg, size_t len, uint32_t *buf, int num,
+                                 int is_unsigned) {
+    uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+    pad |= pad << 16;
+    
+    uint32_t val = pad;
+    if (len > (size_t)num * 4) {
+        len = (size_t)num * 4;
+    }
+    for (size_t i = 0; i < len; i++) {
+        int c = is_unsigned ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+        val = (uint32_t)c + (val << 8);
+        if ((i % 4) == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    if (--num >= 0) {
+        *buf++ = val;
+    }
+    while (--num >= 0) {
+        *buf++ = pad;
+    }
+}
+
+/*
+ * Three reduced rounds of MD4 over eight words of input
+ */
+static void ext2r_dx_half_md4(uint32_t buf[4], const uint32_t in[8]) {
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+    const uint32_t k2 = 013240474631U, k3 = 015666365641U;
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = EXT2R_ROL32(a, s))
+    ROUND(F, a, b, c, d, in[0], 3);
+    ROUND(F, d, a, b, c, in[1], 7);
+    ROUND(F, c, d, a, b, in[2], 11);
+    ROUND(F, b, c, d, a, in[3], 19);
+    ROUND(F, a, b, c, d, in[4], 3);
+    ROUND(F, d, a, b, c, in[5], 7);
+    ROUND(F, c, d, a, b, in[6], 11);
+    ROUND(F, b, c, d, a, in[7], 19);
+    
+    ROUND(G, a, b, c, d, in[1] + k2, 3);
+    ROUND(G, d, a, b, c, in[3] + k2, 5);
+    ROUND(G, c, d, a, b, in[5] + k2, 9);
+    ROUND(G, b, c, d, a, in[7] + k2, 13);
+    ROUND(G, a, b, c, d, in[0] + k2, 3);
+    ROUND(G, d, a, b, c, in[2] + k2, 5);
+    ROUND(G, c, d, a, b, in[4] + k2, 9);
+    ROUND(G, b, c, d, a, in[6] + k2, 13);
+    
+    ROUND(H, a, b, c, d, in[3] + k3, 3);
+    ROUND(H, d, a, b, c, in[7] + k3, 9);
+    ROUND(H, c, d, a, b, in[2] + k3, 11);
+    ROUND(H, b, c, d, a, in[6] + k3, 15);
+    ROUND(H, a, b, c, d, in[1] + k3, 3);
+    ROUND(H, d, a, b, c, in[5] + k3, 9);
+    ROUND(H, c, d, a, b, in[0] + k3, 11);
+    ROUND(H, b, c, d, a, in[4] + k3, 15);
+#undef ROUND
+#undef H
+#undef G
+#undef F
+    
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+/*
+ * Sixteen rounds of TEA over four words of input
+ */
+static void ext2r_dx_tea(uint32_t buf[4], const uint32_t in[4]) {
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    
+    for (int n = 0; n < 16; n++) {
+        sum += 0x9E3779B9;
+        b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+        b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+    }
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+/*
+ * Computes the HTree hash of a name. Returns EXT2R_EINVAL for unknown
+ * hash versions.
+ */
+int ext2r_dx_hash(const ext2_superblock_t *sb, int version, const char *name, size_t len,
+                  uint32_t *out) {
+    uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    uint32_t in[8];
+    uint32_t hash;
+    const uint32_t *seed = sb->s_hash_seed;
+    
+    if (seed[0] || seed[1] || seed[2] || seed[3]) {
+        memcpy(buf, seed, sizeof(buf));
+    }
+    
+    int is_unsigned = version >= EXT2_HASH_LEGACY_UNSIGNED;
+    switch (version) {
+    case EXT2_HASH_LEGACY:
+    case EXT2_HASH_LEGACY_UNSIGNED:
+        hash = ext2r_dx_hack_hash(name, len, is_unsigned);
+        break;
+    case EXT2_HASH_HALF_MD4:
+    case EXT2_HASH_HALF_MD4_UNSIGNED:
+        for (size_t off = 0; off < len; off += 32) {
+            ext2r_dx_str2hashbuf(name + off, len - off, in, 8, is_unsigned);
+            ext2r_dx_half_md4(buf, in);
+        }
+        hash = buf[1];
+        break;
+    case EXT2_HASH_TEA:
+    case EXT2_HASH_TEA_UNSIGNED:
+        for (size_t off = 0; off < len; off += 16) {
+            ext2r_dx_str2hashbuf(name + off, len - off, in, 4, is_unsigned);
+            ext2r_dx_tea(buf, in);
+        }
+        hash = buf[0];
+        break;
+    default:
+        return EXT2R_EINVAL;
+    }
+    
+    hash &= ~1U;
+    if (hash == (0x7fffffffU << 1)) {
+        hash = (0x7fffffffU - 1) << 1;
+    }
+    *out = hash;
+    return EXT2R_OK;
+}
+
+/* One level of an HTree descent */
+typedef struct {
+    const ext2_dx_entry_t *entries;
+    const ext2_dx_entry_t *at;
+    uint16_t count;
+    uint8_t *buf;
+} ext2r_dx_frame_t;
+
+/*
+ * Validates the count/limit header of an index block and fills a frame
+ */
+static int ext2r_dx_frame(ext2r_dx_frame_t *frame, const uint8_t *data, uint32_t offset,
+                          uint32_t block_size) {
+    const ext2_dx_countlimit_t *cl = (const ext2_dx_countlimit_t *)(data + offset);
+    uint32_t room = (block_size - offset) / sizeof(ext2_dx_entry_t);
+    
+    if (cl->count == 0 || cl->count > cl->limit || cl->limit > room) {
+        return -1;
+    }
+    frame->entries = (const ext2_dx_entry_t *)cl;
+    frame->count = cl->count;
+    return 0;
+}
+
+/*
+ * Looks a name up through a directory's HTree index: binary search down
+ * the index blocks, then a scan of the one leaf the hash selects. When
+ * the following leaf continues the same hash, it is scanned too. Blocks
+ * come from read, which may use the four blocks at bufs. Sets *ino to
+ * the inode number or 0 when absent; returns EXT2R_EBADINDEX when the
+ * index cannot be used and the directory has to be scanned instead.
+ */
+int ext2r_dx_find(const ext2_superblock_t *sb, ext2r_dir_read_fn read, void *ctx,
+                  uint8_t *bufs, const char *name, size_t name_len, uint32_t *ino) {
+    uint32_t block_size = 1024U << sb->s_log_block_size;
+    uint8_t *leaf_buf = bufs + (size_t)block_size * 3;
+    ext2r_dx_frame_t frames[3];
+    int levels;
+    uint32_t hash;
+    
+    /* The root sits in block 0, behind the "." and ".." entries */
+    const uint8_t *data = read(ctx, 0, bufs);
+    if (!data) {
+        return EXT2R_EBADINDEX;
+    }
+    const ext2_dx_root_info_t *info = (const ext2_dx_root_info_t *)(data + 24);
+    int version = info->hash_version;
+    if (version <= EXT2_HASH_TEA && (sb->s_flags & EXT2_FLAGS_UNSIGNED_HASH)) {
+        version += EXT2_HASH_LEGACY_UNSIGNED;
+    }
+    levels = info->indirect_levels;
+    if (info->reserved_zero != 0 || info->info_length < 8 || levels > 2 ||
+        ext2r_dx_frame(&frames[0], data, 24 + info->info_length, block_size) != 0 ||
+        ext2r_dx_hash(sb, version, name, name_len, &hash) != EXT2R_OK) {
+        return EXT2R_EBADINDEX;
+    }
+    frames[0].buf = bufs;
+    
+    /* Descend, picking the last entry whose hash is <= ours */
+    for (int level = 0; ; level++) {
+        ext2r_dx_frame_t *f = &frames[level];
+        uint32_t lo = 1, hi = f->count;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (f->entries[mid].hash > hash) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        f->at = &f->entries[lo - 1];
+        if (level == levels) {
+            break;
+        }
+        
+        ext2r_dx_frame_t *child = &frames[level + 1];
+        child->buf = bufs + (size_t)block_size * (level + 1);
+        data = read(ctx, f->at->block & 0x0fffffff, child->buf);
+        if (!data || ext2r_dx_frame(child, data, 8, block_size) != 0) {
+            return EXT2R_EBADINDEX;
+        }
+    }
+    
+    for (;;) {
+        data = read(ctx, frames[levels].at->block & 0x0fffffff, leaf_buf);
+        if (!data) {
+            return EXT2R_EBADINDEX;
+        }
+        *ino = ext2r_block_find(data, block_size, name, name_len);
+        if (*ino != 0) {
+            return EXT2R_OK;
+        }
+        
+        /* Step to the next leaf; only worth it if it continues our hash */
+        int level = levels;
+        while (level >= 0 && frames[level].at + 1 == frames[level].entries + frames[level].count) {
+            level--;
+        }
+        if (level < 0) {
+            return EXT2R_OK;
+        }
+        frames[level].at++;
+        uint32_t next_hash = frames[level].at->hash;
+        if ((next_hash & 1) == 0 || (next_hash & ~1U) != hash) {
+            return EXT2R_OK;
+        }
+        for (; level < levels; level++) {
+            ext2r_dx_frame_t *child = &frames[level + 1];
+            data = read(ctx, frames[level].at->block & 0x0fffffff, child->buf);
+            if (!data || ext2r_dx_frame(child, data, 8, block_size) != 0) {
+                return EXT2R_EBADINDEX;
+            }
+            child->at = child->entries;
+        }
+    }
+}
+
+/*
+ * Reads logical block lblk of the directory in an ext2r_dx_ctx_t
+ */
+static const uint8_t *ext2r_dx_read(void *ctx, uint32_t lblk, uint8_t *buf) {
+    ext2r_dx_ctx_t *dx = (ext2r_dx_ctx_t *)ctx;
+    uint32_t block_num;
+    uint64_t hole_run;
+    
+    if (ext2r_map(dx->fs, dx->inode, &dx->map, dx->ind_buf, lblk, &block_num, &hole_run) != 0 ||
+        block_num == 0 || ext2r_read_block(dx->fs, block_num, buf) != EXT2R_OK) {
+        return NULL;
+    }
+    return buf;
+}
+
+/*
+ * Looks up one name in a directory, through its HTree index when it has
+ * a usable one and by scanning its blocks otherwise
+ */
+int ext2r_lookup(const ext2r_fs_t *fs, uint32_t dir_ino, const char *name, size_t name_len,
+                 uint32_t *ino, void *scratch) {
+    ext2_inode_t inode;
+    uint8_t *bufs = (uint8_t *)scratch;
+    
+    if (name_len > EXT2_NAME_LEN) {
+        return EXT2R_ENAMETOOLONG;
+    }
+    int err = ext2r_read_inode(fs, dir_ino, &inode);
+    if (err != EXT2R_OK) {
+        return err;
+    }
+    if ((inode.i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR) {
+        return EXT2R_ENOTDIR;
+    }
+    
+    err = EXT2R_EBADINDEX;
+    if ((inode.i_flags & EXT2_INDEX_FL) &&
+        (fs->sb.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)) {
+        ext2r_dx_ctx_t dx;
+        memset(&dx, 0, sizeof(dx));
+        dx.fs = fs;
+        dx.inode = &inode;
+        dx.ind_buf = bufs + (size_t)fs->block_size * 4;
+        err = ext2r_dx_find(&fs->sb, ext2r_dx_read, &dx, bufs, name, name_len, ino);
+    }
+    if (err == EXT2R_EBADINDEX) {
+        ext2r_dir_t dir;
+        ext2r_dirent_t ent;
+        
+        *ino = 0;
+        ext2r_dir_open(&dir, fs, &inode, scratch);
+        while ((err = ext2r_dir_next(&dir, &ent)) > 0) {
+            if (ent.name_len == name_len && memcmp(ent.name, name, name_len) == 0) {
+                *ino = ent.ino;
+                break;
+            }
+        }
+        if (err < 0) {
+            return err;
+        }
+    } else if (err != EXT2R_OK) {
+        return err;
+    }
+    
+    return *ino != 0 ? EXT2R_OK : EXT2R_ENOENT;
+}
+
+/*
+ * Walks an absolute path from the root directory, in place and without
+ * copying it
+ */
+int ext2r_resolve(const ext2r_fs_t *fs, const char *path, uint32_t *ino, void *scratch) {
+    uint32_t current = EXT2_ROOT_INODE;
+    const char *p = path;
+    
+    while (*p) {
+        while (*p == '/') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        
+        const char *component = p;
+        while (*p && *p != '/') {
+            p++;
+        }
+        
+        int err = ext2r_lookup(fs, current, component, (size_t)(p - component), &current,
+                               scratch);
+        if (err != EXT2R_OK) {
+            return err;
+        }
+    }
+    
+    *ino = current;
+    return EXT2R_OK;
+}
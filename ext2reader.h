@@ -0,0 +1,131 @@
+#ifndef EXT2READER_H
+#define EXT2READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "ext2.h"
+
+/*
+ * libext2reader: the reentrant core of the reader, for embedding.
+ *
+ * Everything goes through an ext2r_fs_t returned by ext2r_open. The image
+ * is only ever read with pread, nothing is printed and there is no global
+ * state, so one handle can be shared by any number of threads as long as
+ * each of them passes its own scratch buffer. Memory is only allocated by
+ * ext2r_open, through the caller's allocator when one is given. Failures
+ * come back as the negative EXT2R_E* codes below; after EXT2R_EIO errno
+ * still holds the cause.
+ */
+
+/* Error codes, always negative */
+#define EXT2R_OK 0
+#define EXT2R_EIO -1                    /* Reading the image failed; see errno */
+#define EXT2R_EBADFS -2                 /* Not an ext2 image, or its geometry is invalid */
+#define EXT2R_ENOMEM -3                 /* The allocator returned NULL */
+#define EXT2R_ENOENT -4                 /* No such file or directory */
+#define EXT2R_ENOTDIR -5                /* A path component is not a directory */
+#define EXT2R_EINVAL -6                 /* Argument out of range */
+#define EXT2R_ECORRUPT -7               /* Metadata points outside the image */
+#define EXT2R_ENAMETOOLONG -8           /* Path component longer than EXT2_NAME_LEN */
+#define EXT2R_EBADINDEX -9              /* HTree index unusable; scan the directory */
+
+/* Blocks of scratch space each calling thread needs; see ext2r_scratch_size */
+#define EXT2R_SCRATCH_BLOCKS 7
+
+/* Where the library gets its memory; ctx is passed back on every call */
+typedef struct {
+    void *(*alloc)(void *ctx, size_t size);
+    void (*free)(void *ctx, void *ptr);
+    void *ctx;
+} ext2r_allocator_t;
+
+/* An open image; read-only once ext2r_open returns */
+typedef struct ext2r_fs ext2r_fs_t;
+
+/* A directory entry: the name points into the caller's scratch buffer
+ * and is not NUL-terminated */
+typedef struct {
+    uint32_t ino;
+    uint8_t file_type;
+    const char *name;
+    size_t name_len;
+} ext2r_dirent_t;
+
+/* Indirect blocks a block map walk keeps, one per tree depth; zero it
+ * before the first walk over an inode */
+typedef struct {
+    const uint32_t *ind[3];             /* Pointers of the cached blocks, or NULL */
+    uint32_t ind_num[3];                /* Which block each depth holds */
+} ext2r_map_t;
+
+/* Fetches indirect block block_num, met at depth, for ext2r_map_walk and
+ * returns its pointers or NULL. next follows block_num in its parent (0
+ * at the top or the end), for loaders that want to prefetch it. */
+typedef const uint32_t *(*ext2r_ind_read_fn)(void *ctx, int depth, uint32_t block_num,
+                                             uint32_t next);
+
+/* Streaming iterator over a directory, living in the caller's memory */
+typedef struct {
+    const ext2r_fs_t *fs;
+    const ext2_inode_t *inode;
+    uint8_t *block;                     /* Current directory block */
+    uint8_t *ind_buf;                   /* Backing store for the map's blocks */
+    ext2r_map_t map;
+    uint32_t lblk;                      /* Next logical block to read */
+    uint32_t nblocks;                   /* Blocks in the directory */
+    uint32_t offset;                    /* Next entry within block */
+    uint32_t block_size;
+} ext2r_dir_t;
+
+/* Reads logical block lblk of a directory for ext2r_dx_find, into buf or
+ * anywhere else it likes. Returns the data or NULL. */
+typedef const uint8_t *(*ext2r_dir_read_fn)(void *ctx, uint32_t lblk, uint8_t *buf);
+
+const char *ext2r_strerror(int err);
+
+int ext2r_open(const char *img_path, const ext2r_allocator_t *alloc, ext2r_fs_t **out);
+int ext2r_open_fd(int fd, const ext2r_allocator_t *alloc, ext2r_fs_t **out);
+void ext2r_close(ext2r_fs_t *fs);
+
+const ext2_superblock_t *ext2r_superblock(const ext2r_fs_t *fs);
+uint32_t ext2r_block_size(const ext2r_fs_t *fs);
+size_t ext2r_scratch_size(const ext2r_fs_t *fs);
+
+int ext2r_read_block(const ext2r_fs_t *fs, uint32_t block_num, void *buf);
+int ext2r_read_inode(const ext2r_fs_t *fs, uint32_t ino, ext2_inode_t *inode);
+uint64_t ext2r_inode_size(const ext2r_fs_t *fs, const ext2_inode_t *inode);
+int ext2r_bmap(const ext2r_fs_t *fs, const ext2_inode_t *inode, uint32_t logical,
+               uint32_t *physical, void *scratch);
+int ext2r_pread(const ext2r_fs_t *fs, const ext2_inode_t *inode, void *buf, size_t count,
+                uint64_t offset, size_t *done, void *scratch);
+int ext2r_readlink(const ext2r_fs_t *fs, const ext2_inode_t *inode, char *buf, size_t size,
+                   size_t *len, void *scratch);
+
+int ext2r_dir_open(ext2r_dir_t *dir, const ext2r_fs_t *fs, const ext2_inode_t *inode,
+                   void *scratch);
+int ext2r_dir_next(ext2r_dir_t *dir, ext2r_dirent_t *ent);
+
+int ext2r_lookup(const ext2r_fs_t *fs, uint32_t dir_ino, const char *name, size_t name_len,
+                 uint32_t *ino, void *scratch);
+int ext2r_resolve(const ext2r_fs_t *fs, const char *path, uint32_t *ino, void *scratch);
+
+/* Format helpers that need no handle; the myfs tool is built on these too */
+int ext2r_read_superblock(int fd, ext2_superblock_t *sb);
+int ext2r_read_group_descs(int fd, const ext2_superblock_t *sb, ext2_group_desc_t *descs,
+                           uint32_t count);
+uint32_t ext2r_group_count(const ext2_superblock_t *sb);
+int ext2r_fast_symlink(const ext2_superblock_t *sb, const ext2_inode_t *inode);
+int ext2r_map_walk(ext2r_map_t *map, const uint32_t i_block[15], uint32_t ptrs_per_block,
+                   uint32_t logical, uint32_t *physical, uint64_t *hole_run,
+                   ext2r_ind_read_fn read, void *ctx);
+int ext2r_dirent_parse(const uint8_t *data, uint32_t block_size, uint32_t *offset,
+                       ext2r_dirent_t *ent);
+uint32_t ext2r_block_find(const uint8_t *data, uint32_t block_size, const char *name,
+                          size_t name_len);
+int ext2r_dx_hash(const ext2_superblock_t *sb, int version, const char *name, size_t len,
+                  uint32_t *out);
+int ext2r_dx_find(const ext2_superblock_t *sb, ext2r_dir_read_fn read, void *ctx,
+                  uint8_t *bufs, const char *name, size_t name_len, uint32_t *ino);
+
+#endif
@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ext2reader.h"
+
+/*
+ * Test driver for libext2reader, linked against the library alone:
+ *
+ *   ext2reader_test <image> cat <path>   file contents to stdout
+ *   ext2reader_test <image> ls <path>    one "inode type name" line per entry
+ *   ext2reader_test <image> readlink <path>   symbolic link target
+ *
+ * cat reads in pieces of changing, odd sizes so that reads start and end
+ * inside blocks and cross indirect block boundaries.
+ */
+
+/*
+ * Writes the contents of inode to stdout with ext2r_pread.
+ */
+static int test_cat(const ext2r_fs_t *fs, const ext2_inode_t *inode, void *scratch) {
+    uint64_t size = ext2r_inode_size(fs, inode);
+    uint64_t offset = 0;
+    size_t piece = 1;
+    char *buf = malloc(1 << 20);
+    
+    if (buf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    
+    while (offset < size) {
+        size_t done;
+        int err = ext2r_pread(fs, inode, buf, piece, offset, &done, scratch);
+        if (err != EXT2R_OK) {
+            fprintf(stderr, "Read at offset %llu: %s\n", (unsigned long long)offset,
+                    ext2r_strerror(err));
+            free(buf);
+            return -1;
+        }
+        if (done == 0 || fwrite(buf, 1, done, stdout) != done) {
+            fprintf(stderr, "Read at offset %llu came back short\n", (unsigned long long)offset);
+            free(buf);
+            return -1;
+        }
+        offset += done;
+        piece = (piece * 3 + 7) % ((1 << 20) - 1) + 1;
+    }
+    
+    free(buf);
+    return 0;
+}
+
+/*
+ * Lists the directory with ext2r_dir_next.
+ */
+static int test_ls(const ext2r_fs_t *fs, const ext2_inode_t *inode, void *scratch) {
+    ext2r_dir_t dir;
+    ext2r_dirent_t ent;
+    int err = ext2r_dir_open(&dir, fs, inode, scratch);
+    
+    while (err == EXT2R_OK && (err = ext2r_dir_next(&dir, &ent)) == 1) {
+        printf("%u %u %.*s\n", ent.ino, ent.file_type, (int)ent.name_len, ent.name);
+        err = EXT2R_OK;
+    }
+    if (err < 0) {
+        fprintf(stderr, "Listing failed: %s\n", ext2r_strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Prints the target of a symbolic link.
+ */
+static int test_readlink(const ext2r_fs_t *fs, const ext2_inode_t *inode, void *scratch) {
+    char target[4096];
+    size_t len;
+    int err = ext2r_readlink(fs, inode, target, sizeof(target), &len, scratch);
+    
+    if (err != EXT2R_OK) {
+        fprintf(stderr, "Reading the link failed: %s\n", ext2r_strerror(err));
+        return -1;
+    }
+    printf("%s\n", target);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    ext2r_fs_t *fs;
+    ext2_inode_t inode;
+    uint32_t ino;
+    void *scratch;
+    int err;
+    int ret;
+    
+    if (argc != 4 || (strcmp(argv[2], "cat") != 0 && strcmp(argv[2], "ls") != 0 &&
+                      strcmp(argv[2], "readlink") != 0)) {
+        fprintf(stderr, "Usage: %s <image> cat|ls|readlink <path>\n", argv[0]);
+        return 2;
+    }
+    
+    err = ext2r_open(argv[1], NULL, &fs);
+    if (err != EXT2R_OK) {
+        fprintf(stderr, "%s: %s\n", argv[1], ext2r_strerror(err));
+        return 1;
+    }
+    scratch = malloc(ext2r_scratch_size(fs));
+    if (scratch == NULL) {
+        perror("malloc");
+        ext2r_close(fs);
+        return 1;
+    }
+    
+    err = ext2r_resolve(fs, argv[3], &ino, scratch);
+    if (err == EXT2R_OK) {
+        err = ext2r_read_inode(fs, ino, &inode);
+    }
+    if (err != EXT2R_OK) {
+        fprintf(stderr, "%s: %s\n", argv[3], ext2r_strerror(err));
+        ret = -1;
+    } else if (strcmp(argv[2], "cat") == 0) {
+        ret = test_cat(fs, &inode, scratch);
+    } else if (strcmp(argv[2], "ls") == 0) {
+        ret = test_ls(fs, &inode, scratch);
+    } else {
+        ret = test_readlink(fs, &inode, scratch);
+    }
+    
+    free(scratch);
+    ext2r_close(fs);
+    if (fflush(stdout) != 0) {
+        perror("stdout");
+        ret = -1;
+    }
+    return ret == 0 ? 0 : 1;
+}
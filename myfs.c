@@ -1,48 +1,118 @@
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include "ext2.h"
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <fnmatch.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "myfs.h"
 
+/* Size of each read kept in flight by the io_uring copy engine */
+#define EXT2_URING_CHUNK (256 * 1024)
+
+/* Minimal io_uring instance driven through the raw system calls */
 typedef struct {
-    int fd;                             /* File descriptor for disk image */
-    ext2_superblock_t superblock;      /* Superblock */
-    ext2_group_desc_t *group_descs;    /* Group descriptors */
-    int num_groups;                     /* Number of block groups */
-} ext2_fs_t;
-
-/* Function prototypes */
-int ext2_open(const char *img_path, ext2_fs_t *fs);
-void ext2_close(ext2_fs_t *fs);
-int ext2_read_superblock(ext2_fs_t *fs);
-int ext2_read_group_descriptors(ext2_fs_t *fs);
-int ext2_read_inode(ext2_fs_t *fs, uint32_t ino, ext2_inode_t *inode);
-int ext2_read_block(ext2_fs_t *fs, uint32_t block_num, void *buffer);
-int ext2_ls(ext2_fs_t *fs, const char *path);
-int ext2_cp(ext2_fs_t *fs, const char *src, const char *dst);
-uint32_t ext2_find_inode(ext2_fs_t *fs, const char *path);
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} ext2_uring_t;
+
+/* Command line front end */
+int run_command(ext2_fs_t *fs, const char *prog, int argc, char *argv[]);
+int run_batch(ext2_fs_t *fs, const char *prog, const char *script);
+
+/*
+ * Prints the superblock summary shown when an image is opened
+ */
+static void ext2_print_superblock(const ext2_fs_t *fs) {
+    int block_size = 1024 << fs->superblock.s_log_block_size;
+    
+    printf("EXT2 Filesystem loaded successfully\n");
+    printf("s_log_block_size: %u\n", fs->superblock.s_log_block_size);
+    printf("Block size: %u bytes\n", block_size);
+    printf("Total inodes: %u\n", fs->superblock.s_inodes_count);
+    printf("Total blocks: %u\n", fs->superblock.s_blocks_count);
+}
 
 /*
  * Opens the EXT2 disk image
+ * With EXT2_OPEN_MMAP the whole image is mapped read-only so block and
+ * inode accesses become pointer arithmetic; if the mapping cannot be
+ * created we silently fall back to pread.
  */
-int ext2_open(const char *img_path, ext2_fs_t *fs) {
+int ext2_open(const char *img_path, ext2_fs_t *fs, int flags) {
+    fs->group_descs = NULL;
+    fs->map = NULL;
+    fs->map_size = 0;
+    fs->copy_mode = EXT2_COPY_RANGE;
+    fs->cache = NULL;
+    fs->dcache = NULL;
+    fs->dindex = NULL;
+    fs->index = NULL;
+    fs->uring_depth = 0;
+    fs->readahead_kb = EXT2_READAHEAD_DEFAULT_KB;
+    
     fs->fd = open(img_path, O_RDONLY);
     if (fs->fd < 0) {
         perror("Error opening disk image");
         return -1;
     }
     
+    if (flags & EXT2_OPEN_MMAP) {
+        struct stat st;
+        if (fstat(fs->fd, &st) == 0 && st.st_size > 0) {
+            void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fs->fd, 0);
+            if (map != MAP_FAILED) {
+                fs->map = (uint8_t *)map;
+                fs->map_size = (size_t)st.st_size;
+            }
+        }
+    }
+    
     if (ext2_read_superblock(fs) != 0) {
-        close(fs->fd);
+        ext2_close(fs);
         return -1;
     }
+    if (!(flags & EXT2_OPEN_QUIET)) {
+        ext2_print_superblock(fs);
+    }
     
     if (ext2_read_group_descriptors(fs) != 0) {
-        close(fs->fd);
+        fs->group_descs = NULL;
+        ext2_close(fs);
+        return -1;
+    }
+    
+    /* Metadata lookups jump around the image */
+    ext2_advise(fs, 0, 0, EXT2_ADVISE_RANDOM);
+    
+    if (ext2_dcache_init(fs, EXT2_DCACHE_ENTRIES) != 0) {
+        ext2_close(fs);
         return -1;
     }
     
@@ -53,9 +123,17 @@ int ext2_open(const char *img_path, ext2_fs_t *fs) {
  * Closes the EXT2 disk image
  */
 void ext2_close(ext2_fs_t *fs) {
+    ext2_index_free(fs);
+    ext2_dindex_free(fs);
+    ext2_dcache_free(fs);
+    ext2_cache_free(fs);
     if (fs->group_descs) {
         free(fs->group_descs);
     }
+    if (fs->map) {
+        munmap(fs->map, fs->map_size);
+        fs->map = NULL;
+    }
     if (fs->fd >= 0) {
         close(fs->fd);
     }
@@ -66,12 +144,8 @@ void ext2_close(ext2_fs_t *fs) {
  * Superblock is located at offset 1024 bytes
  */
 int ext2_read_superblock(ext2_fs_t *fs) {
-    if (lseek(fs->fd, 1024, SEEK_SET) != 1024) {
-        perror("Error seeking to superblock");
-        return -1;
-    }
-    
-    if (read(fs->fd, &fs->superblock, sizeof(ext2_superblock_t)) != sizeof(ext2_superblock_t)) {
+    int err = ext2r_read_superblock(fs->fd, &fs->superblock);
+    if (err == EXT2R_EIO) {
         perror("Error reading superblock");
         return -1;
     }
@@ -81,14 +155,10 @@ int ext2_read_superblock(ext2_fs_t *fs) {
         fprintf(stderr, "Invalid EXT2 magic number: 0x%x\n", fs->superblock.s_magic);
         return -1;
     }
-    
-    int block_size = 1024 << fs->superblock.s_log_block_size;
-    
-    printf("EXT2 Filesystem loaded successfully\n");
-    printf("s_log_block_size: %u\n", fs->superblock.s_log_block_size);
-    printf("Block size: %u bytes\n", block_size);
-    printf("Total inodes: %u\n", fs->superblock.s_inodes_count);
-    printf("Total blocks: %u\n", fs->superblock.s_blocks_count);
+    if (err != EXT2R_OK) {
+        fprintf(stderr, "Invalid EXT2 superblock: %s\n", ext2r_strerror(err));
+        return -1;
+    }
     
     return 0;
 }
@@ -97,31 +167,16 @@ int ext2_read_superblock(ext2_fs_t *fs) {
  * Reads block group descriptors
  */
 int ext2_read_group_descriptors(ext2_fs_t *fs) {
-    int block_size = 1024 << fs->superblock.s_log_block_size;
-    int group_desc_size = sizeof(ext2_group_desc_t);
-    
-    /* Calculate number of block groups */
-    fs->num_groups = (fs->superblock.s_blocks_count + fs->superblock.s_blocks_per_group - 1) / 
-                     fs->superblock.s_blocks_per_group;
+    fs->num_groups = ext2r_group_count(&fs->superblock);
     
     /* Allocate space for group descriptors */
-    fs->group_descs = (ext2_group_desc_t *)malloc(fs->num_groups * group_desc_size);
+    fs->group_descs = (ext2_group_desc_t *)malloc(fs->num_groups * sizeof(ext2_group_desc_t));
     if (!fs->group_descs) {
         perror("Error allocating memory for group descriptors");
         return -1;
     }
     
-    /* Group descriptors start at block 1 (after superblock) */
-    uint32_t group_desc_block = (block_size == 1024) ? 2 : 1;
-    
-    if (lseek(fs->fd, group_desc_block * block_size, SEEK_SET) < 0) {
-        perror("Error seeking to group descriptors");
-        free(fs->group_descs);
-        return -1;
-    }
-    
-    ssize_t bytes_read = read(fs->fd, fs->group_descs, fs->num_groups * group_desc_size);
-    if (bytes_read != fs->num_groups * group_desc_size) {
+    if (ext2r_read_group_descs(fs->fd, &fs->superblock, fs->group_descs, fs->num_groups) != 0) {
         perror("Error reading group descriptors");
         free(fs->group_descs);
         return -1;
@@ -131,390 +186,6575 @@ int ext2_read_group_descriptors(ext2_fs_t *fs) {
 }
 
 /*
- * Reads an inode from the disk
+ * Sets up the block cache with room for capacity_mb MiB of blocks. The
+ * mapped backend already gets the page cache for free, so this is a no-op
+ * there, as is a capacity of 0.
  */
-int ext2_read_inode(ext2_fs_t *fs, uint32_t ino, ext2_inode_t *inode) {
-    if (ino < 1 || ino > fs->superblock.s_inodes_count) {
-        fprintf(stderr, "Invalid inode number: %u\n", ino);
-        return -1;
-    }
-    
-    int inode_size = fs->superblock.s_inode_size;
-    int block_size = 1024 << fs->superblock.s_log_block_size;
-    int inodes_per_group = fs->superblock.s_inodes_per_group;
+int ext2_cache_init(ext2_fs_t *fs, uint32_t capacity_mb) {
+    uint32_t block_size = 1024 << fs->superblock.s_log_block_size;
     
-    /* Calculate which group this inode belongs to */
-    int group = (ino - 1) / inodes_per_group;
-    int index_in_group = (ino - 1) % inodes_per_group;
+    if (fs->map || capacity_mb == 0) {
+        return 0;
+    }
     
-    /* Get inode table location from group descriptor */
-    uint32_t inode_table_block = fs->group_descs[group].bg_inode_table;
+    ext2_cache_t *cache = (ext2_cache_t *)calloc(1, sizeof(ext2_cache_t));
+    if (!cache) {
+        perror("Error allocating block cache");
+        return -1;
+    }
     
-    /* Calculate offset */
-    off_t offset = (off_t)inode_table_block * block_size + index_in_group * inode_size;
+    cache->block_size = block_size;
+    cache->capacity = (uint32_t)(((uint64_t)capacity_mb << 20) / block_size);
     
-    if (lseek(fs->fd, offset, SEEK_SET) != offset) {
-        perror("Error seeking to inode");
-        return -1;
+    /* At least one bucket per slot, rounded up to a power of two */
+    uint32_t buckets = 1;
+    while (buckets < cache->capacity) {
+        buckets <<= 1;
     }
+    cache->hash_mask = buckets - 1;
     
-    /* Read the inode - only read the fixed 128-byte part */
-    if (read(fs->fd, inode, 128) != 128) {
-        perror("Error reading inode");
+    /* Block data comes from one pool allocation, never malloc per block */
+    cache->pool = (uint8_t *)malloc((size_t)cache->capacity * block_size);
+    cache->slots = (ext2_cache_slot_t *)malloc(cache->capacity * sizeof(ext2_cache_slot_t));
+    cache->buckets = (int32_t *)malloc(buckets * sizeof(int32_t));
+    if (!cache->pool || !cache->slots || !cache->buckets) {
+        perror("Error allocating block cache");
+        free(cache->pool);
+        free(cache->slots);
+        free(cache->buckets);
+        free(cache);
         return -1;
     }
     
-    /* If the inode is larger than 128 bytes, we need to skip past the extra bytes */
-    /* But for now we only care about the first 128 bytes */
+    memset(cache->buckets, 0xff, buckets * sizeof(int32_t));
+    cache->lru_head = -1;
+    cache->lru_tail = -1;
+    pthread_mutex_init(&cache->lock, NULL);
     
+    fs->cache = cache;
     return 0;
 }
 
 /*
- * Reads a block from the disk
+ * Releases the block cache
  */
+void ext2_cache_free(ext2_fs_t *fs) {
+    ext2_cache_t *cache = fs->cache;
+    if (!cache) {
+        return;
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->pool);
+    free(cache->slots);
+    free(cache->buckets);
+    free(cache);
+    fs->cache = NULL;
+}
+
+static uint32_t ext2_cache_hash(ext2_cache_t *cache, uint32_t block_num) {
+    return (block_num * 2654435761u) & cache->hash_mask;
+}
+
+static void ext2_cache_unlink(ext2_cache_t *cache, int32_t slot) {
+    ext2_cache_slot_t *s = &cache->slots[slot];
+    if (s->lru_prev >= 0) cache->slots[s->lru_prev].lru_next = s->lru_next;
+    else cache->lru_head = s->lru_next;
+    if (s->lru_next >= 0) cache->slots[s->lru_next].lru_prev = s->lru_prev;
+    else cache->lru_tail = s->lru_prev;
+}
+
+static void ext2_cache_push_front(ext2_cache_t *cache, int32_t slot) {
+    ext2_cache_slot_t *s = &cache->slots[slot];
+    s->lru_prev = -1;
+    s->lru_next = cache->lru_head;
+    if (cache->lru_head >= 0) cache->slots[cache->lru_head].lru_prev = slot;
+    cache->lru_head = slot;
+    if (cache->lru_tail < 0) cache->lru_tail = slot;
+}
+
+static void ext2_cache_push_back(ext2_cache_t *cache, int32_t slot) {
+    ext2_cache_slot_t *s = &cache->slots[slot];
+    s->lru_next = -1;
+    s->lru_prev = cache->lru_tail;
+    if (cache->lru_tail >= 0) cache->slots[cache->lru_tail].lru_next = slot;
+    cache->lru_tail = slot;
+    if (cache->lru_head < 0) cache->lru_head = slot;
+}
+
 /*
- * Reads a block from the disk
+ * Returns the cached copy of a block, reading it on a miss. The caller
+ * must hold cache->lock, and the pointer is only valid while it does.
  */
-int ext2_read_block(ext2_fs_t *fs, uint32_t block_num, void *buffer) {
-    int block_size = 1024 << fs->superblock.s_log_block_size;
-    off_t offset = (off_t)block_num * (off_t)block_size;
+static const void *ext2_cache_get(ext2_fs_t *fs, uint32_t block_num) {
+    ext2_cache_t *cache = fs->cache;
+    uint32_t bucket = ext2_cache_hash(cache, block_num);
     
-    if (lseek(fs->fd, offset, SEEK_SET) != offset) {
-        perror("Error seeking to block");
-        return -1;
+    for (int32_t slot = cache->buckets[bucket]; slot >= 0; slot = cache->slots[slot].hash_next) {
+        if (cache->slots[slot].block_num == block_num) {
+            cache->hits++;
+            if (cache->lru_head != slot) {
+                ext2_cache_unlink(cache, slot);
+                ext2_cache_push_front(cache, slot);
+            }
+            return cache->pool + (size_t)slot * cache->block_size;
+        }
     }
     
-    ssize_t bytes_read = read(fs->fd, buffer, block_size);
-    if (bytes_read != block_size) {
+    cache->misses++;
+    
+    /* Take a fresh slot from the pool, or recycle the least recently used */
+    int32_t slot;
+    int fresh = cache->used < cache->capacity;
+    if (fresh) {
+        slot = (int32_t)cache->used++;
+    } else {
+        slot = cache->lru_tail;
+        ext2_cache_unlink(cache, slot);
+        
+        /* A slot whose read failed was never hashed, so it may be missing */
+        int32_t *link = &cache->buckets[ext2_cache_hash(cache, cache->slots[slot].block_num)];
+        while (*link >= 0 && *link != slot) {
+            link = &cache->slots[*link].hash_next;
+        }
+        if (*link == slot) {
+            *link = cache->slots[slot].hash_next;
+        }
+        cache->evictions++;
+    }
+    
+    uint8_t *data = cache->pool + (size_t)slot * cache->block_size;
+    off_t offset = (off_t)block_num * cache->block_size;
+    if (pread(fs->fd, data, cache->block_size, offset) != (ssize_t)cache->block_size) {
         perror("Error reading block");
-        return -1;
+        if (fresh) {
+            cache->used--;
+        } else {
+            /* Keep it on the LRU list, at the end, so it is recycled next */
+            ext2_cache_push_back(cache, slot);
+        }
+        return NULL;
     }
     
-    return 0;
+    cache->slots[slot].block_num = block_num;
+    cache->slots[slot].hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = slot;
+    ext2_cache_push_front(cache, slot);
+    
+    return data;
 }
 
 /*
- * Lists files in a directory (ls implementation)
+ * Copies length bytes at offset within a block out of the cache. The
+ * lock is held across a miss so two threads never read the same block;
+ * only metadata goes through the cache, so this is rarely contended.
  */
-int ext2_ls(ext2_fs_t *fs, const char *path) {
-    uint32_t inode_num = ext2_find_inode(fs, path);
-    if (inode_num == 0) {
-        fprintf(stderr, "Directory not found: %s\n", path);
-        return -1;
+static int ext2_cache_read(ext2_fs_t *fs, uint32_t block_num, size_t offset, size_t length,
+                           void *buffer) {
+    pthread_mutex_lock(&fs->cache->lock);
+    const uint8_t *data = ext2_cache_get(fs, block_num);
+    if (data) {
+        memcpy(buffer, data + offset, length);
     }
+    pthread_mutex_unlock(&fs->cache->lock);
+    return data ? 0 : -1;
+}
+
+/*
+ * Prints block, dentry and directory index cache counters
+ */
+void ext2_cache_report(ext2_fs_t *fs, FILE *out) {
+    ext2_cache_t *cache = fs->cache;
+    ext2_dcache_t *dc = fs->dcache;
+    ext2_dindex_cache_t *dx = fs->dindex;
     
-    ext2_inode_t inode;
-    if (ext2_read_inode(fs, inode_num, &inode) != 0) {
-        return -1;
+    if (dc) {
+        fprintf(out, "Dentry cache: %u of %u entries, %u name bytes\n",
+                dc->count, dc->mask + 1, dc->names_used);
+        fprintf(out, "  hits: %llu  negative hits: %llu  misses: %llu  flushes: %llu\n",
+                (unsigned long long)dc->hits, (unsigned long long)dc->negative_hits,
+                (unsigned long long)dc->misses, (unsigned long long)dc->flushes);
     }
     
-    /* Check if it's a directory */
-    if ((inode.i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR) {
-        fprintf(stderr, "Not a directory: %s\n", path);
-        return -1;
+    if (dx) {
+        fprintf(out, "Directory index: %u directories, %zu of %zu KiB\n",
+                dx->dirs, dx->bytes >> 10, dx->limit >> 10);
+        fprintf(out, "  hits: %llu  builds: %llu  evictions: %llu  oversized: %llu\n",
+                (unsigned long long)dx->hits, (unsigned long long)dx->builds,
+                (unsigned long long)dx->evictions, (unsigned long long)dx->oversized);
     }
     
-    int block_size = 1024 << fs->superblock.s_log_block_size;
-    uint8_t *dir_block = (uint8_t *)malloc(block_size);
-    if (!dir_block) {
-        perror("Error allocating memory for directory block");
-        return -1;
+    if (!cache) {
+        fprintf(out, "Block cache: disabled\n");
+        return;
     }
     
-    printf("Contents of '%s':\n", path);
-    printf("%-30s %-10s %-10s\n", "Name", "Type", "Inode");
-    printf("----------------------------------------------\n");
+    uint64_t lookups = cache->hits + cache->misses;
+    fprintf(out, "Block cache: %u of %u slots used (%u KiB)\n", cache->used, cache->capacity,
+            (uint32_t)(((uint64_t)cache->capacity * cache->block_size) >> 10));
+    fprintf(out, "  hits: %llu  misses: %llu  evictions: %llu  hit rate: %.1f%%\n",
+            (unsigned long long)cache->hits, (unsigned long long)cache->misses,
+            (unsigned long long)cache->evictions,
+            lookups ? 100.0 * cache->hits / lookups : 0.0);
+}
+
+/* Set by ext2_stats_enable before the image is opened, then only read */
+static int stats_enabled;
+static __thread ext2_stats_t *stats_self;
+static ext2_stats_t *stats_list;
+static uint32_t stats_threads;          /* Threads that ever counted anything */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *const stats_names[EXT2_STAT_OPS] = {
+    "block_read", "inode_read", "lookup", "copy"
+};
+
+/*
+ * Turns on the hot path counters for the rest of the process
+ */
+void ext2_stats_enable(void) {
+    stats_enabled = 1;
+}
+
+static uint64_t ext2_stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Starts timing one call; returns 0 without touching the clock when
+ * the counters are off
+ */
+static inline uint64_t ext2_stats_begin(void) {
+    return stats_enabled ? ext2_stats_now() : 0;
+}
+
+/*
+ * Gives the calling thread its own counters on first use. Counters left
+ * by threads that have exited are taken over, so the list only grows to
+ * the most threads ever alive at once, however many pools come and go.
+ */
+static ext2_stats_t *ext2_stats_register(void) {
+    ext2_stats_t *st;
     
-    /* Read directory entries from all data blocks */
-    uint32_t blocks_read = 0;
-    uint32_t dir_size = inode.i_size;
+    pthread_mutex_lock(&stats_lock);
+    st = stats_list;
+    while (st && st->busy) {
+        st = st->next;
+    }
+    if (!st) {
+        st = (ext2_stats_t *)calloc(1, sizeof(ext2_stats_t));
+        if (!st) {
+            pthread_mutex_unlock(&stats_lock);
+            return NULL;  /* Counting is best effort */
+        }
+        st->next = stats_list;
+        stats_list = st;
+    }
+    st->busy = 1;
+    stats_threads++;
+    pthread_mutex_unlock(&stats_lock);
+    stats_self = st;
+    return st;
+}
+
+/*
+ * Hands the calling thread's counters back before it exits; what they
+ * hold is kept for the report
+ */
+static void ext2_stats_release(void) {
+    if (!stats_self) {
+        return;
+    }
+    pthread_mutex_lock(&stats_lock);
+    stats_self->busy = 0;
+    pthread_mutex_unlock(&stats_lock);
+    stats_self = NULL;
+}
+
+/*
+ * Charges a call started at start to op in the calling thread's counters.
+ * Threads never share counters, so no atomics are needed.
+ */
+static inline void ext2_stats_end(int op, uint64_t start, uint64_t bytes, uint32_t blocks) {
+    if (!stats_enabled) {
+        return;
+    }
+    ext2_stats_t *st = stats_self ? stats_self : ext2_stats_register();
+    if (!st) {
+        return;
+    }
     
-    for (int i = 0; i < 12 && blocks_read * block_size < dir_size; i++) {
-        if (inode.i_block[i] == 0) break;
-        
-        if (ext2_read_block(fs, inode.i_block[i], dir_block) != 0) {
-            free(dir_block);
-            return -1;
+    ext2_stat_t *s = &st->ops[op];
+    s->calls++;
+    s->bytes += bytes;
+    s->ns += ext2_stats_now() - start;
+    if (blocks > 0) {
+        int bucket = 0;
+        while ((blocks >>= 1) != 0 && bucket < EXT2_STAT_BUCKETS - 1) {
+            bucket++;
         }
-        
-            /* Parse directory entries */
-            uint32_t offset = 0;
-            while (offset < (uint32_t)block_size && offset < dir_size) {
-                if (offset + sizeof(ext2_dir_entry_t) > (uint32_t)block_size) {
-                    break;  /* Not enough space for even the header */
-                }
-                
-                ext2_dir_entry_t *entry = (ext2_dir_entry_t *)(dir_block + offset);
-                
-                if (entry->rec_len == 0) {
-                    break;  /* Prevent infinite loop */
-                }
-                
-                if (entry->inode == 0) {
-                    offset += entry->rec_len;
-                    continue;
-                }
-                
-                /* Bounds check: name_len should not exceed rec_len - header size */
-                uint16_t max_name_len = entry->rec_len - sizeof(ext2_dir_entry_t);
-                if (entry->name_len > max_name_len) {
-                    entry->name_len = max_name_len;
-                }
-                
-                if (entry->name_len > 255) {
-                    entry->name_len = 255;
-                }
-                
-                char name[256];
-                char *name_ptr = (char *)(entry + 1);  /* Name starts right after the header */
-                strncpy(name, name_ptr, entry->name_len);
-                name[entry->name_len] = '\0';
-            
-            const char *type_str = "unknown";
-            switch (entry->file_type) {
-                case EXT2_FT_REG_FILE: type_str = "file"; break;
-                case EXT2_FT_DIR: type_str = "dir"; break;
-                case EXT2_FT_SYMLINK: type_str = "link"; break;
+        s->blocks[bucket]++;
+    }
+}
+
+/*
+ * Formats the label of a histogram bucket: "1", "2-3", ..., "1024+"
+ */
+static void ext2_stats_bucket_name(int bucket, char *buf, size_t size) {
+    uint32_t lo = 1u << bucket;
+    if (bucket == 0) {
+        snprintf(buf, size, "1");
+    } else if (bucket == EXT2_STAT_BUCKETS - 1) {
+        snprintf(buf, size, "%u+", lo);
+    } else {
+        snprintf(buf, size, "%u-%u", lo, 2 * lo - 1);
+    }
+}
+
+/*
+ * Sums the counters of every thread and prints them as text or JSON.
+ * Call once the worker threads have finished.
+ */
+void ext2_stats_report(FILE *out, int json) {
+    ext2_stat_t total[EXT2_STAT_OPS];
+    int threads;
+    char label[16];
+    memset(total, 0, sizeof(total));
+    
+    pthread_mutex_lock(&stats_lock);
+    threads = (int)stats_threads;
+    for (ext2_stats_t *st = stats_list; st; st = st->next) {
+        for (int op = 0; op < EXT2_STAT_OPS; op++) {
+            total[op].calls += st->ops[op].calls;
+            total[op].bytes += st->ops[op].bytes;
+            total[op].ns += st->ops[op].ns;
+            for (int b = 0; b < EXT2_STAT_BUCKETS; b++) {
+                total[op].blocks[b] += st->ops[op].blocks[b];
             }
-            
-            printf("%-30s %-10s %-10u\n", name, type_str, entry->inode);
-            
-            offset += entry->rec_len;
-            if (entry->rec_len == 0) break;
         }
-        
-        blocks_read++;
     }
+    pthread_mutex_unlock(&stats_lock);
     
-    free(dir_block);
-    return 0;
-}
-
-int ext2_cp(ext2_fs_t *fs, const char *src, const char *dst) {
-    uint32_t inode_num = ext2_find_inode(fs, src);
-    if (inode_num == 0) {
-        fprintf(stderr, "File not found: %s\n", src);
-        return -1;
+    if (json) {
+        fprintf(out, "{\"threads\": %d, \"ops\": {", threads);
+        for (int op = 0; op < EXT2_STAT_OPS; op++) {
+            fprintf(out, "%s\"%s\": {\"calls\": %llu, \"bytes\": %llu, \"ns\": %llu, "
+                    "\"blocks_per_call\": {", op ? ", " : "", stats_names[op],
+                    (unsigned long long)total[op].calls, (unsigned long long)total[op].bytes,
+                    (unsigned long long)total[op].ns);
+            for (int b = 0; b < EXT2_STAT_BUCKETS; b++) {
+                ext2_stats_bucket_name(b, label, sizeof(label));
+                fprintf(out, "%s\"%s\": %llu", b ? ", " : "", label,
+                        (unsigned long long)total[op].blocks[b]);
+            }
+            fprintf(out, "}}");
+        }
+        fprintf(out, "}}\n");
+        return;
     }
     
-    ext2_inode_t inode;
-    if (ext2_read_inode(fs, inode_num, &inode) != 0) {
-        return -1;
+    fprintf(out, "Hot path stats (%d thread%s):\n", threads, threads == 1 ? "" : "s");
+    fprintf(out, "  %-10s %12s %14s %12s %10s %10s\n",
+            "path", "calls", "bytes", "time_ms", "avg_us", "MB/s");
+    for (int op = 0; op < EXT2_STAT_OPS; op++) {
+        const ext2_stat_t *s = &total[op];
+        double secs = (double)s->ns / 1e9;
+        fprintf(out, "  %-10s %12llu %14llu %12.3f %10.3f %10.1f\n", stats_names[op],
+                (unsigned long long)s->calls, (unsigned long long)s->bytes, secs * 1000.0,
+                s->calls ? (double)s->ns / 1000.0 / (double)s->calls : 0.0,
+                secs > 0 ? (double)s->bytes / (1024.0 * 1024.0) / secs : 0.0);
     }
     
-    /* Check if it's a regular file */
-    if ((inode.i_mode & EXT2_S_IFMT) != EXT2_S_IFREG) {
-        fprintf(stderr, "Not a regular file: %s\n", src);
-        return -1;
+    for (int op = 0; op < EXT2_STAT_OPS; op++) {
+        int printed = 0;
+        for (int b = 0; b < EXT2_STAT_BUCKETS; b++) {
+            if (total[op].blocks[b] == 0) {
+                continue;
+            }
+            if (!printed) {
+                fprintf(out, "  %s blocks per call:", stats_names[op]);
+                printed = 1;
+            }
+            ext2_stats_bucket_name(b, label, sizeof(label));
+            fprintf(out, " %s: %llu", label, (unsigned long long)total[op].blocks[b]);
+        }
+        if (printed) {
+            fprintf(out, "\n");
+        }
+    }
+}
+
+/*
+ * Creates the dentry cache with room for the given number of names
+ */
+int ext2_dcache_init(ext2_fs_t *fs, uint32_t entries) {
+    uint32_t slots = 1;
+    while (slots < entries) {
+        slots <<= 1;
     }
     
-    /* Create output file */
-    int out_fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (out_fd < 0) {
-        perror("Error creating output file");
+    ext2_dcache_t *dc = (ext2_dcache_t *)calloc(1, sizeof(ext2_dcache_t));
+    if (!dc) {
+        perror("Error allocating dentry cache");
         return -1;
     }
     
-    int block_size = 1024 << fs->superblock.s_log_block_size;
-    
-    /* Allocate buffer for reading blocks */
-    uint8_t *file_block = (uint8_t *)malloc(block_size);
-    if (!file_block) {
-        perror("Error allocating memory for file block");
-        close(out_fd);
+    dc->entries = (ext2_dentry_t *)calloc(slots, sizeof(ext2_dentry_t));
+    dc->names_size = slots * 32;
+    dc->names = (char *)malloc(dc->names_size);
+    if (!dc->entries || !dc->names) {
+        perror("Error allocating dentry cache");
+        free(dc->entries);
+        free(dc->names);
+        free(dc);
         return -1;
     }
+    dc->mask = slots - 1;
+    pthread_mutex_init(&dc->lock, NULL);
     
-    uint32_t bytes_written = 0;
-    uint32_t file_size = inode.i_size;
+    fs->dcache = dc;
+    return 0;
+}
+
+/*
+ * Releases the dentry cache
+ */
+void ext2_dcache_free(ext2_fs_t *fs) {
+    ext2_dcache_t *dc = fs->dcache;
+    if (!dc) {
+        return;
+    }
+    pthread_mutex_destroy(&dc->lock);
+    free(dc->entries);
+    free(dc->names);
+    free(dc);
+    fs->dcache = NULL;
+}
+
+/*
+ * FNV-1a hash of a directory entry name
+ */
+static uint32_t ext2_name_hash(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t ext2_dcache_slot(uint32_t parent, uint32_t hash) {
+    return (hash ^ (parent * 2654435761u));
+}
+
+/*
+ * Probes the dentry cache. Returns 1 and sets *ino on a hit (0 for a
+ * cached negative entry), 0 on a miss.
+ */
+static int ext2_dcache_lookup(ext2_fs_t *fs, uint32_t parent, uint32_t hash,
+                              const char *name, size_t name_len, uint32_t *ino) {
+    ext2_dcache_t *dc = fs->dcache;
+    if (!dc) {
+        return 0;
+    }
     
-    /* Read direct blocks (first 12 blocks) */
-    for (int i = 0; i < 12 && bytes_written < file_size; i++) {
-        if (inode.i_block[i] == 0) break;
-        
-        if (ext2_read_block(fs, inode.i_block[i], file_block) != 0) {
-            perror("Error reading file block");
-            close(out_fd);
-            free(file_block);
-            return -1;
+    pthread_mutex_lock(&dc->lock);
+    for (uint32_t i = ext2_dcache_slot(parent, hash) & dc->mask; ; i = (i + 1) & dc->mask) {
+        const ext2_dentry_t *d = &dc->entries[i];
+        if (d->parent == 0) {
+            break;
         }
-        
-        /* Calculate how many bytes to write from this block */
-        uint32_t bytes_remaining = file_size - bytes_written;
-        uint32_t bytes_to_write = (bytes_remaining < (uint32_t)block_size) ? bytes_remaining : block_size;
-        
-        if (write(out_fd, file_block, bytes_to_write) != (int)bytes_to_write) {
-            perror("Error writing to output file");
-            close(out_fd);
-            free(file_block);
-            return -1;
+        if (d->parent == parent && d->hash == hash && d->name_len == name_len &&
+            memcmp(dc->names + d->name_off, name, name_len) == 0) {
+            *ino = d->ino;
+            if (d->ino) dc->hits++;
+            else dc->negative_hits++;
+            pthread_mutex_unlock(&dc->lock);
+            return 1;
         }
-        
-        bytes_written += bytes_to_write;
     }
     
-    free(file_block);
-    close(out_fd);
-    
-    printf("File copied: %s -> %s (%u bytes)\n", src, dst, file_size);
+    dc->misses++;
+    pthread_mutex_unlock(&dc->lock);
     return 0;
 }
 
 /*
- * Finds an inode by path
+ * Records the result of a lookup. When the table is three quarters full
+ * or the name arena is exhausted the whole cache is flushed, which keeps
+ * its memory bounded without per-entry eviction bookkeeping.
  */
-uint32_t ext2_find_inode(ext2_fs_t *fs, const char *path) {
-    /* Start with root inode */
-    uint32_t current_inode = EXT2_ROOT_INODE;
+static void ext2_dcache_insert(ext2_fs_t *fs, uint32_t parent, uint32_t hash,
+                               const char *name, size_t name_len, uint32_t ino) {
+    ext2_dcache_t *dc = fs->dcache;
+    if (!dc) {
+        return;
+    }
     
-    /* Handle root directory */
-    if (strcmp(path, "/") == 0) {
-        return current_inode;
+    pthread_mutex_lock(&dc->lock);
+    if ((dc->count + 1) * 4 > (dc->mask + 1) * 3 || dc->names_used + name_len > dc->names_size) {
+        memset(dc->entries, 0, (size_t)(dc->mask + 1) * sizeof(ext2_dentry_t));
+        dc->count = 0;
+        dc->names_used = 0;
+        dc->flushes++;
     }
     
-    /* Make a copy of path to avoid modifying the original */
-    char *path_copy = strdup(path);
-    if (!path_copy) {
+    uint32_t i = ext2_dcache_slot(parent, hash) & dc->mask;
+    while (dc->entries[i].parent != 0) {
+        i = (i + 1) & dc->mask;
+    }
+    
+    ext2_dentry_t *d = &dc->entries[i];
+    d->parent = parent;
+    d->hash = hash;
+    d->ino = ino;
+    d->name_off = dc->names_used;
+    d->name_len = (uint32_t)name_len;
+    memcpy(dc->names + dc->names_used, name, name_len);
+    dc->names_used += (uint32_t)name_len;
+    dc->count++;
+    pthread_mutex_unlock(&dc->lock);
+}
+
+/*
+ * Sets up per-directory indexes with a memory budget of limit_mb
+ * megabytes; 0 leaves them disabled
+ */
+int ext2_dindex_init(ext2_fs_t *fs, uint32_t limit_mb) {
+    if (limit_mb == 0) {
         return 0;
     }
     
-    /* Parse path components */
-    char *saveptr;
-    char *component = strtok_r(path_copy, "/", &saveptr);
+    ext2_dindex_cache_t *dx = (ext2_dindex_cache_t *)calloc(1, sizeof(ext2_dindex_cache_t));
+    if (!dx) {
+        perror("Error allocating directory index");
+        return -1;
+    }
+    dx->limit = (size_t)limit_mb << 20;
+    pthread_mutex_init(&dx->lock, NULL);
     
-    while (component != NULL) {
-        ext2_inode_t inode;
-        if (ext2_read_inode(fs, current_inode, &inode) != 0) {
-            free(path_copy);
+    fs->dindex = dx;
+    return 0;
+}
+
+/*
+ * Releases every directory index
+ */
+void ext2_dindex_free(ext2_fs_t *fs) {
+    ext2_dindex_cache_t *dx = fs->dindex;
+    if (!dx) {
+        return;
+    }
+    
+    ext2_dindex_t *d = dx->oldest;
+    while (d) {
+        ext2_dindex_t *next = d->newer;
+        free(d->entries);
+        free(d->names);
+        free(d);
+        d = next;
+    }
+    pthread_mutex_destroy(&dx->lock);
+    free(dx);
+    fs->dindex = NULL;
+}
+
+/* Scratch state while a directory index is being built */
+typedef struct {
+    ext2_dindex_entry_t *entries;       /* Entries in directory order */
+    uint32_t count;
+    uint32_t capacity;
+    char *names;
+    size_t names_used;
+    size_t names_size;
+    int failed;                         /* Set when memory ran out */
+} ext2_dindex_build_t;
+
+/*
+ * ext2_dir_foreach callback appending one entry to the build
+ */
+static int ext2_dindex_collect(void *arg, uint32_t ino, uint8_t file_type, const char *name,
+                               size_t name_len) {
+    ext2_dindex_build_t *b = (ext2_dindex_build_t *)arg;
+    
+    if (b->count == b->capacity) {
+        uint32_t capacity = b->capacity ? b->capacity * 2 : 64;
+        ext2_dindex_entry_t *entries = (ext2_dindex_entry_t *)realloc(
+            b->entries, capacity * sizeof(ext2_dindex_entry_t));
+        if (!entries) {
+            b->failed = 1;
+            return 1;
+        }
+        b->entries = entries;
+        b->capacity = capacity;
+    }
+    if (b->names_used + name_len > b->names_size) {
+        size_t size = b->names_size ? b->names_size * 2 : 1024;
+        while (size < b->names_used + name_len) {
+            size *= 2;
+        }
+        char *names = (char *)realloc(b->names, size);
+        if (!names) {
+            b->failed = 1;
+            return 1;
+        }
+        b->names = names;
+        b->names_size = size;
+    }
+    
+    ext2_dindex_entry_t *e = &b->entries[b->count++];
+    e->hash = ext2_name_hash(name, name_len);
+    e->ino = ino;
+    e->name_off = (uint32_t)b->names_used;
+    e->name_len = (uint8_t)name_len;
+    e->file_type = file_type;
+    memcpy(b->names + b->names_used, name, name_len);
+    b->names_used += name_len;
+    return 0;
+}
+
+/*
+ * Turns a finished build into an index, releasing the build's memory.
+ * Returns NULL when memory runs out.
+ */
+static ext2_dindex_t *ext2_dindex_finish(ext2_dindex_build_t *b, uint32_t dir_ino) {
+    ext2_dindex_t *d = NULL;
+    
+    /* Keep the table at most half full */
+    uint32_t slots = 16;
+    while (slots < b->count * 2) {
+        slots <<= 1;
+    }
+    
+    d = (ext2_dindex_t *)calloc(1, sizeof(ext2_dindex_t));
+    if (!d) {
+        goto out;
+    }
+    d->entries = (ext2_dindex_entry_t *)calloc(slots, sizeof(ext2_dindex_entry_t));
+    if (!d->entries) {
+        free(d);
+        d = NULL;
+        goto out;
+    }
+    d->dir_ino = dir_ino;
+    d->mask = slots - 1;
+    d->names = b->names;
+    b->names = NULL;
+    d->bytes = sizeof(ext2_dindex_t) + slots * sizeof(ext2_dindex_entry_t) + b->names_size;
+    
+    /* Insert in directory order; a duplicate name keeps its first entry,
+     * as a linear scan would */
+    for (uint32_t n = 0; n < b->count; n++) {
+        const ext2_dindex_entry_t *e = &b->entries[n];
+        uint32_t i = e->hash & d->mask;
+        while (d->entries[i].ino != 0) {
+            const ext2_dindex_entry_t *o = &d->entries[i];
+            if (o->hash == e->hash && o->name_len == e->name_len &&
+                memcmp(d->names + o->name_off, d->names + e->name_off, e->name_len) == 0) {
+                break;
+            }
+            i = (i + 1) & d->mask;
+        }
+        if (d->entries[i].ino == 0) {
+            d->entries[i] = *e;
+        }
+    }
+    
+out:
+    free(b->entries);
+    free(b->names);
+    memset(b, 0, sizeof(*b));
+    return d;
+}
+
+/*
+ * Reads a whole directory into a new index. Returns NULL on errors.
+ */
+static ext2_dindex_t *ext2_dindex_build(ext2_fs_t *fs, uint32_t dir_ino,
+                                        const ext2_inode_t *dir) {
+    ext2_dindex_build_t b;
+    memset(&b, 0, sizeof(b));
+    
+    if (ext2_dir_foreach(fs, dir, ext2_dindex_collect, &b) != 0 || b.failed) {
+        free(b.entries);
+        free(b.names);
+        return NULL;
+    }
+    return ext2_dindex_finish(&b, dir_ino);
+}
+
+/*
+ * Tells whether a directory already has an index
+ */
+static int ext2_dindex_present(ext2_fs_t *fs, uint32_t dir_ino) {
+    ext2_dindex_cache_t *dx = fs->dindex;
+    int found = 0;
+    
+    pthread_mutex_lock(&dx->lock);
+    for (ext2_dindex_t *d = dx->buckets[dir_ino % EXT2_DINDEX_BUCKETS]; d && !found;
+         d = d->hash_next) {
+        found = d->dir_ino == dir_ino;
+    }
+    pthread_mutex_unlock(&dx->lock);
+    return found;
+}
+
+/*
+ * Hands a freshly built index to the cache, which takes ownership.
+ * Indexes are dropped oldest first to stay within the memory budget; one
+ * that would not fit on its own, or whose directory another thread
+ * indexed meanwhile, is freed.
+ */
+static void ext2_dindex_add(ext2_fs_t *fs, ext2_dindex_t *built) {
+    ext2_dindex_cache_t *dx = fs->dindex;
+    ext2_dindex_t **bucket = &dx->buckets[built->dir_ino % EXT2_DINDEX_BUCKETS];
+    
+    pthread_mutex_lock(&dx->lock);
+    dx->builds++;
+    int keep = built->bytes <= dx->limit;
+    for (ext2_dindex_t *d = *bucket; d && keep; d = d->hash_next) {
+        if (d->dir_ino == built->dir_ino) {
+            keep = 0;
+        }
+    }
+    if (!keep) {
+        if (built->bytes > dx->limit) {
+            dx->oversized++;
+        }
+        pthread_mutex_unlock(&dx->lock);
+        free(built->entries);
+        free(built->names);
+        free(built);
+        return;
+    }
+    
+    while (dx->bytes + built->bytes > dx->limit) {
+        ext2_dindex_t *old = dx->oldest;
+        ext2_dindex_t **pp = &dx->buckets[old->dir_ino % EXT2_DINDEX_BUCKETS];
+        while (*pp != old) {
+            pp = &(*pp)->hash_next;
+        }
+        *pp = old->hash_next;
+        dx->oldest = old->newer;
+        if (!dx->oldest) {
+            dx->newest = NULL;
+        }
+        dx->bytes -= old->bytes;
+        dx->dirs--;
+        dx->evictions++;
+        free(old->entries);
+        free(old->names);
+        free(old);
+    }
+    
+    built->hash_next = *bucket;
+    *bucket = built;
+    if (dx->newest) {
+        dx->newest->newer = built;
+    } else {
+        dx->oldest = built;
+    }
+    dx->newest = built;
+    dx->bytes += built->bytes;
+    dx->dirs++;
+    pthread_mutex_unlock(&dx->lock);
+}
+
+/*
+ * Finds a name in a directory index. Returns its inode number or 0.
+ */
+static uint32_t ext2_dindex_probe(const ext2_dindex_t *d, uint32_t hash, const char *name,
+                                  size_t name_len) {
+    for (uint32_t i = hash & d->mask; ; i = (i + 1) & d->mask) {
+        const ext2_dindex_entry_t *e = &d->entries[i];
+        if (e->ino == 0) {
+            return 0;
+        }
+        if (e->hash == hash && e->name_len == name_len &&
+            memcmp(d->names + e->name_off, name, name_len) == 0) {
+            return e->ino;
+        }
+    }
+}
+
+/*
+ * Looks a name up through the directory's index, building the index
+ * with one full scan the first time the directory is searched or
+ * listed. An index too large to keep still answers this lookup.
+ * Returns the inode number, 0 when absent and (uint32_t)-1 on errors.
+ */
+static uint32_t ext2_dindex_lookup(ext2_fs_t *fs, uint32_t dir_ino, const ext2_inode_t *dir,
+                                   uint32_t hash, const char *name, size_t name_len) {
+    ext2_dindex_cache_t *dx = fs->dindex;
+    ext2_dindex_t **bucket = &dx->buckets[dir_ino % EXT2_DINDEX_BUCKETS];
+    uint32_t ino;
+    
+    pthread_mutex_lock(&dx->lock);
+    for (ext2_dindex_t *d = *bucket; d; d = d->hash_next) {
+        if (d->dir_ino == dir_ino) {
+            ino = ext2_dindex_probe(d, hash, name, name_len);
+            dx->hits++;
+            pthread_mutex_unlock(&dx->lock);
+            return ino;
+        }
+    }
+    pthread_mutex_unlock(&dx->lock);
+    
+    /* Build without the lock; another thread may race us to the same
+     * directory, in which case the loser's copy is thrown away */
+    ext2_dindex_t *built = ext2_dindex_build(fs, dir_ino, dir);
+    if (!built) {
+        return (uint32_t)-1;
+    }
+    ino = ext2_dindex_probe(built, hash, name, name_len);
+    ext2_dindex_add(fs, built);
+    return ino;
+}
+
+/* ext2_index_find could not decide; walk the directories instead */
+#define EXT2_INDEX_UNKNOWN ((uint32_t)-1)
+
+/* Scratch state while the sidecar index is being built */
+typedef struct {
+    ext2_index_path_t *paths;
+    uint32_t path_count;
+    uint32_t path_capacity;
+    char *names;
+    size_t names_used;
+    size_t names_size;
+    ext2_index_inode_t *inodes;         /* One per path until sorted and merged */
+    uint32_t inode_count;
+    uint32_t inode_capacity;
+    ext2_extent_t *extents;
+    uint64_t extent_count;
+    uint64_t extent_capacity;
+} ext2_index_build_t;
+
+/*
+ * Makes room for one more element in a growing array
+ */
+static int ext2_index_grow(void **array, uint64_t count, uint64_t *capacity, size_t size) {
+    if (count < *capacity) {
+        return 0;
+    }
+    uint64_t grown = *capacity ? *capacity * 2 : 256;
+    void *p = realloc(*array, (size_t)grown * size);
+    if (!p) {
+        perror("Error growing index");
+        return -1;
+    }
+    *array = p;
+    *capacity = grown;
+    return 0;
+}
+
+/*
+ * Appends a path and its inode to the build
+ */
+static int ext2_index_add(ext2_index_build_t *b, const char *path, size_t len, uint32_t ino,
+                          const ext2_inode_t *inode) {
+    uint64_t capacity = b->path_capacity;
+    if (ext2_index_grow((void **)&b->paths, b->path_count, &capacity,
+                        sizeof(ext2_index_path_t)) != 0) {
+        return -1;
+    }
+    b->path_capacity = (uint32_t)capacity;
+    
+    capacity = b->inode_capacity;
+    if (ext2_index_grow((void **)&b->inodes, b->inode_count, &capacity,
+                        sizeof(ext2_index_inode_t)) != 0) {
+        return -1;
+    }
+    b->inode_capacity = (uint32_t)capacity;
+    
+    while (b->names_used + len + 1 > b->names_size) {
+        size_t size = b->names_size ? b->names_size * 2 : 65536;
+        char *names = (char *)realloc(b->names, size);
+        if (!names) {
+            perror("Error growing index");
+            return -1;
+        }
+        b->names = names;
+        b->names_size = size;
+    }
+    
+    ext2_index_path_t *p = &b->paths[b->path_count++];
+    memset(p, 0, sizeof(*p));
+    p->name_off = b->names_used;
+    p->name_len = (uint32_t)len;
+    p->hash = ext2_name_hash(path, len);
+    p->ino = ino;
+    memcpy(b->names + b->names_used, path, len);
+    b->names[b->names_used + len] = '\0';
+    b->names_used += len + 1;
+    
+    ext2_index_inode_t *r = &b->inodes[b->inode_count++];
+    memset(r, 0, sizeof(*r));
+    r->ino = ino;
+    r->inode = *inode;
+    return 0;
+}
+
+/*
+ * Walks the tree breadth first; the path list doubles as the queue of
+ * directories still to read
+ */
+static int ext2_index_walk(ext2_fs_t *fs, ext2_index_build_t *b) {
+    ext2_inode_t inode;
+    char path[4096];
+    
+    if (ext2_read_inode(fs, EXT2_ROOT_INODE, &inode) != 0 ||
+        ext2_index_add(b, "/", 1, EXT2_ROOT_INODE, &inode) != 0) {
+        return -1;
+    }
+    
+    for (uint32_t i = 0; i < b->path_count; i++) {
+        if ((b->inodes[i].inode.i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR) {
+            continue;
+        }
+        
+        ext2_dir_t dir;
+        ext2_dirent_t ent;
+        ext2_inode_t dir_inode = b->inodes[i].inode;
+        if (ext2_dir_open(&dir, fs, &dir_inode) != 0) {
+            return -1;
+        }
+        
+        size_t base = b->paths[i].name_len;
+        memcpy(path, b->names + b->paths[i].name_off, base);
+        if (base == 1) {
+            base = 0;  /* The root contributes no component of its own */
+        }
+        
+        int more;
+        while ((more = ext2_dir_next(&dir, &ent)) > 0) {
+            if ((ent.name_len == 1 && ent.name[0] == '.') ||
+                (ent.name_len == 2 && ent.name[0] == '.' && ent.name[1] == '.')) {
+                continue;
+            }
+            if (base + 1 + ent.name_len >= sizeof(path)) {
+                /* Left to the directory walk at lookup time */
+                fprintf(stderr, "Path too long to index below %.*s\n",
+                        (int)b->paths[i].name_len, b->names + b->paths[i].name_off);
+                continue;
+            }
+            
+            path[base] = '/';
+            memcpy(path + base + 1, ent.name, ent.name_len);
+            if (ext2_read_inode(fs, ent.ino, &inode) != 0 ||
+                ext2_index_add(b, path, base + 1 + ent.name_len, ent.ino, &inode) != 0) {
+                more = -1;
+                break;
+            }
+        }
+        ext2_dir_close(&dir);
+        if (more < 0) {
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+static int ext2_index_cmp_ino(const void *a, const void *b) {
+    uint32_t x = ((const ext2_index_inode_t *)a)->ino;
+    uint32_t y = ((const ext2_index_inode_t *)b)->ino;
+    return (x > y) - (x < y);
+}
+
+static int ext2_index_cmp_key(const void *a, const void *b) {
+    uint32_t x = ((const ext2_index_key_t *)a)->block;
+    uint32_t y = ((const ext2_index_key_t *)b)->block;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Returns the block that keys an inode's extents: its first indirect
+ * block, or 0 when the inode has none
+ */
+static uint32_t ext2_index_key_of(const ext2_inode_t *inode) {
+    for (int i = 12; i < 15; i++) {
+        if (inode->i_block[i] != 0) {
+            return inode->i_block[i];
+        }
+    }
+    return 0;
+}
+
+/*
+ * Records the mapped runs of every inode that has indirect blocks
+ */
+static int ext2_index_map(ext2_fs_t *fs, ext2_index_build_t *b) {
+    for (uint32_t i = 0; i < b->inode_count; i++) {
+        ext2_index_inode_t *r = &b->inodes[i];
+        uint16_t type = r->inode.i_mode & EXT2_S_IFMT;
+        if (ext2_index_key_of(&r->inode) == 0 || (type != EXT2_S_IFREG && type != EXT2_S_IFDIR)) {
+            continue;
+        }
+        
+        ext2_bmap_t bm;
+        ext2_extent_t ext;
+        int more;
+        if (ext2_bmap_open(&bm, fs, &r->inode) != 0) {
+            return -1;
+        }
+        r->extent_first = b->extent_count;
+        while ((more = ext2_bmap_next(&bm, &ext)) > 0) {
+            if (ext.physical == 0) {
+                continue;
+            }
+            if (ext2_index_grow((void **)&b->extents, b->extent_count, &b->extent_capacity,
+                                sizeof(ext2_extent_t)) != 0) {
+                more = -1;
+                break;
+            }
+            b->extents[b->extent_count++] = ext;
+        }
+        ext2_bmap_close(&bm);
+        if (more < 0) {
+            return -1;
+        }
+        r->extent_count = (uint32_t)(b->extent_count - r->extent_first);
+    }
+    return 0;
+}
+
+/*
+ * Writes one section and pads the file to the next 8-byte boundary
+ */
+static int ext2_index_write(FILE *out, const void *data, size_t size) {
+    static const uint8_t zeros[8];
+    if (size > 0 && fwrite(data, 1, size, out) != size) {
+        return -1;
+    }
+    size_t pad = (8 - size % 8) % 8;
+    return (pad > 0 && fwrite(zeros, 1, pad, out) != pad) ? -1 : 0;
+}
+
+static uint64_t ext2_index_align(uint64_t offset) {
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+/*
+ * Writes a sidecar index of the whole tree to out_path: every path with
+ * its inode number, the attributes of each inode and the block runs of
+ * every file that has indirect blocks. The file is written next to its
+ * final name and renamed into place, so readers never see half of it.
+ */
+int ext2_index_build(ext2_fs_t *fs, const char *out_path) {
+    ext2_index_build_t b;
+    ext2_index_key_t *keys = NULL;
+    uint32_t *hash = NULL;
+    uint32_t key_count = 0;
+    int result = -1;
+    memset(&b, 0, sizeof(b));
+    
+    if (ext2_index_walk(fs, &b) != 0) {
+        goto out;
+    }
+    
+    /* One record per inode: hard links share theirs */
+    qsort(b.inodes, b.inode_count, sizeof(ext2_index_inode_t), ext2_index_cmp_ino);
+    uint32_t unique = 0;
+    for (uint32_t i = 0; i < b.inode_count; i++) {
+        if (unique == 0 || b.inodes[unique - 1].ino != b.inodes[i].ino) {
+            b.inodes[unique++] = b.inodes[i];
+        }
+    }
+    b.inode_count = unique;
+    
+    if (ext2_index_map(fs, &b) != 0) {
+        goto out;
+    }
+    
+    keys = (ext2_index_key_t *)malloc((b.inode_count + 1) * sizeof(ext2_index_key_t));
+    uint32_t hash_size = 16;
+    while (hash_size < 2 * b.path_count) {
+        hash_size <<= 1;
+    }
+    hash = (uint32_t *)calloc(hash_size, sizeof(uint32_t));
+    if (!keys || !hash) {
+        perror("Error allocating index");
+        goto out;
+    }
+    for (uint32_t i = 0; i < b.inode_count; i++) {
+        if (b.inodes[i].extent_count > 0) {
+            keys[key_count].block = ext2_index_key_of(&b.inodes[i].inode);
+            keys[key_count].inode = i;
+            key_count++;
+        }
+    }
+    qsort(keys, key_count, sizeof(ext2_index_key_t), ext2_index_cmp_key);
+    for (uint32_t i = 0; i < b.path_count; i++) {
+        uint32_t slot = b.paths[i].hash & (hash_size - 1);
+        while (hash[slot] != 0) {
+            slot = (slot + 1) & (hash_size - 1);
+        }
+        hash[slot] = i + 1;
+    }
+    
+    ext2_index_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, EXT2_INDEX_MAGIC, sizeof(h.magic));
+    h.version = EXT2_INDEX_VERSION;
+    h.block_size = 1024 << fs->superblock.s_log_block_size;
+    memcpy(h.uuid, fs->superblock.s_uuid, sizeof(h.uuid));
+    h.wtime = fs->superblock.s_wtime;
+    h.mtime = fs->superblock.s_mtime;
+    h.inodes_count = fs->superblock.s_inodes_count;
+    h.blocks_count = fs->superblock.s_blocks_count;
+    h.path_count = b.path_count;
+    h.hash_size = hash_size;
+    h.inode_count = b.inode_count;
+    h.key_count = key_count;
+    h.extent_count = b.extent_count;
+    h.paths_off = ext2_index_align(sizeof(h));
+    h.hash_off = ext2_index_align(h.paths_off + (uint64_t)b.path_count * sizeof(ext2_index_path_t));
+    h.names_off = ext2_index_align(h.hash_off + (uint64_t)hash_size * sizeof(uint32_t));
+    h.names_size = b.names_used;
+    h.inodes_off = ext2_index_align(h.names_off + b.names_used);
+    h.keys_off = ext2_index_align(h.inodes_off + (uint64_t)b.inode_count * sizeof(ext2_index_inode_t));
+    h.extents_off = ext2_index_align(h.keys_off + (uint64_t)key_count * sizeof(ext2_index_key_t));
+    h.file_size = ext2_index_align(h.extents_off + b.extent_count * sizeof(ext2_extent_t));
+    
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", out_path);
+    FILE *out = fopen(tmp_path, "wb");
+    if (!out) {
+        perror("Error creating index file");
+        goto out;
+    }
+    int failed = ext2_index_write(out, &h, sizeof(h)) != 0 ||
+                 ext2_index_write(out, b.paths, (size_t)b.path_count * sizeof(ext2_index_path_t)) != 0 ||
+                 ext2_index_write(out, hash, (size_t)hash_size * sizeof(uint32_t)) != 0 ||
+                 ext2_index_write(out, b.names, b.names_used) != 0 ||
+                 ext2_index_write(out, b.inodes, (size_t)b.inode_count * sizeof(ext2_index_inode_t)) != 0 ||
+                 ext2_index_write(out, keys, (size_t)key_count * sizeof(ext2_index_key_t)) != 0 ||
+                 ext2_index_write(out, b.extents, (size_t)b.extent_count * sizeof(ext2_extent_t)) != 0;
+    if (fclose(out) != 0) {
+        failed = 1;
+    }
+    if (failed || rename(tmp_path, out_path) != 0) {
+        perror("Error writing index file");
+        unlink(tmp_path);
+        goto out;
+    }
+    
+    printf("Indexed %u paths, %u inodes and %llu extents into %s (%llu bytes)\n",
+           b.path_count, b.inode_count, (unsigned long long)b.extent_count, out_path,
+           (unsigned long long)h.file_size);
+    result = 0;
+    
+out:
+    free(b.paths);
+    free(b.names);
+    free(b.inodes);
+    free(b.extents);
+    free(keys);
+    free(hash);
+    return result;
+}
+
+/*
+ * Checks that a section of count elements lies inside the index file
+ */
+static int ext2_index_fits(const ext2_index_header_t *h, uint64_t offset, uint64_t count,
+                           size_t size) {
+    return offset % 8 == 0 && offset <= h->file_size &&
+           count <= (h->file_size - offset) / size;
+}
+
+/*
+ * Maps a sidecar index written by ext2_index_build. An index that was
+ * made from another image, or from this one before it was last written,
+ * is ignored with a warning; a damaged index is an error.
+ */
+int ext2_index_load(ext2_fs_t *fs, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening index file");
+        return -1;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ext2_index_header_t)) {
+        fprintf(stderr, "Invalid index file: %s\n", path);
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Error mapping index file");
+        return -1;
+    }
+    
+    const ext2_index_header_t *h = (const ext2_index_header_t *)map;
+    if (memcmp(h->magic, EXT2_INDEX_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != EXT2_INDEX_VERSION || h->file_size != (uint64_t)st.st_size ||
+        h->hash_size == 0 || (h->hash_size & (h->hash_size - 1)) != 0 ||
+        !ext2_index_fits(h, h->paths_off, h->path_count, sizeof(ext2_index_path_t)) ||
+        !ext2_index_fits(h, h->hash_off, h->hash_size, sizeof(uint32_t)) ||
+        h->names_off > h->file_size || h->names_size > h->file_size - h->names_off ||
+        !ext2_index_fits(h, h->inodes_off, h->inode_count, sizeof(ext2_index_inode_t)) ||
+        !ext2_index_fits(h, h->keys_off, h->key_count, sizeof(ext2_index_key_t)) ||
+        !ext2_index_fits(h, h->extents_off, h->extent_count, sizeof(ext2_extent_t))) {
+        fprintf(stderr, "Invalid index file: %s\n", path);
+        munmap(map, (size_t)st.st_size);
+        return -1;
+    }
+    
+    if (memcmp(h->uuid, fs->superblock.s_uuid, sizeof(h->uuid)) != 0 ||
+        h->wtime != fs->superblock.s_wtime || h->mtime != fs->superblock.s_mtime ||
+        h->block_size != (1024u << fs->superblock.s_log_block_size) ||
+        h->inodes_count != fs->superblock.s_inodes_count ||
+        h->blocks_count != fs->superblock.s_blocks_count) {
+        fprintf(stderr, "Index %s does not match the image; ignoring it\n", path);
+        munmap(map, (size_t)st.st_size);
+        return 0;
+    }
+    
+    ext2_index_t *ix = (ext2_index_t *)malloc(sizeof(ext2_index_t));
+    if (!ix) {
+        perror("Error allocating index");
+        munmap(map, (size_t)st.st_size);
+        return -1;
+    }
+    ix->map = (const uint8_t *)map;
+    ix->size = (size_t)st.st_size;
+    ix->header = h;
+    ix->paths = (const ext2_index_path_t *)(ix->map + h->paths_off);
+    ix->hash = (const uint32_t *)(ix->map + h->hash_off);
+    ix->names = (const char *)(ix->map + h->names_off);
+    ix->inodes = (const ext2_index_inode_t *)(ix->map + h->inodes_off);
+    ix->keys = (const ext2_index_key_t *)(ix->map + h->keys_off);
+    ix->extents = (const ext2_extent_t *)(ix->map + h->extents_off);
+    
+    /* Lookups hop around the index */
+    madvise((void *)ix->map, ix->size, MADV_RANDOM);
+    
+    fs->index = ix;
+    return 0;
+}
+
+/*
+ * Unmaps the sidecar index
+ */
+void ext2_index_free(ext2_fs_t *fs) {
+    if (fs->index) {
+        munmap((void *)fs->index->map, fs->index->size);
+        free(fs->index);
+        fs->index = NULL;
+    }
+}
+
+/*
+ * Resolves a path through the sidecar index. Returns the inode, 0 when
+ * the tree has no such path, or EXT2_INDEX_UNKNOWN for paths the index
+ * cannot answer (those with "." or ".." components, or too long).
+ */
+static uint32_t ext2_index_find(const ext2_index_t *ix, const char *path) {
+    const ext2_index_header_t *h = ix->header;
+    char norm[4096];
+    size_t len = 0;
+    
+    /* Same form as the builder: "/" alone, or "/a/b" */
+    const char *p = path;
+    while (*p) {
+        while (*p == '/') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        const char *component = p;
+        while (*p && *p != '/') {
+            p++;
+        }
+        size_t component_len = p - component;
+        if ((component_len == 1 && component[0] == '.') ||
+            (component_len == 2 && component[0] == '.' && component[1] == '.') ||
+            len + 1 + component_len >= sizeof(norm)) {
+            return EXT2_INDEX_UNKNOWN;
+        }
+        norm[len++] = '/';
+        memcpy(norm + len, component, component_len);
+        len += component_len;
+    }
+    if (len == 0) {
+        norm[len++] = '/';
+    }
+    
+    uint32_t hash = ext2_name_hash(norm, len);
+    uint32_t mask = h->hash_size - 1;
+    for (uint32_t n = 0, slot = hash & mask; n < h->hash_size; n++, slot = (slot + 1) & mask) {
+        uint32_t i = ix->hash[slot];
+        if (i == 0) {
             return 0;
         }
+        if (i > h->path_count) {
+            return EXT2_INDEX_UNKNOWN;
+        }
+        const ext2_index_path_t *e = &ix->paths[i - 1];
+        if (e->hash == hash && e->name_len == len && e->name_off <= h->names_size &&
+            len <= h->names_size - e->name_off && memcmp(ix->names + e->name_off, norm, len) == 0) {
+            return e->ino;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Returns the indexed copy of an inode, or NULL when it is not indexed
+ */
+static const ext2_inode_t *ext2_index_inode(const ext2_index_t *ix, uint32_t ino) {
+    uint32_t lo = 0;
+    uint32_t hi = ix->header->inode_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (ix->inodes[mid].ino < ino) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < ix->header->inode_count && ix->inodes[lo].ino == ino) {
+        return &ix->inodes[lo].inode;
+    }
+    return NULL;
+}
+
+/*
+ * Finds the indexed runs of an inode with indirect blocks, leaving
+ * *extents NULL when the index has none for it
+ */
+static void ext2_index_extents(const ext2_index_t *ix, const ext2_inode_t *inode,
+                               const ext2_extent_t **extents, uint32_t *count) {
+    const ext2_index_header_t *h = ix->header;
+    uint32_t key = ext2_index_key_of(inode);
+    
+    *extents = NULL;
+    *count = 0;
+    if (key == 0) {
+        return;
+    }
+    
+    uint32_t lo = 0;
+    uint32_t hi = h->key_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (ix->keys[mid].block < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == h->key_count || ix->keys[lo].block != key || ix->keys[lo].inode >= h->inode_count) {
+        return;
+    }
+    
+    /* Only trust the runs if they were recorded for this very block map */
+    const ext2_index_inode_t *r = &ix->inodes[ix->keys[lo].inode];
+    if (memcmp(r->inode.i_block, inode->i_block, sizeof(inode->i_block)) != 0 ||
+        r->inode.i_size != inode->i_size || r->extent_first > h->extent_count ||
+        r->extent_count > h->extent_count - r->extent_first) {
+        return;
+    }
+    *extents = ix->extents + r->extent_first;
+    *count = r->extent_count;
+}
+
+/*
+ * Locates an inode for ext2_get_inode
+ */
+static const ext2_inode_t *ext2_fetch_inode(ext2_fs_t *fs, uint32_t ino, ext2_inode_t *buffer) {
+    if (ino < 1 || ino > fs->superblock.s_inodes_count) {
+        fprintf(stderr, "Invalid inode number: %u\n", ino);
+        return NULL;
+    }
+    
+    if (fs->index) {
+        const ext2_inode_t *indexed = ext2_index_inode(fs->index, ino);
+        if (indexed) {
+            return indexed;
+        }
+    }
+    
+    int inode_size = fs->superblock.s_inode_size;
+    int block_size = 1024 << fs->superblock.s_log_block_size;
+    int inodes_per_group = fs->superblock.s_inodes_per_group;
+    
+    /* Calculate which group this inode belongs to */
+    int group = (ino - 1) / inodes_per_group;
+    int index_in_group = (ino - 1) % inodes_per_group;
+    
+    /* Get inode table location from group descriptor */
+    uint32_t inode_table_block = fs->group_descs[group].bg_inode_table;
+    
+    /* Calculate offset */
+    off_t offset = (off_t)inode_table_block * block_size + index_in_group * inode_size;
+    
+    if (fs->map) {
+        if ((size_t)offset + sizeof(ext2_inode_t) > fs->map_size) {
+            fprintf(stderr, "Inode %u lies beyond the end of the image\n", ino);
+            return NULL;
+        }
+        return (const ext2_inode_t *)(fs->map + offset);
+    }
+    
+    /* Served from the inode table block when it is cached */
+    if (fs->cache) {
+        if (ext2_cache_read(fs, (uint32_t)(offset / block_size), offset % block_size, 128,
+                            buffer) != 0) {
+            return NULL;
+        }
+        return buffer;
+    }
+    
+    /* Read the inode - only read the fixed 128-byte part */
+    if (pread(fs->fd, buffer, 128, offset) != 128) {
+        perror("Error reading inode");
+        return NULL;
+    }
+    
+    return buffer;
+}
+
+/*
+ * Returns a pointer to an inode. With a mapped image this points straight
+ * into the inode table; otherwise the inode is read into buffer.
+ */
+const ext2_inode_t *ext2_get_inode(ext2_fs_t *fs, uint32_t ino, ext2_inode_t *buffer) {
+    uint64_t start = ext2_stats_begin();
+    const ext2_inode_t *inode = ext2_fetch_inode(fs, ino, buffer);
+    ext2_stats_end(EXT2_STAT_INODE_READ, start, inode ? sizeof(ext2_inode_t) : 0, 0);
+    return inode;
+}
+
+/*
+ * Reads an inode from the disk
+ */
+int ext2_read_inode(ext2_fs_t *fs, uint32_t ino, ext2_inode_t *inode) {
+    const ext2_inode_t *src = ext2_get_inode(fs, ino, inode);
+    if (!src) {
+        return -1;
+    }
+    if (src != inode) {
+        memcpy(inode, src, sizeof(ext2_inode_t));
+    }
+    return 0;
+}
+
+/*
+ * Locates a block for ext2_get_block
+ */
+static const void *ext2_fetch_block(ext2_fs_t *fs, uint32_t block_num, void *buffer) {
+    int block_size = 1024 << fs->superblock.s_log_block_size;
+    off_t offset = (off_t)block_num * (off_t)block_size;
+    
+    if (fs->map) {
+        if ((size_t)offset + block_size > fs->map_size) {
+            fprintf(stderr, "Block %u lies beyond the end of the image\n", block_num);
+            return NULL;
+        }
+        return fs->map + offset;
+    }
+    
+    if (fs->cache) {
+        if (ext2_cache_read(fs, block_num, 0, block_size, buffer) != 0) {
+            return NULL;
+        }
+        return buffer;
+    }
+    
+    ssize_t bytes_read = pread(fs->fd, buffer, block_size, offset);
+    if (bytes_read != block_size) {
+        perror("Error reading block");
+        return NULL;
+    }
+    
+    return buffer;
+}
+
+/*
+ * Returns a pointer to a block. With a mapped image this points straight
+ * into the mapping and nothing is copied; otherwise the block is read
+ * into buffer, which must hold at least one block.
+ */
+const void *ext2_get_block(ext2_fs_t *fs, uint32_t block_num, void *buffer) {
+    uint64_t start = ext2_stats_begin();
+    const void *data = ext2_fetch_block(fs, block_num, buffer);
+    ext2_stats_end(EXT2_STAT_BLOCK_READ, start,
+                   data ? (uint64_t)1024 << fs->superblock.s_log_block_size : 0, 1);
+    return data;
+}
+
+/*
+ * Reads a block from the disk
+ */
+int ext2_read_block(ext2_fs_t *fs, uint32_t block_num, void *buffer) {
+    const void *src = ext2_get_block(fs, block_num, buffer);
+    if (!src) {
+        return -1;
+    }
+    if (src != buffer) {
+        memcpy(buffer, src, 1024 << fs->superblock.s_log_block_size);
+    }
+    return 0;
+}
+
+/*
+ * Copies count consecutive blocks into buffer for ext2_read_blocks
+ */
+static int ext2_fetch_blocks(ext2_fs_t *fs, uint32_t block_num, uint32_t count, void *buffer) {
+    int block_size = 1024 << fs->superblock.s_log_block_size;
+    off_t offset = (off_t)block_num * (off_t)block_size;
+    size_t length = (size_t)count * block_size;
+    
+    if ((uint64_t)block_num + count > fs->superblock.s_blocks_count) {
+        fprintf(stderr, "Blocks %u-%u lie beyond the end of the file system\n",
+                block_num, block_num + count - 1);
+        return -1;
+    }
+    
+    if (fs->map) {
+        if ((size_t)offset + length > fs->map_size) {
+            fprintf(stderr, "Blocks %u-%u lie beyond the end of the image\n",
+                    block_num, block_num + count - 1);
+            return -1;
+        }
+        memcpy(buffer, fs->map + offset, length);
+        return 0;
+    }
+    
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = pread(fs->fd, (uint8_t *)buffer + done, length - done, offset + done);
+        if (n == 0) {
+            fprintf(stderr, "Blocks %u-%u lie beyond the end of the image\n",
+                    block_num, block_num + count - 1);
+            return -1;
+        }
+        if (n < 0) {
+            perror("Error reading blocks");
+            return -1;
+        }
+        done += n;
+    }
+    
+    return 0;
+}
+
+/*
+ * Reads count consecutive blocks with a single pread
+ */
+int ext2_read_blocks(ext2_fs_t *fs, uint32_t block_num, uint32_t count, void *buffer) {
+    uint64_t start = ext2_stats_begin();
+    int rc = ext2_fetch_blocks(fs, block_num, count, buffer);
+    ext2_stats_end(EXT2_STAT_BLOCK_READ, start,
+                   rc == 0 ? (uint64_t)count << (10 + fs->superblock.s_log_block_size) : 0, count);
+    return rc;
+}
+
+/*
+ * Returns a pointer to count consecutive blocks: into the mapping when
+ * there is one, otherwise read into buffer with a single pread
+ */
+const void *ext2_get_blocks(ext2_fs_t *fs, uint32_t block_num, uint32_t count, void *buffer) {
+    int block_size = 1024 << fs->superblock.s_log_block_size;
+    
+    if (fs->map) {
+        uint64_t start = ext2_stats_begin();
+        if (((uint64_t)block_num + count) * block_size > fs->map_size) {
+            fprintf(stderr, "Blocks %u-%u lie beyond the end of the image\n",
+                    block_num, block_num + count - 1);
+            return NULL;
+        }
+        ext2_stats_end(EXT2_STAT_BLOCK_READ, start, (uint64_t)count * block_size, count);
+        return fs->map + (size_t)block_num * block_size;
+    }
+    if (ext2_read_blocks(fs, block_num, count, buffer) != 0) {
+        return NULL;
+    }
+    return buffer;
+}
+
+/*
+ * Tells the kernel how a range of blocks is about to be accessed.
+ * A count of 0 applies the hint to the whole image. Hints are best
+ * effort, so failures are ignored.
+ */
+int ext2_advise(ext2_fs_t *fs, uint32_t block_num, uint32_t count, int advice) {
+    int block_size = 1024 << fs->superblock.s_log_block_size;
+    off_t offset = (off_t)block_num * block_size;
+    off_t length = (off_t)count * block_size;
+    
+    if (fs->map) {
+        int madv = MADV_NORMAL;
+        if (advice == EXT2_ADVISE_SEQUENTIAL) madv = MADV_SEQUENTIAL;
+        if (advice == EXT2_ADVISE_RANDOM) madv = MADV_RANDOM;
+        if (advice == EXT2_ADVISE_WILLNEED) madv = MADV_WILLNEED;
+        
+        if ((size_t)offset >= fs->map_size) {
+            return 0;
+        }
+        if (count == 0 || (size_t)(offset + length) > fs->map_size) {
+            length = fs->map_size - offset;
+        }
+        
+        /* madvise wants a page-aligned start */
+        long page_size = sysconf(_SC_PAGESIZE);
+        off_t aligned = offset & ~((off_t)page_size - 1);
+        return madvise(fs->map + aligned, length + (offset - aligned), madv);
+    }
+    
+    int fadv = POSIX_FADV_NORMAL;
+    if (advice == EXT2_ADVISE_SEQUENTIAL) fadv = POSIX_FADV_SEQUENTIAL;
+    if (advice == EXT2_ADVISE_RANDOM) fadv = POSIX_FADV_RANDOM;
+    if (advice == EXT2_ADVISE_WILLNEED) fadv = POSIX_FADV_WILLNEED;
+    return posix_fadvise(fs->fd, offset, length, fadv);
+}
+
+/*
+ * Returns the size of a file in bytes. Revision 1 file systems keep the
+ * upper 32 bits of a regular file's size in i_dir_acl.
+ */
+uint64_t ext2_inode_size(ext2_fs_t *fs, const ext2_inode_t *inode) {
+    uint64_t size = inode->i_size;
+    if (fs->superblock.s_rev_level >= 1 && (inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFREG) {
+        size |= (uint64_t)inode->i_dir_acl << 32;
+    }
+    return size;
+}
+
+/*
+ * Prepares a block map iterator for an inode
+ */
+int ext2_bmap_open(ext2_bmap_t *bm, ext2_fs_t *fs, const ext2_inode_t *inode) {
+    uint32_t block_size = 1024 << fs->superblock.s_log_block_size;
+    
+    memset(bm, 0, sizeof(*bm));
+    bm->fs = fs;
+    memcpy(bm->i_block, inode->i_block, sizeof(bm->i_block));
+    bm->count = (uint32_t)((ext2_inode_size(fs, inode) + block_size - 1) / block_size);
+    bm->ptrs_per_block = block_size / sizeof(uint32_t);
+    
+    /* With the runs at hand the indirect blocks are never read */
+    if (fs->index) {
+        ext2_index_extents(fs->index, inode, &bm->ix, &bm->ix_count);
+    }
+    
+    if (!fs->map && !bm->ix) {
+        bm->ind_buf = (uint8_t *)malloc(3 * block_size);
+        if (!bm->ind_buf) {
+            perror("Error allocating memory for indirect blocks");
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+/*
+ * Loader for ext2r_map_walk: returns an indirect block from the mapping,
+ * or reads it into the slot for its depth. On the readahead cursor,
+ * entering a new indirect block starts fetching the one after it.
+ */
+static const uint32_t *ext2_bmap_load(void *ctx, int depth, uint32_t block_num, uint32_t next) {
+    ext2_bmap_t *bm = (ext2_bmap_t *)ctx;
+    
+    if (block_num >= bm->fs->superblock.s_blocks_count) {
+        fprintf(stderr, "Corrupt indirect block pointer: %u\n", block_num);
+        return NULL;
+    }
+    
+    uint32_t block_size = bm->ptrs_per_block * sizeof(uint32_t);
+    void *buffer = bm->ind_buf ? bm->ind_buf + depth * block_size : NULL;
+    const uint32_t *ptrs = (const uint32_t *)ext2_get_block(bm->fs, block_num, buffer);
+    
+    if (ptrs && bm->hint_indirect && depth > 0 && next != 0) {
+        ext2_advise(bm->fs, next, 1, EXT2_ADVISE_WILLNEED);
+    }
+    return ptrs;
+}
+
+/*
+ * Looks logical up in the indexed runs. Sets *physical (0 in a hole) and
+ * returns how many blocks from logical on continue the same way.
+ */
+static uint64_t ext2_bmap_indexed(const ext2_bmap_t *bm, uint32_t logical, uint32_t *physical) {
+    uint32_t lo = 0;
+    uint32_t hi = bm->ix_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if ((uint64_t)bm->ix[mid].logical + bm->ix[mid].length <= logical) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    
+    if (lo < bm->ix_count && bm->ix[lo].logical <= logical) {
+        *physical = bm->ix[lo].physical + (logical - bm->ix[lo].logical);
+        return (uint64_t)bm->ix[lo].logical + bm->ix[lo].length - logical;
+    }
+    *physical = 0;
+    uint64_t end = (lo < bm->ix_count) ? bm->ix[lo].logical : bm->count;
+    return end > logical ? end - logical : 1;
+}
+
+/*
+ * Maps a logical file block to its disk block. Holes map to 0, and
+ * hole_run is set to the number of blocks from logical onwards that are
+ * known to be holes because a whole indirect subtree is missing.
+ */
+static int ext2_bmap_map(ext2_bmap_t *bm, uint32_t logical, uint32_t *physical,
+                         uint64_t *hole_run) {
+    /* Direct blocks are cheaper to take from i_block than to search for */
+    if (bm->ix && logical >= 12) {
+        uint64_t run = ext2_bmap_indexed(bm, logical, physical);
+        *hole_run = (*physical == 0) ? run : 1;
+        return 0;
+    }
+    
+    int err = ext2r_map_walk(&bm->map, bm->i_block, bm->ptrs_per_block, logical, physical,
+                             hole_run, ext2_bmap_load, bm);
+    if (err == EXT2R_EINVAL) {
+        fprintf(stderr, "Logical block %u is out of range\n", logical);
+    }
+    return err == EXT2R_OK ? 0 : -1;
+}
+
+/*
+ * Maps a logical file block to its disk block. Holes map to 0.
+ */
+int ext2_bmap_lookup(ext2_bmap_t *bm, uint32_t logical, uint32_t *physical) {
+    uint64_t hole_run;
+    return ext2_bmap_map(bm, logical, physical, &hole_run);
+}
+
+/*
+ * Moves the readahead cursor so that the data blocks up to ra_window
+ * beyond the extent just returned have been hinted with WILLNEED. The
+ * window doubles on every sequential step and collapses after a seek.
+ */
+static int ext2_bmap_hint(ext2_bmap_t *bm, const ext2_extent_t *extent) {
+    ext2_bmap_t *ra = bm->ra;
+    uint32_t end = extent->logical + extent->length;
+    uint32_t min_window = ra->ra_window;  /* Initial window, kept on the cursor */
+    
+    if (extent->logical == bm->ra_expect && bm->ra_window > 0) {
+        bm->ra_window = (bm->ra_window * 2 < bm->ra_max) ? bm->ra_window * 2 : bm->ra_max;
+    } else {
+        bm->ra_window = min_window;
+    }
+    bm->ra_expect = end;
+    
+    /* Never hint what the reader already has, nor restart behind it */
+    if (ra->next < end) {
+        ra->next = end;
+    }
+    
+    uint64_t target = (uint64_t)end + bm->ra_window;
+    if (target > ra->count) {
+        target = ra->count;
+    }
+    
+    while (ra->next < target) {
+        ext2_extent_t ahead;
+        if (ext2_bmap_next(ra, &ahead) < 0) {
+            return -1;
+        }
+        if (ahead.logical + ahead.length > target) {
+            /* Hint only up to the window; the rest is picked up next time */
+            ahead.length = (uint32_t)(target - ahead.logical);
+            ra->next = (uint32_t)target;
+        }
+        if (ahead.physical != 0) {
+            ext2_advise(bm->fs, ahead.physical, ahead.length, EXT2_ADVISE_WILLNEED);
+        }
+    }
+    
+    return 0;
+}
+
+/*
+ * Returns the next run of blocks that is contiguous on disk, or a run of
+ * holes. Returns 1 when an extent was produced, 0 at the end of the file
+ * and -1 on error.
+ */
+int ext2_bmap_next(ext2_bmap_t *bm, ext2_extent_t *extent) {
+    if (bm->next >= bm->count) {
+        return 0;
+    }
+    
+    uint32_t physical;
+    uint64_t run;
+    
+    /* The indexed runs are already maximal */
+    if (bm->ix) {
+        run = ext2_bmap_indexed(bm, bm->next, &physical);
+        if (run > bm->count - bm->next) {
+            run = bm->count - bm->next;
+        }
+        extent->logical = bm->next;
+        extent->physical = physical;
+        extent->length = (uint32_t)run;
+        bm->next += (uint32_t)run;
+        return (bm->ra && ext2_bmap_hint(bm, extent) != 0) ? -1 : 1;
+    }
+    
+    if (ext2_bmap_map(bm, bm->next, &physical, &run) != 0) {
+        return -1;
+    }
+    if (physical != 0 || run > bm->count - bm->next) {
+        run = (physical != 0) ? 1 : bm->count - bm->next;
+    }
+    
+    extent->logical = bm->next;
+    extent->physical = physical;
+    extent->length = (uint32_t)run;
+    bm->next += (uint32_t)run;
+    
+    /* Extend the run while the following blocks stay contiguous */
+    while (bm->next < bm->count) {
+        uint32_t next_physical;
+        if (ext2_bmap_map(bm, bm->next, &next_physical, &run) != 0) {
+            return -1;
+        }
+        if (physical == 0 ? next_physical != 0 : next_physical != physical + extent->length) {
+            break;
+        }
+        if (next_physical != 0 || run > bm->count - bm->next) {
+            run = (next_physical != 0) ? 1 : bm->count - bm->next;
+        }
+        extent->length += (uint32_t)run;
+        bm->next += (uint32_t)run;
+    }
+    
+    if (bm->ra && ext2_bmap_hint(bm, extent) != 0) {
+        return -1;
+    }
+    
+    return 1;
+}
+
+/*
+ * Releases a block map iterator
+ */
+void ext2_bmap_close(ext2_bmap_t *bm) {
+    if (bm->ra) {
+        ext2_bmap_close(bm->ra);
+        free(bm->ra);
+        bm->ra = NULL;
+    }
+    free(bm->ind_buf);
+    bm->ind_buf = NULL;
+}
+
+/*
+ * Turns on readahead for a walk with ext2_bmap_next. A second cursor
+ * runs ahead of the reader, loading indirect blocks early (and hinting
+ * the next one) and hinting the data blocks inside an adaptive window,
+ * so the kernel fetches them while the current ones are processed.
+ */
+int ext2_bmap_readahead(ext2_bmap_t *bm) {
+    ext2_fs_t *fs = bm->fs;
+    uint32_t block_size = bm->ptrs_per_block * sizeof(uint32_t);
+    
+    if (fs->readahead_kb == 0 || bm->ra) {
+        return 0;
+    }
+    
+    ext2_bmap_t *ra = (ext2_bmap_t *)malloc(sizeof(ext2_bmap_t));
+    if (!ra) {
+        perror("Error allocating readahead cursor");
+        return -1;
+    }
+    memcpy(ra, bm, sizeof(*ra));
+    memset(&ra->map, 0, sizeof(ra->map));
+    ra->ind_buf = NULL;
+    ra->ra = NULL;
+    ra->hint_indirect = 1;
+    if (!fs->map) {
+        ra->ind_buf = (uint8_t *)malloc(3 * block_size);
+        if (!ra->ind_buf) {
+            perror("Error allocating readahead cursor");
+            free(ra);
+            return -1;
+        }
+    }
+    
+    uint32_t min_blocks = (EXT2_READAHEAD_MIN_KB * 1024) / block_size;
+    uint32_t max_blocks = (uint32_t)(((uint64_t)fs->readahead_kb * 1024) / block_size);
+    if (min_blocks == 0) min_blocks = 1;
+    if (max_blocks < min_blocks) max_blocks = min_blocks;
+    
+    ra->ra_window = min_blocks;  /* The cursor remembers the initial window */
+    bm->ra = ra;
+    bm->ra_window = 0;
+    bm->ra_max = max_blocks;
+    bm->ra_expect = bm->next;
+    return 0;
+}
+
+/*
+ * Writes a whole buffer at an offset, retrying short writes
+ */
+static int pwrite_full(int fd, const void *buffer, size_t length, off_t offset) {
+    const uint8_t *p = (const uint8_t *)buffer;
+    while (length > 0) {
+        ssize_t n = pwrite(fd, p, length, offset);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        length -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/*
+ * Writes a whole buffer to a stream such as stdout, retrying short writes
+ */
+static int write_full(int fd, const void *buffer, size_t length) {
+    const uint8_t *p = (const uint8_t *)buffer;
+    while (length > 0) {
+        ssize_t n = write(fd, p, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/*
+ * pread that keeps going until length bytes have been read
+ */
+static int pread_full(int fd, void *buffer, size_t length, off_t offset) {
+    uint8_t *p = (uint8_t *)buffer;
+    while (length > 0) {
+        ssize_t n = pread(fd, p, length, offset);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        length -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/*
+ * Tells whether in_off is at or past the end of the image, for copy
+ * calls that moved no data
+ */
+static int ext2_copy_at_eof(ext2_fs_t *fs, off_t in_off) {
+    struct stat st;
+    if (fs->map) {
+        return (size_t)in_off >= fs->map_size;
+    }
+    return fstat(fs->fd, &st) == 0 && in_off >= st.st_size;
+}
+
+/*
+ * Moves length bytes from the image to out_fd without passing them
+ * through user space. Returns 0 when everything was copied, 1 when the
+ * kernel cannot do it for this pair of files (fs->copy_mode is lowered
+ * so later copies skip the attempt) and -1 on I/O error. A partial copy
+ * before falling back is fine: offsets are advanced as data moves.
+ */
+static int ext2_copy_kernel(ext2_fs_t *fs, int out_fd, off_t *in_off, off_t *out_off,
+                            uint64_t *length) {
+    /* copy_mode is shared by worker threads; it only ever moves down */
+    while (*length > 0 && __atomic_load_n(&fs->copy_mode, __ATOMIC_RELAXED) == EXT2_COPY_RANGE) {
+        size_t want = (*length > (1u << 30)) ? (1u << 30) : (size_t)*length;
+        ssize_t n = copy_file_range(fs->fd, in_off, out_fd, out_off, want, 0);
+        if (n > 0) {
+            *length -= n;
+            continue;
+        }
+        if (n < 0 && errno != ENOSYS && errno != EXDEV && errno != EINVAL &&
+            errno != EOPNOTSUPP && errno != EBADF) {
+            perror("Error copying file data");
+            return -1;
+        }
+        if (n == 0 && ext2_copy_at_eof(fs, *in_off)) {
+            fprintf(stderr, "File data at offset %lld lies beyond the end of the image\n",
+                    (long long)*in_off);
+            return -1;
+        }
+        /* Unsupported, or 0 bytes from a file system that cannot do it */
+        __atomic_store_n(&fs->copy_mode, EXT2_COPY_SENDFILE, __ATOMIC_RELAXED);
+    }
+    
+    if (*length > 0 && __atomic_load_n(&fs->copy_mode, __ATOMIC_RELAXED) == EXT2_COPY_SENDFILE) {
+        /* sendfile writes at the current offset of out_fd */
+        if (lseek(out_fd, *out_off, SEEK_SET) != *out_off) {
+            perror("Error seeking in output file");
+            return -1;
+        }
+        while (*length > 0) {
+            size_t want = (*length > (1u << 30)) ? (1u << 30) : (size_t)*length;
+            ssize_t n = sendfile(out_fd, fs->fd, in_off, want);
+            if (n > 0) {
+                *length -= n;
+                *out_off += n;
+                continue;
+            }
+            if (n < 0 && errno != ENOSYS && errno != EINVAL) {
+                perror("Error copying file data");
+                return -1;
+            }
+            if (n == 0 && ext2_copy_at_eof(fs, *in_off)) {
+                fprintf(stderr, "File data at offset %lld lies beyond the end of the image\n",
+                        (long long)*in_off);
+                return -1;
+            }
+            __atomic_store_n(&fs->copy_mode, EXT2_COPY_BUFFERED, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    
+    return (*length > 0) ? 1 : 0;
+}
+
+/*
+ * Copies length bytes starting at disk block physical into out_fd at
+ * out_off. Prefers an in-kernel copy and falls back to writing straight
+ * from the mapping, or to pread into chunk (EXT2_COPY_CHUNK bytes).
+ */
+static int ext2_copy_run(ext2_fs_t *fs, int out_fd, uint32_t physical, uint64_t length,
+                         off_t out_off, uint8_t *chunk) {
+    uint32_t block_size = 1024 << fs->superblock.s_log_block_size;
+    off_t in_off = (off_t)physical * block_size;
+    
+    if (__atomic_load_n(&fs->copy_mode, __ATOMIC_RELAXED) != EXT2_COPY_BUFFERED) {
+        int rc = ext2_copy_kernel(fs, out_fd, &in_off, &out_off, &length);
+        if (rc <= 0) {
+            return rc;
+        }
+    }
+    
+    while (length > 0) {
+        size_t n = (length < EXT2_COPY_CHUNK) ? (size_t)length : EXT2_COPY_CHUNK;
+        const uint8_t *data;
+        
+        if (fs->map) {
+            if ((size_t)in_off + n > fs->map_size) {
+                fprintf(stderr, "File data at offset %lld lies beyond the end of the image\n",
+                        (long long)in_off);
+                return -1;
+            }
+            data = fs->map + in_off;
+        } else {
+            /* in_off may sit mid-block after a partial kernel copy */
+            ssize_t got = pread(fs->fd, chunk, n, in_off);
+            if (got == 0) {
+                fprintf(stderr, "File data at offset %lld lies beyond the end of the image\n",
+                        (long long)in_off);
+                return -1;
+            }
+            if (got < 0) {
+                perror("Error reading file data");
+                return -1;
+            }
+            n = got;
+            data = chunk;
+        }
+        
+        if (pwrite_full(out_fd, data, n, out_off) != 0) {
+            perror("Error writing to output file");
+            return -1;
+        }
+        
+        in_off += n;
+        out_off += n;
+        length -= n;
+    }
+    
+    return 0;
+}
+
+/*
+ * Sets up an io_uring with room for entries requests. Returns -1 when
+ * the kernel has no io_uring (or it is blocked), without printing.
+ */
+static int ext2_uring_init(ext2_uring_t *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+        (void *)ring->sqes == MAP_FAILED) {
+        if (ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+        if (ring->cq_ring != MAP_FAILED) munmap(ring->cq_ring, ring->cq_ring_size);
+        if ((void *)ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+        close(ring->fd);
+        return -1;
+    }
+    
+    uint8_t *sq = (uint8_t *)ring->sq_ring;
+    uint8_t *cq = (uint8_t *)ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    
+    return 0;
+}
+
+static void ext2_uring_free(ext2_uring_t *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/*
+ * Queues a read of length bytes at offset into buffer, tagged with slot
+ */
+static void ext2_uring_queue_read(ext2_uring_t *ring, int fd, void *buffer, unsigned length,
+                                  off_t offset, unsigned slot) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = length;
+    sqe->off = (uint64_t)offset;
+    sqe->user_data = slot;
+    
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Writes out one completed io_uring read, counted as a copy call
+ */
+static int ext2_uring_write(ext2_fs_t *fs, int out_fd, const uint8_t *data, size_t length,
+                            off_t out_off) {
+    uint32_t block_size = 1024 << fs->superblock.s_log_block_size;
+    uint64_t start = ext2_stats_begin();
+    int rc = pwrite_full(out_fd, data, length, out_off);
+    ext2_stats_end(EXT2_STAT_COPY, start, rc == 0 ? length : 0,
+                   (uint32_t)((length + block_size - 1) / block_size));
+    return rc;
+}
+
+/*
+ * Copies file blocks with io_uring: up to fs->uring_depth reads of
+ * EXT2_URING_CHUNK bytes are kept in flight while completed ones are
+ * written out, so the device always has a queue of work. Returns 0 on
+ * success, -1 on error and 1 when io_uring is unavailable; since all
+ * writes land at fixed offsets the caller can simply redo the range on
+ * the synchronous path in that case.
+ */
+static int ext2_copy_blocks_uring(ext2_fs_t *fs, ext2_bmap_t *bm, int out_fd, uint64_t file_size) {
+    uint32_t block_size = 1024 << fs->superblock.s_log_block_size;
+    unsigned depth = (unsigned)fs->uring_depth;
+    
+    ext2_uring_t ring;
+    if (ext2_uring_init(&ring, depth) != 0) {
+        return 1;
+    }
+    
+    /* Per-slot request state; a slot is busy while its read is in flight */
+    uint8_t *buffers = (uint8_t *)malloc((size_t)depth * EXT2_URING_CHUNK);
+    off_t *in_offs = (off_t *)malloc(depth * sizeof(off_t));
+    off_t *out_offs = (off_t *)malloc(depth * sizeof(off_t));
+    unsigned *lengths = (unsigned *)malloc(depth * sizeof(unsigned));
+    unsigned *free_slots = (unsigned *)malloc(depth * sizeof(unsigned));
+    if (!buffers || !in_offs || !out_offs || !lengths || !free_slots) {
+        perror("Error allocating io_uring buffers");
+        free(buffers); free(in_offs); free(out_offs); free(lengths); free(free_slots);
+        ext2_uring_free(&ring);
+        return -1;
+    }
+    unsigned nfree = depth;
+    for (unsigned i = 0; i < depth; i++) {
+        free_slots[i] = i;
+    }
+    
+    int result = 0;
+    int more = 1;
+    unsigned queued = 0;                    /* In the submission ring, not yet taken */
+    unsigned inflight = 0;                  /* Taken by the kernel, not yet completed */
+    ext2_extent_t ext;
+    uint64_t ext_done = 0;                  /* Bytes of ext already queued */
+    uint64_t ext_len = 0;
+    
+    while (result == 0 && (more || queued > 0 || inflight > 0)) {
+        /* Fill every free slot with the next piece of the file */
+        while (more && nfree > 0) {
+            if (ext_done == ext_len) {
+                more = ext2_bmap_next(bm, &ext);
+                if (more < 0) {
+                    result = -1;
+                    break;
+                }
+                if (more == 0) {
+                    break;
+                }
+                if (ext.physical == 0) {
+                    ext_done = ext_len = 0;  /* Hole: nothing to read */
+                    continue;
+                }
+                if ((uint64_t)ext.physical + ext.length > fs->superblock.s_blocks_count) {
+                    fprintf(stderr, "Corrupt block pointer: %u\n", ext.physical);
+                    result = -1;
+                    break;
+                }
+                uint64_t start = (uint64_t)ext.logical * block_size;
+                ext_len = (uint64_t)ext.length * block_size;
+                if (start + ext_len > file_size) {
+                    ext_len = file_size - start;  /* Partial tail block */
+                }
+                ext_done = 0;
+                continue;
+            }
+            
+            unsigned slot = free_slots[--nfree];
+            uint64_t n = ext_len - ext_done;
+            lengths[slot] = (unsigned)(n < EXT2_URING_CHUNK ? n : EXT2_URING_CHUNK);
+            in_offs[slot] = (off_t)ext.physical * block_size + ext_done;
+            out_offs[slot] = (off_t)ext.logical * block_size + ext_done;
+            ext2_uring_queue_read(&ring, fs->fd, buffers + (size_t)slot * EXT2_URING_CHUNK,
+                                  lengths[slot], in_offs[slot], slot);
+            ext_done += lengths[slot];
+            queued++;
+        }
+        if (result != 0 || (queued == 0 && inflight == 0)) {
+            break;
+        }
+        
+        /* Submit the queued reads and wait for at least one to finish; the
+         * kernel may take only some of them, the rest go next time round */
+        long submitted = syscall(__NR_io_uring_enter, ring.fd, queued, 1, IORING_ENTER_GETEVENTS,
+                                 NULL, 0);
+        if (submitted < 0) {
+            if (errno != EINTR) {
+                result = (errno == ENOSYS || errno == EPERM) ? 1 : -1;
+                if (result < 0) {
+                    perror("Error waiting for io_uring");
+                }
+                break;
+            }
+            submitted = 0;
+        }
+        queued -= (unsigned)submitted;
+        inflight += (unsigned)submitted;
+        
+        /* Write out whatever completed while later reads stay queued */
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail && result == 0) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            unsigned slot = (unsigned)cqe->user_data;
+            int res = cqe->res;
+            head++;
+            inflight--;
+            
+            if (res == -EINVAL || res == -EOPNOTSUPP) {
+                result = 1;  /* Kernel predates IORING_OP_READ */
+            } else if (res == 0) {
+                fprintf(stderr, "File data at offset %lld lies beyond the end of the image\n",
+                        (long long)in_offs[slot]);
+                result = -1;
+            } else if (res < 0) {
+                errno = -res;
+                perror("Error reading file data");
+                result = -1;
+            } else if (ext2_uring_write(fs, out_fd, buffers + (size_t)slot * EXT2_URING_CHUNK,
+                                        (size_t)res, out_offs[slot]) != 0) {
+                perror("Error writing to output file");
+                result = -1;
+            } else if ((unsigned)res < lengths[slot]) {
+                /* Short read: queue the remainder in the same slot */
+                in_offs[slot] += res;
+                out_offs[slot] += res;
+                lengths[slot] -= res;
+                ext2_uring_queue_read(&ring, fs->fd, buffers + (size_t)slot * EXT2_URING_CHUNK,
+                                      lengths[slot], in_offs[slot], slot);
+                queued++;
+            } else {
+                free_slots[nfree++] = slot;
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    
+    /* Don't free buffers the kernel may still be writing into */
+    while (inflight > 0) {
+        if (syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+            errno != EINTR) {
+            break;
+        }
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        inflight -= tail - head;
+        __atomic_store_n(ring.cq_head, tail, __ATOMIC_RELEASE);
+    }
+    
+    free(buffers); free(in_offs); free(out_offs); free(lengths); free(free_slots);
+    ext2_uring_free(&ring);
+    return result;
+}
+
+/*
+ * Copies file blocks [first, first + count) of an inode into out_fd at
+ * the same offsets, one physically contiguous run at a time. Holes are
+ * left unwritten, so the caller sizes the output with ftruncate. Safe to
+ * call from several threads on disjoint ranges of the same file as long
+ * as each has its own out_fd.
+ */
+int ext2_copy_blocks(ext2_fs_t *fs, const ext2_inode_t *inode, int out_fd,
+                     uint32_t first, uint32_t count) {
+    uint32_t block_size = 1024 << fs->superblock.s_log_block_size;
+    uint64_t file_size = ext2_inode_size(fs, inode);
+    
+    ext2_bmap_t bm;
+    if (ext2_bmap_open(&bm, fs, inode) != 0) {
+        return -1;
+    }
+    if ((uint64_t)first + count < bm.count) {
+        bm.count = first + count;
+    }
+    bm.next = first;
+    
+    /* Large ranges go through io_uring when it is enabled and available */
+    if (fs->uring_depth > 0 && bm.count > first &&
+        (uint64_t)(bm.count - first) * block_size >= 2 * EXT2_URING_CHUNK) {
+        int rc = ext2_copy_blocks_uring(fs, &bm, out_fd, file_size);
+        if (rc <= 0) {
+            ext2_bmap_close(&bm);
+            return rc;
+        }
+        __atomic_store_n(&fs->uring_depth, 0, __ATOMIC_RELAXED);
+        bm.next = first;
+    }
+    
+    if (ext2_bmap_readahead(&bm) != 0) {
+        ext2_bmap_close(&bm);
+        return -1;
+    }
+    
+    /* Staging buffer, only needed when reading with pread */
+    uint8_t *chunk = NULL;
+    if (!fs->map) {
+        uint64_t range = (uint64_t)(bm.count > first ? bm.count - first : 0) * block_size;
+        chunk = (uint8_t *)malloc(range < EXT2_COPY_CHUNK ? range + 1 : EXT2_COPY_CHUNK);
+        if (!chunk) {
+            perror("Error allocating memory for copy buffer");
+            ext2_bmap_close(&bm);
+            return -1;
+        }
+    }
+    
+    int result = 0;
+    ext2_extent_t ext;
+    int more;
+    while ((more = ext2_bmap_next(&bm, &ext)) > 0) {
+        uint64_t start = (uint64_t)ext.logical * block_size;
+        uint64_t length = (uint64_t)ext.length * block_size;
+        if (start + length > file_size) {
+            length = file_size - start;  /* Partial tail block */
+        }
+        
+        if (ext.physical == 0) {
+            /* Hole: leave it unwritten so the output stays sparse */
+        } else if ((uint64_t)ext.physical + ext.length > fs->superblock.s_blocks_count) {
+            fprintf(stderr, "Corrupt block pointer: %u\n", ext.physical);
+            result = -1;
+        } else {
+            uint64_t t0 = ext2_stats_begin();
+            result = ext2_copy_run(fs, out_fd, ext.physical, length, (off_t)start, chunk);
+            ext2_stats_end(EXT2_STAT_COPY, t0, result == 0 ? length : 0, ext.length);
+        }
+        
+        if (result != 0) {
+            break;
+        }
+    }
+    if (more < 0) {
+        result = -1;
+    }
+    
+    ext2_bmap_close(&bm);
+    free(chunk);
+    return result;
+}
+
+/*
+ * Starts iterating over a directory. No memory is allocated per entry;
+ * the block buffer is only needed when the image is not mapped.
+ */
+int ext2_dir_open(ext2_dir_t *dir, ext2_fs_t *fs, const ext2_inode_t *inode) {
+    memset(dir, 0, sizeof(*dir));
+    dir->fs = fs;
+    dir->block_size = 1024 << fs->superblock.s_log_block_size;
+    
+    if (!fs->map) {
+        dir->buf = (uint8_t *)malloc(dir->block_size);
+        if (!dir->buf) {
+            perror("Error allocating memory for directory block");
+            return -1;
+        }
+    }
+    
+    if (ext2_bmap_open(&dir->bm, fs, inode) != 0 || ext2_bmap_readahead(&dir->bm) != 0) {
+        ext2_bmap_close(&dir->bm);
+        free(dir->buf);
+        dir->buf = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Returns the next live entry of the directory in *ent: 1 when one was
+ * found, 0 at the end and -1 on read errors. The name stays valid until
+ * the next call.
+ */
+int ext2_dir_next(ext2_dir_t *dir, ext2_dirent_t *ent) {
+    for (;;) {
+        if (dir->data && ext2r_dirent_parse(dir->data, dir->block_size, &dir->offset, ent)) {
+            return 1;
+        }
+        dir->data = NULL;
+        
+        if (dir->ext_pos == dir->ext.length) {
+            int more = ext2_bmap_next(&dir->bm, &dir->ext);
+            if (more <= 0) {
+                return more;
+            }
+            dir->ext_pos = 0;
+        }
+        if (dir->ext.physical == 0) {
+            dir->ext_pos = dir->ext.length;  /* Holes hold no entries */
+            continue;
+        }
+        
+        dir->data = ext2_get_block(dir->fs, dir->ext.physical + dir->ext_pos, dir->buf);
+        if (!dir->data) {
+            return -1;
+        }
+        dir->ext_pos++;
+        dir->offset = 0;
+    }
+}
+
+/*
+ * Ends an iteration
+ */
+void ext2_dir_close(ext2_dir_t *dir) {
+    ext2_bmap_close(&dir->bm);
+    free(dir->buf);
+    dir->buf = NULL;
+}
+
+/*
+ * Calls fn for every live entry of a directory, across all of its
+ * blocks including those behind indirect pointers.
+ */
+int ext2_dir_foreach(ext2_fs_t *fs, const ext2_inode_t *dir, ext2_dir_fn fn, void *ctx) {
+    ext2_dir_t it;
+    ext2_dirent_t ent;
+    int more;
+    
+    if (ext2_dir_open(&it, fs, dir) != 0) {
+        return -1;
+    }
+    while ((more = ext2_dir_next(&it, &ent)) > 0) {
+        if (fn(ctx, ent.ino, ent.file_type, ent.name, ent.name_len)) {
+            break;
+        }
+    }
+    ext2_dir_close(&it);
+    return more < 0 ? -1 : 0;
+}
+
+/*
+ * Opens a file for ext2_file_pread
+ */
+int ext2_file_open(ext2_file_t *file, ext2_fs_t *fs, const ext2_inode_t *inode) {
+    memset(file, 0, sizeof(*file));
+    file->fs = fs;
+    file->inode = *inode;
+    file->size = ext2_inode_size(fs, inode);
+    
+    return ext2_bmap_open(&file->bm, fs, &file->inode);
+}
+
+/*
+ * Reads up to count bytes at offset. Returns the number of bytes read,
+ * short only at the end of the file, or -1 on errors. Holes read as
+ * zeros. The offset is mapped to its block directly through the
+ * direct/indirect slots (with the indirect blocks cached in the file's
+ * block map), and each run of blocks that is contiguous on disk is
+ * fetched with one copy or one pread straight into buf. Not safe to
+ * call on the same file from several threads.
+ */
+ssize_t ext2_file_pread(ext2_file_t *file, void *buf, size_t count, uint64_t offset) {
+    ext2_fs_t *fs = file->fs;
+    uint32_t block_size = 1024 << fs->superblock.s_log_block_size;
+    uint8_t *out = (uint8_t *)buf;
+    
+    if (offset >= file->size) {
+        return 0;
+    }
+    if (count > file->size - offset) {
+        count = (size_t)(file->size - offset);
+    }
+    
+    size_t done = 0;
+    while (done < count) {
+        uint64_t pos = offset + done;
+        uint32_t logical = (uint32_t)(pos / block_size);
+        uint32_t within = (uint32_t)(pos % block_size);
+        uint64_t wanted = (within + (uint64_t)(count - done) + block_size - 1) / block_size;
+        
+        uint32_t physical;
+        uint64_t hole_run;
+        if (ext2_bmap_map(&file->bm, logical, &physical, &hole_run) != 0) {
+            return -1;
+        }
+        
+        /* Extend the run while the next block continues it */
+        uint64_t run = (physical == 0) ? hole_run : 1;
+        while (run < wanted) {
+            uint32_t next;
+            uint64_t next_hole;
+            if (ext2_bmap_map(&file->bm, logical + (uint32_t)run, &next, &next_hole) != 0) {
+                return -1;
+            }
+            if (physical == 0 && next == 0) {
+                run += next_hole;
+            } else if (physical != 0 && next == physical + run) {
+                run++;
+            } else {
+                break;
+            }
+        }
+        
+        size_t n = (size_t)(run * block_size - within);
+        if (n > count - done) {
+            n = count - done;
+        }
+        
+        if (physical == 0) {
+            memset(out + done, 0, n);
+        } else if ((uint64_t)physical + run > fs->superblock.s_blocks_count) {
+            fprintf(stderr, "Corrupt block pointer: %u\n", physical);
+            return -1;
+        } else {
+            off_t start = (off_t)physical * block_size + within;
+            uint64_t t0 = ext2_stats_begin();
+            if (fs->map) {
+                if ((size_t)start + n > fs->map_size) {
+                    fprintf(stderr, "Block %u lies beyond the end of the image\n", physical);
+                    return -1;
+                }
+                memcpy(out + done, fs->map + start, n);
+            } else if (pread_full(fs->fd, out + done, n, start) != 0) {
+                perror("Error reading file data");
+                return -1;
+            }
+            ext2_stats_end(EXT2_STAT_BLOCK_READ, t0, n, (uint32_t)run);
+        }
+        done += n;
+    }
+    
+    return (ssize_t)done;
+}
+
+/*
+ * Ends reads from a file
+ */
+void ext2_file_close(ext2_file_t *file) {
+    ext2_bmap_close(&file->bm);
+}
+
+/*
+ * Reads the target of a symbolic link into buf, NUL-terminated and
+ * truncated to fit. Short targets are stored in i_block itself.
+ * Returns the target length or -1 on errors.
+ */
+ssize_t ext2_readlink(ext2_fs_t *fs, const ext2_inode_t *inode, char *buf, size_t size) {
+    uint64_t length = ext2_inode_size(fs, inode);
+    
+    if ((inode->i_mode & EXT2_S_IFMT) != EXT2_S_IFLNK || size == 0) {
+        return -1;
+    }
+    if (length > size - 1) {
+        length = size - 1;
+    }
+    
+    if (ext2r_fast_symlink(&fs->superblock, inode) && length <= sizeof(inode->i_block)) {
+        memcpy(buf, inode->i_block, (size_t)length);
+    } else {
+        ext2_file_t file;
+        if (ext2_file_open(&file, fs, inode) != 0) {
+            return -1;
+        }
+        ssize_t n = ext2_file_pread(&file, buf, (size_t)length, 0);
+        ext2_file_close(&file);
+        if (n < 0) {
+            return -1;
+        }
+        length = (uint64_t)n;
+    }
+    
+    buf[length] = '\0';
+    return (ssize_t)length;
+}
+
+/*
+ * Writes length bytes of a file starting at offset to stdout. A negative
+ * offset counts back from the end of the file and a length of 0 reads
+ * to the end, so a trailer can be read without knowing the file size.
+ */
+int ext2_cat(ext2_fs_t *fs, const char *path, int64_t offset, uint64_t length) {
+    uint32_t inode_num = ext2_find_inode(fs, path);
+    if (inode_num == 0) {
+        fprintf(stderr, "File not found: %s\n", path);
+        return -1;
+    }
+    
+    ext2_inode_t inode;
+    if (ext2_read_inode(fs, inode_num, &inode) != 0) {
+        return -1;
+    }
+    if ((inode.i_mode & EXT2_S_IFMT) != EXT2_S_IFREG) {
+        fprintf(stderr, "Not a regular file: %s\n", path);
+        return -1;
+    }
+    
+    ext2_file_t file;
+    if (ext2_file_open(&file, fs, &inode) != 0) {
+        return -1;
+    }
+    
+    uint64_t pos;
+    if (offset < 0) {
+        uint64_t back = (uint64_t)-(offset + 1) + 1;
+        pos = (back > file.size) ? 0 : file.size - back;
+    } else {
+        pos = (uint64_t)offset;
+    }
+    uint64_t end = file.size;
+    if (length != 0 && pos < end && length < end - pos) {
+        end = pos + length;
+    }
+    
+    uint8_t *chunk = NULL;
+    if (pos < end) {
+        chunk = (uint8_t *)malloc(end - pos < EXT2_COPY_CHUNK ? (size_t)(end - pos) : EXT2_COPY_CHUNK);
+        if (!chunk) {
+            perror("Error allocating copy buffer");
+            ext2_file_close(&file);
+            return -1;
+        }
+    }
+    
+    /* Anything already buffered on stdout has to come first */
+    fflush(stdout);
+    
+    int result = 0;
+    while (pos < end) {
+        size_t want = (end - pos < EXT2_COPY_CHUNK) ? (size_t)(end - pos) : EXT2_COPY_CHUNK;
+        ssize_t n = ext2_file_pread(&file, chunk, want, pos);
+        if (n <= 0) {
+            result = -1;
+            break;
+        }
+        if (write_full(STDOUT_FILENO, chunk, (size_t)n) != 0) {
+            perror("Error writing to stdout");
+            result = -1;
+            break;
+        }
+        pos += (uint64_t)n;
+    }
+    
+    free(chunk);
+    ext2_file_close(&file);
+    return result;
+}
+
+/* Identifies the pool and worker slot of the current thread */
+static __thread ext2_pool_t *pool_self;
+static __thread int pool_index;
+
+/*
+ * Appends a task at the tail of a deque, growing the ring when full.
+ * Returns -1 when the ring cannot grow.
+ */
+static int ext2_deque_push(ext2_deque_t *q, ext2_task_t task) {
+    pthread_mutex_lock(&q->lock);
+    if (q->count == q->capacity) {
+        size_t capacity = q->capacity ? q->capacity * 2 : 64;
+        ext2_task_t *tasks = (ext2_task_t *)malloc(capacity * sizeof(ext2_task_t));
+        if (!tasks) {
+            pthread_mutex_unlock(&q->lock);
+            perror("Error growing task queue");
+            return -1;
+        }
+        for (size_t i = 0; i < q->count; i++) {
+            tasks[i] = q->tasks[(q->head + i) % q->capacity];
+        }
+        free(q->tasks);
+        q->tasks = tasks;
+        q->head = 0;
+        q->capacity = capacity;
+    }
+    q->tasks[(q->head + q->count) % q->capacity] = task;
+    q->count++;
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+/*
+ * Takes a task from the tail (owner) or the head (thief) of a deque
+ */
+static int ext2_deque_take(ext2_deque_t *q, int steal, ext2_task_t *task) {
+    int found = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0) {
+        if (steal) {
+            *task = q->tasks[q->head];
+            q->head = (q->head + 1) % q->capacity;
+        } else {
+            *task = q->tasks[(q->head + q->count - 1) % q->capacity];
+        }
+        q->count--;
+        found = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+static void *ext2_pool_worker(void *arg) {
+    ext2_worker_t *self = (ext2_worker_t *)arg;
+    ext2_pool_t *pool = self->pool;
+    
+    pool_self = pool;
+    pool_index = self->index;
+    
+    for (;;) {
+        /* Reserve one of the queued tasks, or sleep until there is one */
+        pthread_mutex_lock(&pool->lock);
+        while (pool->queued == 0 && !pool->stop) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        if (pool->queued == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+        
+        /* Newest own work first, otherwise the oldest work of a neighbour */
+        ext2_task_t task;
+        int found = ext2_deque_take(&pool->queues[self->index], 0, &task);
+        for (int i = 1; !found; i++) {
+            found = ext2_deque_take(&pool->queues[(self->index + i) % pool->nthreads], 1, &task);
+        }
+        
+        task.fn(task.arg);
+        
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0) {
+            pthread_cond_broadcast(&pool->all_done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    
+    ext2_stats_release();
+    return NULL;
+}
+
+/*
+ * Starts a pool of nthreads workers
+ */
+ext2_pool_t *ext2_pool_create(int nthreads) {
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    
+    ext2_pool_t *pool = (ext2_pool_t *)calloc(1, sizeof(ext2_pool_t));
+    if (!pool) {
+        perror("Error allocating thread pool");
+        return NULL;
+    }
+    pool->workers = (ext2_worker_t *)calloc(nthreads, sizeof(ext2_worker_t));
+    pool->queues = (ext2_deque_t *)calloc(nthreads, sizeof(ext2_deque_t));
+    if (!pool->workers || !pool->queues) {
+        perror("Error allocating thread pool");
+        free(pool->workers);
+        free(pool->queues);
+        free(pool);
+        return NULL;
+    }
+    
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->all_done, NULL);
+    for (int i = 0; i < nthreads; i++) {
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+    }
+    
+    for (int i = 0; i < nthreads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        if (pthread_create(&pool->workers[i].thread, NULL, ext2_pool_worker, &pool->workers[i]) != 0) {
+            perror("Error starting worker thread");
+            break;
+        }
+        pool->nthreads = i + 1;
+    }
+    
+    if (pool->nthreads == 0) {
+        ext2_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/*
+ * Queues a task. From a worker it goes onto that worker's own deque,
+ * from anywhere else the deques are filled round-robin. Returns -1 when
+ * the task could not be queued; it then never runs and arg still
+ * belongs to the caller.
+ */
+int ext2_pool_submit(ext2_pool_t *pool, ext2_task_fn fn, void *arg) {
+    ext2_task_t task = { fn, arg };
+    int target;
+    
+    /* Count it as pending before any thread can finish it */
+    pthread_mutex_lock(&pool->lock);
+    pool->pending++;
+    target = (pool_self == pool) ? pool_index : (int)(pool->next_queue++ % pool->nthreads);
+    pthread_mutex_unlock(&pool->lock);
+    
+    if (ext2_deque_push(&pool->queues[target], task) != 0) {
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0) {
+            pthread_cond_broadcast(&pool->all_done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pthread_cond_signal(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+/*
+ * Blocks until every submitted task, including ones queued by other
+ * tasks, has finished
+ */
+void ext2_pool_wait(ext2_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->all_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Stops the workers once the queues drain and frees the pool
+ */
+void ext2_pool_destroy(ext2_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+    
+    for (int i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    for (int i = 0; i < pool->nthreads; i++) {
+        pthread_mutex_destroy(&pool->queues[i].lock);
+        free(pool->queues[i].tasks);
+    }
+    
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_cond_destroy(&pool->all_done);
+    free(pool->queues);
+    free(pool->workers);
+    free(pool);
+}
+
+/*
+ * Lists files in a directory (ls implementation)
+ */
+int ext2_ls(ext2_fs_t *fs, const char *path) {
+    uint32_t inode_num = ext2_find_inode(fs, path);
+    if (inode_num == 0) {
+        fprintf(stderr, "Directory not found: %s\n", path);
+        return -1;
+    }
+    
+    ext2_inode_t inode;
+    if (ext2_read_inode(fs, inode_num, &inode) != 0) {
+        return -1;
+    }
+    
+    /* Check if it's a directory */
+    if ((inode.i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR) {
+        fprintf(stderr, "Not a directory: %s\n", path);
+        return -1;
+    }
+    
+    ext2_dir_t it;
+    if (ext2_dir_open(&it, fs, &inode) != 0) {
+        return -1;
+    }
+    
+    /* Listing a directory without an HTree is a full scan anyway: keep
+     * its names, so later lookups in it go through the in-memory index */
+    ext2_dindex_build_t build;
+    memset(&build, 0, sizeof(build));
+    int collect = fs->dindex &&
+                  !((inode.i_flags & EXT2_INDEX_FL) &&
+                    (fs->superblock.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)) &&
+                  !ext2_dindex_present(fs, inode_num);
+    
+    printf("Contents of '%s':\n", path);
+    printf("%-30s %-10s %-10s\n", "Name", "Type", "Inode");
+    printf("----------------------------------------------\n");
+    
+    /* Read directory entries from all data blocks */
+    ext2_dirent_t ent;
+    int more;
+    while ((more = ext2_dir_next(&it, &ent)) > 0) {
+        const char *type_str = "unknown";
+        switch (ent.file_type) {
+            case EXT2_FT_REG_FILE: type_str = "file"; break;
+            case EXT2_FT_DIR: type_str = "dir"; break;
+            case EXT2_FT_SYMLINK: type_str = "link"; break;
+        }
+        
+        printf("%-30.*s %-10s %-10u\n", (int)ent.name_len, ent.name, type_str, ent.ino);
+        
+        if (collect && ext2_dindex_collect(&build, ent.ino, ent.file_type, ent.name,
+                                           ent.name_len) != 0) {
+            collect = 0;  /* Out of memory: list without indexing */
+        }
+    }
+    
+    ext2_dir_close(&it);
+    if (collect && more == 0) {
+        ext2_dindex_t *built = ext2_dindex_finish(&build, inode_num);
+        if (built) {
+            ext2_dindex_add(fs, built);
+        }
+    } else {
+        free(build.entries);
+        free(build.names);
+    }
+    return more < 0 ? -1 : 0;
+}
+
+int ext2_cp(ext2_fs_t *fs, const char *src, const char *dst) {
+    uint32_t inode_num = ext2_find_inode(fs, src);
+    if (inode_num == 0) {
+        fprintf(stderr, "File not found: %s\n", src);
+        return -1;
+    }
+    
+    ext2_inode_t inode;
+    if (ext2_read_inode(fs, inode_num, &inode) != 0) {
+        return -1;
+    }
+    
+    /* Check if it's a regular file */
+    if ((inode.i_mode & EXT2_S_IFMT) != EXT2_S_IFREG) {
+        fprintf(stderr, "Not a regular file: %s\n", src);
+        return -1;
+    }
+    
+    /* Create output file */
+    int out_fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        perror("Error creating output file");
+        return -1;
+    }
+    
+    uint64_t file_size = ext2_inode_size(fs, &inode);
+    
+    /* File data is streamed front to back */
+    ext2_advise(fs, 0, 0, EXT2_ADVISE_SEQUENTIAL);
+    
+    int result = ext2_copy_blocks(fs, &inode, out_fd, 0, UINT32_MAX);
+    
+    /* Extends the file over a trailing hole */
+    if (result == 0 && ftruncate(out_fd, (off_t)file_size) != 0) {
+        perror("Error setting output file size");
+        result = -1;
+    }
+    
+    ext2_advise(fs, 0, 0, EXT2_ADVISE_RANDOM);
+    close(out_fd);
+    
+    if (result != 0) {
+        return -1;
+    }
+    
+    printf("File copied: %s -> %s (%llu bytes)\n", src, dst, (unsigned long long)file_size);
+    return 0;
+}
+
+/* Shared state of one parallel extraction */
+typedef struct {
+    ext2_fs_t *fs;
+    ext2_pool_t *pool;
+    uint32_t chunk_blocks;              /* File blocks per copy task */
+    int recursive;
+    unsigned long files;                /* Updated atomically by workers */
+    unsigned long long bytes;
+    unsigned long failed;
+} cp_job_t;
+
+/* A file being extracted; freed by whichever task finishes it last */
+typedef struct {
+    cp_job_t *job;
+    ext2_inode_t inode;
+    uint64_t size;
+    int tasks_left;
+    int failed;
+    char *src;
+    char *dst;
+} cp_file_t;
+
+/* One block range of a file, the unit of work handed to the pool */
+typedef struct {
+    cp_file_t *file;
+    uint32_t first;
+    uint32_t count;
+} cp_task_t;
+
+static void cp_file_done(cp_file_t *file) {
+    cp_job_t *job = file->job;
+    if (file->failed) {
+        __atomic_add_fetch(&job->failed, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&job->files, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&job->bytes, file->size, __ATOMIC_RELAXED);
+        printf("File copied: %s -> %s (%llu bytes)\n", file->src, file->dst,
+               (unsigned long long)file->size);
+    }
+    free(file->src);
+    free(file->dst);
+    free(file);
+}
+
+/*
+ * Pool task: copies one block range of a file through its own output fd
+ */
+static void cp_task_run(void *arg) {
+    cp_task_t *task = (cp_task_t *)arg;
+    cp_file_t *file = task->file;
+    
+    int out_fd = open(file->dst, O_WRONLY);
+    if (out_fd < 0) {
+        perror("Error opening output file");
+        __atomic_store_n(&file->failed, 1, __ATOMIC_RELAXED);
+    } else {
+        if (ext2_copy_blocks(file->job->fs, &file->inode, out_fd, task->first, task->count) != 0) {
+            __atomic_store_n(&file->failed, 1, __ATOMIC_RELAXED);
+        }
+        close(out_fd);
+    }
+    
+    if (__atomic_sub_fetch(&file->tasks_left, 1, __ATOMIC_ACQ_REL) == 0) {
+        cp_file_done(file);
+    }
+    free(task);
+}
+
+/*
+ * Creates the output file at its final size and queues its block ranges.
+ * Big files become several tasks so one of them cannot hold up the rest.
+ */
+static int cp_schedule_file(cp_job_t *job, const ext2_inode_t *inode, const char *src,
+                            const char *dst) {
+    uint32_t block_size = 1024 << job->fs->superblock.s_log_block_size;
+    
+    cp_file_t *file = (cp_file_t *)calloc(1, sizeof(cp_file_t));
+    if (!file) {
+        perror("Error allocating copy task");
+        return -1;
+    }
+    file->job = job;
+    file->inode = *inode;
+    file->size = ext2_inode_size(job->fs, inode);
+    file->src = strdup(src);
+    file->dst = strdup(dst);
+    if (!file->src || !file->dst) {
+        perror("Error allocating copy task");
+        file->failed = 1;
+        cp_file_done(file);
+        return -1;
+    }
+    
+    int out_fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0 || ftruncate(out_fd, (off_t)file->size) != 0) {
+        perror("Error creating output file");
+        if (out_fd >= 0) {
+            close(out_fd);
+        }
+        file->failed = 1;
+        cp_file_done(file);
+        return -1;
+    }
+    close(out_fd);
+    
+    uint32_t blocks = (uint32_t)((file->size + block_size - 1) / block_size);
+    uint32_t tasks = (blocks + job->chunk_blocks - 1) / job->chunk_blocks;
+    if (tasks == 0) {
+        cp_file_done(file);  /* Empty file: nothing to copy */
+        return 0;
+    }
+    
+    /* Hold one reference while queueing so early finishers can't free it */
+    file->tasks_left = (int)tasks + 1;
+    for (uint32_t i = 0; i < tasks; i++) {
+        cp_task_t *task = (cp_task_t *)malloc(sizeof(cp_task_t));
+        if (!task) {
+            perror("Error allocating copy task");
+            file->failed = 1;
+            __atomic_sub_fetch(&file->tasks_left, tasks - i, __ATOMIC_ACQ_REL);
+            break;
+        }
+        task->file = file;
+        task->first = i * job->chunk_blocks;
+        task->count = job->chunk_blocks;
+        if (ext2_pool_submit(job->pool, cp_task_run, task) != 0) {
+            free(task);
+            file->failed = 1;
+            __atomic_sub_fetch(&file->tasks_left, tasks - i, __ATOMIC_ACQ_REL);
+            break;
+        }
+    }
+    if (__atomic_sub_fetch(&file->tasks_left, 1, __ATOMIC_ACQ_REL) == 0) {
+        cp_file_done(file);
+    }
+    
+    return 0;
+}
+
+static int cp_walk(cp_job_t *job, uint32_t ino, const char *src, const char *dst);
+
+/*
+ * Checks that a directory entry name is a single path component. A
+ * crafted image can hold names with '/' or NUL in them, which would climb
+ * out of (or cut short) the paths built from them; those are reported and
+ * must be skipped.
+ */
+static int ext2_name_check(const char *parent, const char *name, size_t name_len) {
+    if (name_len == 0 || memchr(name, '/', name_len) || memchr(name, '\0', name_len)) {
+        fprintf(stderr, "Skipping entry with an invalid name in %s\n", parent);
+        return -1;
+    }
+    return 0;
+}
+
+/* Directory walk context handed to ext2_dir_foreach */
+typedef struct {
+    cp_job_t *job;
+    const char *src;
+    const char *dst;
+    int result;
+} cp_dir_ctx_t;
+
+static int cp_dir_entry(void *arg, uint32_t ino, uint8_t file_type, const char *name,
+                        size_t name_len) {
+    cp_dir_ctx_t *ctx = (cp_dir_ctx_t *)arg;
+    (void)file_type;
+    
+    if ((name_len == 1 && name[0] == '.') || (name_len == 2 && name[0] == '.' && name[1] == '.')) {
+        return 0;
+    }
+    if (ext2_name_check(ctx->src, name, name_len) != 0) {
+        ctx->result = -1;
+        return 0;
+    }
+    
+    size_t src_len = strlen(ctx->src);
+    size_t dst_len = strlen(ctx->dst);
+    char *src = (char *)malloc(src_len + name_len + 2);
+    char *dst = (char *)malloc(dst_len + name_len + 2);
+    if (!src || !dst) {
+        perror("Error allocating path");
+        free(src);
+        free(dst);
+        ctx->result = -1;
+        return 1;
+    }
+    
+    /* Avoid a double slash below the root */
+    int src_slash = !(src_len > 0 && ctx->src[src_len - 1] == '/');
+    int dst_slash = !(dst_len > 0 && ctx->dst[dst_len - 1] == '/');
+    sprintf(src, "%s%s%.*s", ctx->src, src_slash ? "/" : "", (int)name_len, name);
+    sprintf(dst, "%s%s%.*s", ctx->dst, dst_slash ? "/" : "", (int)name_len, name);
+    
+    if (cp_walk(ctx->job, ino, src, dst) != 0) {
+        ctx->result = -1;  /* Keep going; report the failure at the end */
+    }
+    
+    free(src);
+    free(dst);
+    return 0;
+}
+
+/*
+ * Extracts one inode: regular files are queued, directories are created
+ * on the host and descended into when copying recursively
+ */
+static int cp_walk(cp_job_t *job, uint32_t ino, const char *src, const char *dst) {
+    ext2_inode_t inode;
+    if (ext2_read_inode(job->fs, ino, &inode) != 0) {
+        return -1;
+    }
+    
+    switch (inode.i_mode & EXT2_S_IFMT) {
+    case EXT2_S_IFREG:
+        return cp_schedule_file(job, &inode, src, dst);
+    case EXT2_S_IFDIR: {
+        if (!job->recursive) {
+            fprintf(stderr, "Omitting directory (use -r): %s\n", src);
+            return -1;
+        }
+        if (mkdir(dst, 0755) != 0 && errno != EEXIST) {
+            perror("Error creating output directory");
+            return -1;
+        }
+        cp_dir_ctx_t ctx = { job, src, dst, 0 };
+        if (ext2_dir_foreach(job->fs, &inode, cp_dir_entry, &ctx) != 0) {
+            return -1;
+        }
+        return ctx.result;
+    }
+    default:
+        fprintf(stderr, "Skipping special file: %s\n", src);
+        return 0;
+    }
+}
+
+/*
+ * Extracts several files, or whole directory trees with recursive set,
+ * into dst_dir. The tree is walked on the calling thread while nthreads
+ * workers copy files; each worker reads with its own pread offsets and
+ * writes through its own output fd, and large files are split into
+ * EXT2_PARALLEL_CHUNK ranges that idle workers steal.
+ */
+int ext2_cp_parallel(ext2_fs_t *fs, char *const srcs[], int nsrcs, const char *dst_dir,
+                     int recursive, int nthreads) {
+    uint32_t block_size = 1024 << fs->superblock.s_log_block_size;
+    
+    if (mkdir(dst_dir, 0755) != 0 && errno != EEXIST) {
+        perror("Error creating output directory");
+        return -1;
+    }
+    
+    cp_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.fs = fs;
+    job.recursive = recursive;
+    job.chunk_blocks = EXT2_PARALLEL_CHUNK / block_size;
+    job.pool = ext2_pool_create(nthreads);
+    if (!job.pool) {
+        return -1;
+    }
+    
+    int result = 0;
+    for (int i = 0; i < nsrcs; i++) {
+        uint32_t ino = ext2_find_inode(fs, srcs[i]);
+        if (ino == 0) {
+            fprintf(stderr, "File not found: %s\n", srcs[i]);
+            result = -1;
+            continue;
+        }
+        
+        /* Each source lands under its own name; "/" copies the contents */
+        const char *base = strrchr(srcs[i], '/');
+        base = base ? base + 1 : srcs[i];
+        size_t dst_len = strlen(dst_dir) + strlen(base) + 2;
+        char *dst = (char *)malloc(dst_len);
+        if (!dst) {
+            perror("Error allocating path");
+            result = -1;
+            break;
+        }
+        snprintf(dst, dst_len, "%s/%s", dst_dir, base);
+        
+        if (cp_walk(&job, ino, srcs[i], dst) != 0) {
+            result = -1;
+        }
+        free(dst);
+    }
+    
+    ext2_pool_wait(job.pool);
+    ext2_pool_destroy(job.pool);
+    
+    printf("Copied %lu files (%llu bytes) using %d threads\n", job.files, job.bytes,
+           nthreads);
+    if (job.failed) {
+        fprintf(stderr, "%lu files failed to copy\n", job.failed);
+        result = -1;
+    }
+    return result;
+}
+
+/* One directory reported by du; children always come after their parent */
+typedef struct {
+    char *path;
+    uint32_t parent;                    /* Index of the parent, UINT32_MAX for the top */
+    uint64_t kib;                       /* Own usage, then that of the whole subtree */
+} walk_node_t;
+
+/* Shared state of one find or du walk */
+typedef struct {
+    ext2_fs_t *fs;
+    ext2_pool_t *pool;
+    const ext2_find_filter_t *filter;   /* Set for find, NULL for du */
+    time_t now;
+    unsigned long failed;               /* Updated atomically by workers */
+    walk_node_t *nodes;                 /* du only, guarded by lock */
+    uint32_t node_count;
+    uint32_t node_capacity;
+    pthread_mutex_t lock;
+} walk_job_t;
+
+/* A directory waiting to be read; the unit of work handed to the pool */
+typedef struct {
+    walk_job_t *job;
+    ext2_inode_t inode;
+    char *path;
+    uint32_t node;
+} walk_task_t;
+
+/* A directory entry held back until its inode is read */
+typedef struct {
+    uint32_t ino;
+    uint32_t name_off;
+    uint8_t name_len;
+} walk_entry_t;
+
+static const char *walk_type_name(uint16_t mode) {
+    switch (mode & EXT2_S_IFMT) {
+    case EXT2_S_IFREG: return "file";
+    case EXT2_S_IFDIR: return "dir";
+    case EXT2_S_IFLNK: return "link";
+    default: return "other";
+    }
+}
+
+/*
+ * Compares a value against a find test: cmp > 0 wants more than
+ * expected, cmp < 0 less and 0 exactly that
+ */
+static int walk_compare(int cmp, uint64_t value, uint64_t expected) {
+    if (cmp > 0) return value > expected;
+    if (cmp < 0) return value < expected;
+    return value == expected;
+}
+
+/*
+ * Prints an entry for find if it passes every test of the filter
+ */
+static void walk_match(walk_job_t *job, const ext2_inode_t *inode, const char *path,
+                       const char *name, size_t name_len) {
+    const ext2_find_filter_t *filter = job->filter;
+    uint64_t size = ext2_inode_size(job->fs, inode);
+    
+    if (filter->mode && (inode->i_mode & EXT2_S_IFMT) != filter->mode) {
+        return;
+    }
+    if (filter->has_size && !walk_compare(filter->size_cmp, size, filter->size)) {
+        return;
+    }
+    if (filter->has_mtime) {
+        int64_t age = (int64_t)job->now - (int64_t)inode->i_mtime;
+        uint64_t days = age > 0 ? (uint64_t)age / 86400 : 0;
+        if (!walk_compare(filter->mtime_cmp, days, filter->mtime_days)) {
+            return;
+        }
+    }
+    if (filter->name) {
+        char buf[EXT2_NAME_LEN + 1];
+        if (name_len > EXT2_NAME_LEN) {
+            name_len = EXT2_NAME_LEN;
+        }
+        memcpy(buf, name, name_len);
+        buf[name_len] = '\0';
+        if (fnmatch(filter->name, buf, 0) != 0) {
+            return;
+        }
+    }
+    
+    printf("%-5s %12llu %10u %s\n", walk_type_name(inode->i_mode), (unsigned long long)size,
+           inode->i_blocks / 2, path);
+}
+
+/*
+ * Builds parent/name, without doubling the slash below the root. Returns
+ * NULL when name is not a valid path component.
+ */
+static char *walk_join(const char *parent, const char *name, size_t name_len) {
+    if (ext2_name_check(parent, name, name_len) != 0) {
+        return NULL;
+    }
+    size_t parent_len = strlen(parent);
+    int slash = !(parent_len > 0 && parent[parent_len - 1] == '/');
+    char *path = (char *)malloc(parent_len + name_len + 2);
+    if (!path) {
+        perror("Error allocating path");
+        return NULL;
+    }
+    sprintf(path, "%s%s%.*s", parent, slash ? "/" : "", (int)name_len, name);
+    return path;
+}
+
+static int walk_entry_cmp(const void *a, const void *b) {
+    uint32_t x = ((const walk_entry_t *)a)->ino;
+    uint32_t y = ((const walk_entry_t *)b)->ino;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Asks for the inode table blocks holding inodes first..last of one
+ * group to be read in ahead of the inode lookups
+ */
+static void walk_prefetch(ext2_fs_t *fs, uint32_t first, uint32_t last) {
+    uint32_t block_size = 1024 << fs->superblock.s_log_block_size;
+    uint32_t per_group = fs->superblock.s_inodes_per_group;
+    uint32_t inode_size = fs->superblock.s_inode_size;
+    uint32_t table = fs->group_descs[(first - 1) / per_group].bg_inode_table;
+    uint32_t first_blk = (uint32_t)((uint64_t)((first - 1) % per_group) * inode_size / block_size);
+    uint32_t last_blk = (uint32_t)((uint64_t)((last - 1) % per_group) * inode_size / block_size);
+    
+    /* A single block is read on demand anyway */
+    if (last_blk > first_blk) {
+        ext2_advise(fs, table + first_blk, last_blk - first_blk + 1, EXT2_ADVISE_WILLNEED);
+    }
+}
+
+static void walk_dir_run(void *arg);
+
+/*
+ * Queues a directory for reading, taking ownership of path. For du it
+ * also gets a node under its parent's.
+ */
+static void walk_schedule(walk_job_t *job, const ext2_inode_t *inode, char *path,
+                          uint32_t parent) {
+    walk_task_t *task = (walk_task_t *)malloc(sizeof(walk_task_t));
+    if (!task) {
+        perror("Error allocating walk task");
+        __atomic_add_fetch(&job->failed, 1, __ATOMIC_RELAXED);
+        free(path);
+        return;
+    }
+    task->job = job;
+    task->inode = *inode;
+    task->path = path;
+    task->node = 0;
+    
+    if (!job->filter) {
+        pthread_mutex_lock(&job->lock);
+        if (job->node_count == job->node_capacity) {
+            uint32_t capacity = job->node_capacity ? job->node_capacity * 2 : 256;
+            walk_node_t *nodes = (walk_node_t *)realloc(job->nodes, capacity * sizeof(walk_node_t));
+            if (!nodes) {
+                pthread_mutex_unlock(&job->lock);
+                perror("Error allocating du node");
+                __atomic_add_fetch(&job->failed, 1, __ATOMIC_RELAXED);
+                free(path);
+                free(task);
+                return;
+            }
+            job->nodes = nodes;
+            job->node_capacity = capacity;
+        }
+        task->node = job->node_count++;
+        job->nodes[task->node].path = path;  /* Shared with the task, freed by du */
+        job->nodes[task->node].parent = parent;
+        job->nodes[task->node].kib = 0;
+        pthread_mutex_unlock(&job->lock);
+    }
+    
+    if (ext2_pool_submit(job->pool, walk_dir_run, task) != 0) {
+        __atomic_add_fetch(&job->failed, 1, __ATOMIC_RELAXED);
+        if (job->filter) {
+            free(path);  /* Otherwise the du node still owns it */
+        }
+        free(task);
+    }
+}
+
+/*
+ * Pool task: reads one directory, then the inodes of its entries in
+ * inode number order so each group's inode table is visited in one
+ * sweep, and queues the subdirectories it finds
+ */
+static void walk_dir_run(void *arg) {
+    walk_task_t *task = (walk_task_t *)arg;
+    walk_job_t *job = task->job;
+    ext2_fs_t *fs = job->fs;
+    walk_entry_t *entries = NULL;
+    size_t count = 0, capacity = 0;
+    char *names = NULL;
+    size_t names_used = 0, names_size = 0;
+    uint64_t kib = task->inode.i_blocks / 2;
+    
+    ext2_dir_t it;
+    ext2_dirent_t ent;
+    int more = -1;
+    if (ext2_dir_open(&it, fs, &task->inode) == 0) {
+        while ((more = ext2_dir_next(&it, &ent)) > 0) {
+            if ((ent.name_len == 1 && ent.name[0] == '.') ||
+                (ent.name_len == 2 && ent.name[0] == '.' && ent.name[1] == '.')) {
+                continue;
+            }
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                walk_entry_t *grown = (walk_entry_t *)realloc(entries, capacity * sizeof(walk_entry_t));
+                if (!grown) {
+                    more = -1;
+                    break;
+                }
+                entries = grown;
+            }
+            if (names_used + ent.name_len > names_size) {
+                names_size = names_size ? names_size * 2 : 4096;
+                char *grown = (char *)realloc(names, names_size);
+                if (!grown) {
+                    more = -1;
+                    break;
+                }
+                names = grown;
+            }
+            entries[count].ino = ent.ino;
+            entries[count].name_off = (uint32_t)names_used;
+            entries[count].name_len = (uint8_t)ent.name_len;
+            memcpy(names + names_used, ent.name, ent.name_len);
+            names_used += ent.name_len;
+            count++;
+        }
+        ext2_dir_close(&it);
+    }
+    if (more < 0) {
+        fprintf(stderr, "Error reading directory: %s\n", task->path);
+        __atomic_add_fetch(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+    
+    qsort(entries, count, sizeof(walk_entry_t), walk_entry_cmp);
+    
+    uint32_t per_group = fs->superblock.s_inodes_per_group;
+    size_t i = 0;
+    while (i < count) {
+        size_t end = i + 1;
+        while (end < count && (entries[end].ino - 1) / per_group == (entries[i].ino - 1) / per_group) {
+            end++;
+        }
+        walk_prefetch(fs, entries[i].ino, entries[end - 1].ino);
+        
+        for (; i < end; i++) {
+            const walk_entry_t *e = &entries[i];
+            ext2_inode_t inode_buf;
+            const ext2_inode_t *inode = ext2_get_inode(fs, e->ino, &inode_buf);
+            if (!inode) {
+                __atomic_add_fetch(&job->failed, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            
+            int is_dir = (inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+            if (!is_dir && !job->filter) {
+                kib += inode->i_blocks / 2;
+                continue;  /* du only needs the paths of directories */
+            }
+            
+            char *path = walk_join(task->path, names + e->name_off, e->name_len);
+            if (!path) {
+                __atomic_add_fetch(&job->failed, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            if (job->filter) {
+                walk_match(job, inode, path, names + e->name_off, e->name_len);
+            }
+            if (is_dir) {
+                walk_schedule(job, inode, path, task->node);
+            } else {
+                free(path);
+            }
+        }
+    }
+    
+    if (!job->filter) {
+        pthread_mutex_lock(&job->lock);
+        job->nodes[task->node].kib = kib;
+        pthread_mutex_unlock(&job->lock);
+    } else {
+        free(task->path);
+    }
+    free(entries);
+    free(names);
+    free(task);
+}
+
+/*
+ * Walks the tree below path with nthreads workers. Every directory is a
+ * pool task; a worker continues with the directories it found most
+ * recently while idle workers steal the oldest, shallowest ones.
+ */
+static int walk_run(walk_job_t *job, const char *path, int nthreads) {
+    ext2_fs_t *fs = job->fs;
+    
+    uint32_t ino = ext2_find_inode(fs, path);
+    if (ino == 0) {
+        fprintf(stderr, "File not found: %s\n", path);
+        return -1;
+    }
+    ext2_inode_t inode;
+    if (ext2_read_inode(fs, ino, &inode) != 0) {
+        return -1;
+    }
+    
+    const char *base = strrchr(path, '/');
+    base = (base && base[1]) ? base + 1 : path;
+    if (job->filter) {
+        walk_match(job, &inode, path, base, strlen(base));
+    }
+    
+    char *top = strdup(path);
+    if (!top) {
+        perror("Error allocating path");
+        return -1;
+    }
+    
+    if ((inode.i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR) {
+        if (job->filter) {
+            free(top);
+            return 0;
+        }
+        /* du of a single file */
+        job->nodes = (walk_node_t *)malloc(sizeof(walk_node_t));
+        if (!job->nodes) {
+            perror("Error allocating du node");
+            free(top);
+            return -1;
+        }
+        job->nodes[0].path = top;
+        job->nodes[0].parent = UINT32_MAX;
+        job->nodes[0].kib = inode.i_blocks / 2;
+        job->node_count = 1;
+        return 0;
+    }
+    
+    job->pool = ext2_pool_create(nthreads);
+    if (!job->pool) {
+        free(top);
+        return -1;
+    }
+    walk_schedule(job, &inode, top, UINT32_MAX);
+    ext2_pool_wait(job->pool);
+    ext2_pool_destroy(job->pool);
+    job->pool = NULL;
+    
+    return job->failed ? -1 : 0;
+}
+
+/*
+ * Lists path and everything below it that passes filter, one line per
+ * entry: type, size in bytes, usage in KiB and path. The order follows
+ * the parallel walk, not the directory order.
+ */
+int ext2_find(ext2_fs_t *fs, const char *path, const ext2_find_filter_t *filter, int nthreads) {
+    walk_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.fs = fs;
+    job.filter = filter;
+    job.now = time(NULL);
+    pthread_mutex_init(&job.lock, NULL);
+    
+    int result = walk_run(&job, path, nthreads);
+    
+    pthread_mutex_destroy(&job.lock);
+    return result;
+}
+
+static int walk_node_cmp(const void *a, const void *b) {
+    return strcmp(((const walk_node_t *)a)->path, ((const walk_node_t *)b)->path);
+}
+
+/*
+ * Prints the disk usage in KiB of every directory below path, sorted by
+ * path, or only the total with summary set
+ */
+int ext2_du(ext2_fs_t *fs, const char *path, int summary, int nthreads) {
+    walk_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.fs = fs;
+    pthread_mutex_init(&job.lock, NULL);
+    
+    int result = walk_run(&job, path, nthreads);
+    
+    /* Children follow their parents, so one backwards pass sums subtrees */
+    for (uint32_t i = job.node_count; i-- > 1; ) {
+        job.nodes[job.nodes[i].parent].kib += job.nodes[i].kib;
+    }
+    
+    if (summary && job.node_count > 0) {
+        printf("%llu\t%s\n", (unsigned long long)job.nodes[0].kib, job.nodes[0].path);
+    } else if (job.node_count > 0) {
+        qsort(job.nodes, job.node_count, sizeof(walk_node_t), walk_node_cmp);
+        for (uint32_t i = 0; i < job.node_count; i++) {
+            printf("%llu\t%s\n", (unsigned long long)job.nodes[i].kib, job.nodes[i].path);
+        }
+    }
+    
+    for (uint32_t i = 0; i < job.node_count; i++) {
+        free(job.nodes[i].path);
+    }
+    free(job.nodes);
+    pthread_mutex_destroy(&job.lock);
+    return result;
+}
+
+/* SHA-256 state (FIPS 180-4) */
+typedef struct {
+    uint32_t h[8];
+    uint64_t length;                    /* Bytes hashed so far */
+    uint8_t block[64];
+    size_t used;                        /* Bytes waiting in block */
+} ext2_sha256_t;
+
+/* xxHash64 state, seed 0 */
+typedef struct {
+    uint64_t v[4];
+    uint64_t length;
+    uint8_t stripe[32];
+    size_t used;
+} ext2_xxh64_t;
+
+/* A digest of either kind */
+typedef struct {
+    int algo;
+    union {
+        ext2_sha256_t sha256;
+        ext2_xxh64_t xxh64;
+    } u;
+} ext2_digest_t;
+
+#define EXT2_ROR32(x, s) (((x) >> (s)) | ((x) << (32 - (s))))
+#define EXT2_ROL64(x, s) (((x) << (s)) | ((x) >> (64 - (s))))
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+/*
+ * Mixes one 64-byte block into the SHA-256 state
+ */
+static void ext2_sha256_block(uint32_t h[8], const uint8_t *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+               (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = EXT2_ROR32(w[i - 15], 7) ^ EXT2_ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = EXT2_ROR32(w[i - 2], 17) ^ EXT2_ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = EXT2_ROR32(e, 6) ^ EXT2_ROR32(e, 11) ^ EXT2_ROR32(e, 25);
+        uint32_t t1 = k + s1 + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t s0 = EXT2_ROR32(a, 2) ^ EXT2_ROR32(a, 13) ^ EXT2_ROR32(a, 22);
+        uint32_t t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void ext2_sha256_init(ext2_sha256_t *s) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(s->h, iv, sizeof(iv));
+    s->length = 0;
+    s->used = 0;
+}
+
+static void ext2_sha256_update(ext2_sha256_t *s, const uint8_t *data, size_t len) {
+    s->length += len;
+    if (s->used) {
+        size_t n = 64 - s->used < len ? 64 - s->used : len;
+        memcpy(s->block + s->used, data, n);
+        s->used += n;
+        data += n;
+        len -= n;
+        if (s->used < 64) {
+            return;
+        }
+        ext2_sha256_block(s->h, s->block);
+        s->used = 0;
+    }
+    for (; len >= 64; data += 64, len -= 64) {
+        ext2_sha256_block(s->h, data);
+    }
+    memcpy(s->block, data, len);
+    s->used = len;
+}
+
+static void ext2_sha256_final(ext2_sha256_t *s, uint8_t out[32]) {
+    uint64_t bits = s->length * 8;
+    uint8_t pad[72] = { 0x80 };
+    size_t pad_len = (s->used < 56 ? 56 : 120) - s->used;
+    for (int i = 0; i < 8; i++) {
+        pad[pad_len + i] = (uint8_t)(bits >> (56 - 8 * i));
+    }
+    ext2_sha256_update(s, pad, pad_len + 8);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = (uint8_t)(s->h[i] >> 24);
+        out[4 * i + 1] = (uint8_t)(s->h[i] >> 16);
+        out[4 * i + 2] = (uint8_t)(s->h[i] >> 8);
+        out[4 * i + 3] = (uint8_t)s->h[i];
+    }
+}
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t ext2_xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    return EXT2_ROL64(acc, 31) * XXH_PRIME64_1;
+}
+
+static uint64_t ext2_xxh64_merge(uint64_t acc, uint64_t v) {
+    acc ^= ext2_xxh64_round(0, v);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static void ext2_xxh64_init(ext2_xxh64_t *x) {
+    x->v[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    x->v[1] = XXH_PRIME64_2;
+    x->v[2] = 0;
+    x->v[3] = 0 - XXH_PRIME64_1;
+    x->length = 0;
+    x->used = 0;
+}
+
+/*
+ * Consumes one 32-byte stripe; the input is read as little-endian words
+ * like everything else on disk
+ */
+static void ext2_xxh64_stripe(ext2_xxh64_t *x, const uint8_t *p) {
+    for (int i = 0; i < 4; i++) {
+        uint64_t lane;
+        memcpy(&lane, p + 8 * i, sizeof(lane));
+        x->v[i] = ext2_xxh64_round(x->v[i], lane);
+    }
+}
+
+static void ext2_xxh64_update(ext2_xxh64_t *x, const uint8_t *data, size_t len) {
+    x->length += len;
+    if (x->used) {
+        size_t n = 32 - x->used < len ? 32 - x->used : len;
+        memcpy(x->stripe + x->used, data, n);
+        x->used += n;
+        data += n;
+        len -= n;
+        if (x->used < 32) {
+            return;
+        }
+        ext2_xxh64_stripe(x, x->stripe);
+        x->used = 0;
+    }
+    for (; len >= 32; data += 32, len -= 32) {
+        ext2_xxh64_stripe(x, data);
+    }
+    memcpy(x->stripe, data, len);
+    x->used = len;
+}
+
+static uint64_t ext2_xxh64_final(const ext2_xxh64_t *x) {
+    uint64_t h;
+    if (x->length >= 32) {
+        h = EXT2_ROL64(x->v[0], 1) + EXT2_ROL64(x->v[1], 7) +
+            EXT2_ROL64(x->v[2], 12) + EXT2_ROL64(x->v[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = ext2_xxh64_merge(h, x->v[i]);
+        }
+    } else {
+        h = XXH_PRIME64_5;
+    }
+    h += x->length;
+    
+    const uint8_t *p = x->stripe;
+    size_t left = x->used;
+    for (; left >= 8; p += 8, left -= 8) {
+        uint64_t k;
+        memcpy(&k, p, sizeof(k));
+        h ^= ext2_xxh64_round(0, k);
+        h = EXT2_ROL64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (left >= 4) {
+        uint32_t k;
+        memcpy(&k, p, sizeof(k));
+        h ^= (uint64_t)k * XXH_PRIME64_1;
+        h = EXT2_ROL64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+        left -= 4;
+    }
+    for (; left > 0; p++, left--) {
+        h ^= *p * XXH_PRIME64_5;
+        h = EXT2_ROL64(h, 11) * XXH_PRIME64_1;
+    }
+    
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static void ext2_digest_init(ext2_digest_t *d, int algo) {
+    d->algo = algo;
+    if (algo == EXT2_DIGEST_XXH64) {
+        ext2_xxh64_init(&d->u.xxh64);
+    } else {
+        ext2_sha256_init(&d->u.sha256);
+    }
+}
+
+static void ext2_digest_update(ext2_digest_t *d, const uint8_t *data, size_t len) {
+    if (d->algo == EXT2_DIGEST_XXH64) {
+        ext2_xxh64_update(&d->u.xxh64, data, len);
+    } else {
+        ext2_sha256_update(&d->u.sha256, data, len);
+    }
+}
+
+/*
+ * Writes the digest as lowercase hex, in the form sha256sum and xxhsum
+ * print it
+ */
+static void ext2_digest_hex(ext2_digest_t *d, char hex[EXT2_DIGEST_HEX]) {
+    if (d->algo == EXT2_DIGEST_XXH64) {
+        snprintf(hex, EXT2_DIGEST_HEX, "%016llx", (unsigned long long)ext2_xxh64_final(&d->u.xxh64));
+    } else {
+        uint8_t out[32];
+        ext2_sha256_final(&d->u.sha256, out);
+        for (int i = 0; i < 32; i++) {
+            snprintf(hex + 2 * i, 3, "%02x", out[i]);
+        }
+    }
+}
+
+/* One file to hash; the digest is filled in by a worker */
+typedef struct {
+    struct hash_job *job;
+    ext2_inode_t inode;
+    char *path;
+    char hex[EXT2_DIGEST_HEX];
+    int failed;
+} hash_file_t;
+
+/* Shared state of one hash command */
+typedef struct hash_job {
+    ext2_fs_t *fs;
+    ext2_pool_t *pool;
+    int algo;
+    int recursive;
+    hash_file_t **files;                /* In walk order, printed once all are done */
+    size_t nfiles;
+    size_t capacity;
+    unsigned long long bytes;           /* Updated atomically by workers */
+} hash_job_t;
+
+/*
+ * Hashes a file larger than one chunk extent by extent. The block map
+ * walk hints the blocks ahead with WILLNEED, so the kernel reads them
+ * in while this worker hashes, without a thread of its own.
+ */
+static int hash_stream(ext2_fs_t *fs, const ext2_inode_t *inode, ext2_digest_t *d) {
+    uint32_t block_size = 1024 << fs->superblock.s_log_block_size;
+    uint32_t chunk_blocks = EXT2_COPY_CHUNK / block_size;
+    uint64_t file_size = ext2_inode_size(fs, inode);
+    
+    ext2_bmap_t bm;
+    if (ext2_bmap_open(&bm, fs, inode) != 0) {
+        return -1;
+    }
+    if (ext2_bmap_readahead(&bm) != 0) {
+        ext2_bmap_close(&bm);
+        return -1;
+    }
+    
+    /* Staging buffer for pread, and the zeros that holes hash as */
+    uint8_t *chunk = (uint8_t *)malloc(EXT2_COPY_CHUNK);
+    if (!chunk) {
+        perror("Error allocating hash buffer");
+        ext2_bmap_close(&bm);
+        return -1;
+    }
+    int zeroed = 0;
+    
+    int result = 0;
+    ext2_extent_t ext;
+    int more;
+    while (result == 0 && (more = ext2_bmap_next(&bm, &ext)) > 0) {
+        uint64_t length = (uint64_t)ext.length * block_size;
+        uint64_t start = (uint64_t)ext.logical * block_size;
+        if (start + length > file_size) {
+            length = file_size - start;  /* Partial tail block */
+        }
+        
+        if (ext.physical != 0 &&
+            (uint64_t)ext.physical + ext.length > fs->superblock.s_blocks_count) {
+            fprintf(stderr, "Corrupt block pointer: %u\n", ext.physical);
+            result = -1;
+            break;
+        }
+        
+        for (uint32_t done = 0; length > 0; done += chunk_blocks) {
+            uint32_t count = ext.length - done < chunk_blocks ? ext.length - done : chunk_blocks;
+            size_t n = length < (uint64_t)count * block_size ? (size_t)length
+                                                              : (size_t)count * block_size;
+            const uint8_t *data = chunk;
+            
+            if (ext.physical == 0) {
+                if (!zeroed) {
+                    memset(chunk, 0, EXT2_COPY_CHUNK);
+                    zeroed = 1;
+                }
+            } else {
+                data = (const uint8_t *)ext2_get_blocks(fs, ext.physical + done, count, chunk);
+                zeroed = 0;
+                if (!data) {
+                    result = -1;
+                    break;
+                }
+            }
+            ext2_digest_update(d, data, n);
+            length -= n;
+        }
+    }
+    if (more < 0) {
+        result = -1;
+    }
+    
+    ext2_bmap_close(&bm);
+    free(chunk);
+    return result;
+}
+
+/*
+ * Pool task: hashes one file. Files that fit in one chunk are read and
+ * hashed in place; bigger ones are streamed with readahead.
+ */
+static void hash_file_run(void *arg) {
+    hash_file_t *file = (hash_file_t *)arg;
+    hash_job_t *job = file->job;
+    uint64_t size = ext2_inode_size(job->fs, &file->inode);
+    ext2_digest_t d;
+    ext2_digest_init(&d, job->algo);
+    
+    if (size > EXT2_COPY_CHUNK) {
+        file->failed = hash_stream(job->fs, &file->inode, &d) != 0;
+    } else if (size > 0) {
+        ext2_file_t f;
+        uint8_t *buf = (uint8_t *)malloc((size_t)size);
+        if (!buf) {
+            perror("Error allocating hash buffer");
+            file->failed = 1;
+        } else if (ext2_file_open(&f, job->fs, &file->inode) != 0) {
+            file->failed = 1;
+        } else {
+            ssize_t n = ext2_file_pread(&f, buf, (size_t)size, 0);
+            if (n != (ssize_t)size) {
+                file->failed = 1;
+            } else {
+                ext2_digest_update(&d, buf, (size_t)n);
+            }
+            ext2_file_close(&f);
+        }
+        free(buf);
+    }
+    
+    if (!file->failed) {
+        ext2_digest_hex(&d, file->hex);
+        __atomic_add_fetch(&job->bytes, size, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Records a regular file in walk order and queues it for hashing
+ */
+static int hash_schedule_file(hash_job_t *job, const ext2_inode_t *inode, const char *path) {
+    if (job->nfiles == job->capacity) {
+        size_t capacity = job->capacity ? job->capacity * 2 : 64;
+        hash_file_t **files = (hash_file_t **)realloc(job->files, capacity * sizeof(hash_file_t *));
+        if (!files) {
+            perror("Error allocating hash list");
+            return -1;
+        }
+        job->files = files;
+        job->capacity = capacity;
+    }
+    
+    hash_file_t *file = (hash_file_t *)calloc(1, sizeof(hash_file_t));
+    if (!file || !(file->path = strdup(path))) {
+        perror("Error allocating hash task");
+        free(file);
+        return -1;
+    }
+    file->job = job;
+    file->inode = *inode;
+    job->files[job->nfiles++] = file;
+    if (ext2_pool_submit(job->pool, hash_file_run, file) != 0) {
+        file->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static int hash_walk(hash_job_t *job, uint32_t ino, const char *path);
+
+/* Directory walk context handed to ext2_dir_foreach */
+typedef struct {
+    hash_job_t *job;
+    const char *path;
+    int result;
+} hash_dir_ctx_t;
+
+static int hash_dir_entry(void *arg, uint32_t ino, uint8_t file_type, const char *name,
+                          size_t name_len) {
+    hash_dir_ctx_t *ctx = (hash_dir_ctx_t *)arg;
+    (void)file_type;
+    
+    if ((name_len == 1 && name[0] == '.') || (name_len == 2 && name[0] == '.' && name[1] == '.')) {
+        return 0;
+    }
+    char *path = walk_join(ctx->path, name, name_len);
+    if (!path) {
+        ctx->result = -1;
+        return 0;
+    }
+    if (hash_walk(ctx->job, ino, path) != 0) {
+        ctx->result = -1;  /* Keep going; report the failure at the end */
+    }
+    free(path);
+    return 0;
+}
+
+/*
+ * Queues one inode: regular files are hashed, directories are descended
+ * into when hashing recursively
+ */
+static int hash_walk(hash_job_t *job, uint32_t ino, const char *path) {
+    ext2_inode_t inode;
+    if (ext2_read_inode(job->fs, ino, &inode) != 0) {
+        return -1;
+    }
+    
+    switch (inode.i_mode & EXT2_S_IFMT) {
+    case EXT2_S_IFREG:
+        return hash_schedule_file(job, &inode, path);
+    case EXT2_S_IFDIR: {
+        if (!job->recursive) {
+            fprintf(stderr, "Is a directory (use -r): %s\n", path);
+            return -1;
+        }
+        hash_dir_ctx_t ctx = { job, path, 0 };
+        if (ext2_dir_foreach(job->fs, &inode, hash_dir_entry, &ctx) != 0) {
+            return -1;
+        }
+        return ctx.result;
+    }
+    default:
+        fprintf(stderr, "Skipping special file: %s\n", path);
+        return 0;
+    }
+}
+
+/*
+ * Prints a SHA-256 or xxHash64 digest of each file, or of every file
+ * below the given directories with recursive set, in the format of
+ * sha256sum. Files are read straight from the image, without extracting
+ * them, and hashed on nthreads workers while the calling thread walks
+ * the tree; a file bigger than one chunk is streamed with kernel
+ * readahead, so no threads beyond the nthreads workers run. Digests are
+ * printed in walk order once all files are done.
+ */
+int ext2_hash(ext2_fs_t *fs, char *const paths[], int npaths, int algo, int recursive,
+              int nthreads) {
+    hash_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.fs = fs;
+    job.algo = algo;
+    job.recursive = recursive;
+    job.pool = ext2_pool_create(nthreads);
+    if (!job.pool) {
+        return -1;
+    }
+    
+    /* File data is streamed front to back */
+    ext2_advise(fs, 0, 0, EXT2_ADVISE_SEQUENTIAL);
+    
+    int result = 0;
+    for (int i = 0; i < npaths; i++) {
+        uint32_t ino = ext2_find_inode(fs, paths[i]);
+        if (ino == 0) {
+            fprintf(stderr, "File not found: %s\n", paths[i]);
+            result = -1;
+            continue;
+        }
+        if (hash_walk(&job, ino, paths[i]) != 0) {
+            result = -1;
+        }
+    }
+    
+    ext2_pool_wait(job.pool);
+    ext2_pool_destroy(job.pool);
+    ext2_advise(fs, 0, 0, EXT2_ADVISE_RANDOM);
+    
+    unsigned long failed = 0;
+    for (size_t i = 0; i < job.nfiles; i++) {
+        hash_file_t *file = job.files[i];
+        if (file->failed) {
+            fprintf(stderr, "Error hashing %s\n", file->path);
+            failed++;
+        } else {
+            printf("%s  %s\n", file->hex, file->path);
+        }
+        free(file->path);
+        free(file);
+    }
+    free(job.files);
+    
+    fprintf(stderr, "Hashed %zu files (%llu bytes) with %s using %d threads\n",
+            job.nfiles - failed, job.bytes, algo == EXT2_DIGEST_XXH64 ? "xxh64" : "sha256",
+            nthreads);
+    return (result != 0 || failed) ? -1 : 0;
+}
+
+/* Shared state of one inode table scan */
+typedef struct {
+    ext2_fs_t *fs;
+    ext2_inode_fn fn;
+    void *ctx;
+    int stop;                           /* Set once fn asks to stop or a read fails */
+    int failed;
+} scan_job_t;
+
+/* One block group, the unit of work handed to the pool */
+typedef struct {
+    scan_job_t *job;
+    uint32_t group;
+} scan_task_t;
+
+/*
+ * Pool task: delivers the used inodes of one group. The inode table is
+ * read in EXT2_SCAN_CHUNK pieces, and pieces whose inodes are all free
+ * according to the bitmap are not read at all.
+ */
+static void scan_group_run(void *arg) {
+    scan_task_t *task = (scan_task_t *)arg;
+    scan_job_t *job = task->job;
+    ext2_fs_t *fs = job->fs;
+    const ext2_group_desc_t *gd = &fs->group_descs[task->group];
+    uint32_t block_size = 1024 << fs->superblock.s_log_block_size;
+    uint32_t inode_size = fs->superblock.s_inode_size;
+    uint32_t per_group = fs->superblock.s_inodes_per_group;
+    uint32_t first_ino = task->group * per_group + 1;
+    uint8_t *bitmap_buf = NULL;
+    uint8_t *chunk_buf = NULL;
+    
+    uint32_t count = fs->superblock.s_inodes_count - (first_ino - 1);
+    if (count > per_group) {
+        count = per_group;
+    }
+    if (gd->bg_free_inodes_count >= count) {
+        goto out;  /* Nothing in use */
+    }
+    
+    uint32_t per_block = block_size / inode_size;
+    uint32_t table_blocks = (count + per_block - 1) / per_block;
+    uint32_t chunk_blocks = EXT2_SCAN_CHUNK / block_size;
+    if (chunk_blocks > table_blocks) {
+        chunk_blocks = table_blocks;
+    }
+    
+    bitmap_buf = (uint8_t *)malloc(block_size);
+    if (!fs->map) {
+        chunk_buf = (uint8_t *)malloc((size_t)chunk_blocks * block_size);
+    }
+    if (!bitmap_buf || (!fs->map && !chunk_buf)) {
+        perror("Error allocating scan buffers");
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        goto out;
+    }
+    const uint8_t *bitmap = ext2_get_block(fs, gd->bg_inode_bitmap, bitmap_buf);
+    if (!bitmap) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        goto out;
+    }
+    
+    for (uint32_t blk = 0; blk < table_blocks; blk += chunk_blocks) {
+        uint32_t n = (table_blocks - blk < chunk_blocks) ? table_blocks - blk : chunk_blocks;
+        uint32_t lo = blk * per_block;
+        uint32_t hi = (blk + n) * per_block < count ? (blk + n) * per_block : count;
+        
+        uint32_t i = lo;
+        while (i < hi && !(bitmap[i >> 3] & (1 << (i & 7)))) {
+            i++;
+        }
+        if (i == hi) {
+            continue;
+        }
+        if (__atomic_load_n(&job->stop, __ATOMIC_RELAXED)) {
+            break;
+        }
+        
+        const uint8_t *table = ext2_get_blocks(fs, gd->bg_inode_table + blk, n, chunk_buf);
+        if (!table) {
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&job->stop, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        for (; i < hi; i++) {
+            if (!(bitmap[i >> 3] & (1 << (i & 7)))) {
+                continue;
+            }
+            const ext2_inode_t *inode = (const ext2_inode_t *)(table + (size_t)(i - lo) * inode_size);
+            if (job->fn(job->ctx, first_ino + i, inode) != 0) {
+                __atomic_store_n(&job->stop, 1, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+    }
+    
+out:
+    free(bitmap_buf);
+    free(chunk_buf);
+    free(task);
+}
+
+/*
+ * Calls fn for every inode marked in use, reading each group's inode
+ * table sequentially in large pieces. Groups are spread over nthreads
+ * workers, so fn runs concurrently and in no particular order; a
+ * non-zero return stops the scan early.
+ */
+int ext2_scan_inodes(ext2_fs_t *fs, ext2_inode_fn fn, void *ctx, int nthreads) {
+    scan_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.fs = fs;
+    job.fn = fn;
+    job.ctx = ctx;
+    
+    ext2_pool_t *pool = ext2_pool_create(nthreads);
+    if (!pool) {
+        return -1;
+    }
+    
+    /* Each group's table is read once, front to back */
+    ext2_advise(fs, 0, 0, EXT2_ADVISE_SEQUENTIAL);
+    for (int g = 0; g < fs->num_groups; g++) {
+        scan_task_t *task = (scan_task_t *)malloc(sizeof(scan_task_t));
+        if (!task) {
+            perror("Error allocating scan task");
+            job.failed = 1;
+            break;
+        }
+        task->job = &job;
+        task->group = (uint32_t)g;
+        if (ext2_pool_submit(pool, scan_group_run, task) != 0) {
+            free(task);
+            job.failed = 1;
+            break;
+        }
+    }
+    ext2_pool_wait(pool);
+    ext2_pool_destroy(pool);
+    ext2_advise(fs, 0, 0, EXT2_ADVISE_RANDOM);
+    
+    return job.failed ? -1 : 0;
+}
+
+/* Totals gathered by the scan command */
+typedef struct {
+    ext2_fs_t *fs;
+    int list;                           /* Print one line per inode */
+    unsigned long inodes;
+    unsigned long files;
+    unsigned long dirs;
+    unsigned long links;
+    unsigned long other;
+    unsigned long long bytes;
+    unsigned long long kib;
+} scan_totals_t;
+
+static int scan_count_inode(void *arg, uint32_t ino, const ext2_inode_t *inode) {
+    scan_totals_t *t = (scan_totals_t *)arg;
+    uint64_t size = ext2_inode_size(t->fs, inode);
+    unsigned long *kind;
+    
+    switch (inode->i_mode & EXT2_S_IFMT) {
+    case EXT2_S_IFREG: kind = &t->files; break;
+    case EXT2_S_IFDIR: kind = &t->dirs; break;
+    case EXT2_S_IFLNK: kind = &t->links; break;
+    default: kind = &t->other; break;
+    }
+    __atomic_add_fetch(kind, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&t->inodes, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&t->bytes, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&t->kib, inode->i_blocks / 2, __ATOMIC_RELAXED);
+    
+    if (t->list) {
+        printf("%10u %-5s %12llu %10u\n", ino, walk_type_name(inode->i_mode),
+               (unsigned long long)size, inode->i_blocks / 2);
+    }
+    return 0;
+}
+
+/*
+ * Inventories every used inode of the image (scan command); with list
+ * set, each inode is printed as it is found
+ */
+int ext2_scan(ext2_fs_t *fs, int list, int nthreads) {
+    scan_totals_t t;
+    memset(&t, 0, sizeof(t));
+    t.fs = fs;
+    t.list = list;
+    
+    int result = ext2_scan_inodes(fs, scan_count_inode, &t, nthreads);
+    
+    printf("Scanned %lu used inodes in %d groups (superblock: %u)\n", t.inodes, fs->num_groups,
+           fs->superblock.s_inodes_count - fs->superblock.s_free_inodes_count);
+    printf("  files: %lu  dirs: %lu  links: %lu  other: %lu\n", t.files, t.dirs, t.links,
+           t.other);
+    printf("  bytes: %llu  usage: %llu KiB\n", t.bytes, t.kib);
+    return result;
+}
+
+/* Counts set bits; the variants below are picked once at run time */
+typedef uint64_t (*ext2_popcount_fn)(const uint8_t *buf, size_t len);
+
+static uint64_t ext2_popcount_scalar(const uint8_t *buf, size_t len) {
+    uint64_t total = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, buf + i, sizeof(word));
+        total += (uint64_t)__builtin_popcountll(word);
+    }
+    for (; i < len; i++) {
+        total += (uint64_t)__builtin_popcount(buf[i]);
+    }
+    return total;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Same loop, compiled to the POPCNT instruction */
+__attribute__((target("popcnt")))
+static uint64_t ext2_popcount_popcnt(const uint8_t *buf, size_t len) {
+    uint64_t total = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, buf + i, sizeof(word));
+        total += (uint64_t)__builtin_popcountll(word);
+    }
+    for (; i < len; i++) {
+        total += (uint64_t)__builtin_popcount(buf[i]);
+    }
+    return total;
+}
+
+/*
+ * AVX2 popcount: looks up the bit count of each nibble with a byte
+ * shuffle and sums the bytes with SAD every 31 vectors, before any byte
+ * counter can overflow
+ */
+__attribute__((target("avx2")))
+static uint64_t ext2_popcount_avx2(const uint8_t *buf, size_t len) {
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    
+    while (i + 32 <= len) {
+        __m256i bytes = _mm256_setzero_si256();
+        for (int k = 0; k < 31 && i + 32 <= len; k++, i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+            __m256i lo = _mm256_and_si256(v, low_mask);
+            __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+            bytes = _mm256_add_epi8(bytes, _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+                                                           _mm256_shuffle_epi8(lookup, hi)));
+        }
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+    }
+    
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + ext2_popcount_scalar(buf + i, len - i);
+}
+#endif
+
+static ext2_popcount_fn popcount_impl;
+static const char *popcount_name;
+
+/*
+ * Chooses the fastest popcount the CPU supports
+ */
+static void ext2_popcount_select(void) {
+    ext2_popcount_fn fn = ext2_popcount_scalar;
+    const char *name = "scalar";
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        fn = ext2_popcount_avx2;
+        name = "avx2";
+    } else if (__builtin_cpu_supports("popcnt")) {
+        fn = ext2_popcount_popcnt;
+        name = "popcnt";
+    }
+#endif
+    popcount_name = name;
+    popcount_impl = fn;
+}
+
+/*
+ * Counts the set bits among the first nbits of a bitmap
+ */
+static uint64_t ext2_bitmap_count(const uint8_t *bitmap, uint32_t nbits) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, ext2_popcount_select);
+    
+    uint64_t total = popcount_impl(bitmap, nbits / 8);
+    if (nbits % 8) {
+        total += (uint64_t)__builtin_popcount(bitmap[nbits / 8] & ((1u << (nbits % 8)) - 1));
+    }
+    return total;
+}
+
+/* Free space figures gathered by df */
+typedef struct {
+    uint64_t free_blocks;
+    uint64_t free_inodes;
+    uint32_t bad_groups;                /* Groups whose descriptor disagrees with the bitmaps */
+    uint64_t run;                       /* Length of the free extent being measured */
+    uint64_t extents;
+    uint64_t largest;
+    uint64_t hist_extents[32];          /* Free extents by floor(log2(length)) */
+    uint64_t hist_blocks[32];
+} df_totals_t;
+
+static void df_end_run(df_totals_t *df) {
+    if (df->run == 0) {
+        return;
+    }
+    int bucket = 63 - __builtin_clzll(df->run);
+    if (bucket > 31) {
+        bucket = 31;
+    }
+    df->extents++;
+    df->hist_extents[bucket]++;
+    df->hist_blocks[bucket] += df->run;
+    if (df->run > df->largest) {
+        df->largest = df->run;
+    }
+    df->run = 0;
+}
+
+/*
+ * Measures the runs of clear bits in a block bitmap. A run still open at
+ * the end carries on into the next group's bitmap.
+ */
+static void df_free_runs(df_totals_t *df, const uint8_t *bitmap, uint32_t nbits) {
+    uint32_t i = 0;
+    while (i < nbits) {
+        if ((i & 63) == 0 && i + 64 <= nbits) {
+            uint64_t word;
+            memcpy(&word, bitmap + i / 8, sizeof(word));
+            if (word == 0) {
+                df->run += 64;
+                i += 64;
+                continue;
+            }
+            if (word == ~0ULL) {
+                df_end_run(df);
+                i += 64;
+                continue;
+            }
+        }
+        if (bitmap[i / 8] & (1 << (i % 8))) {
+            df_end_run(df);
+        } else {
+            df->run++;
+        }
+        i++;
+    }
+}
+
+/*
+ * Reports free space from the block and inode bitmaps (df command),
+ * checks it against the superblock and group descriptor counters and
+ * prints a histogram of free extent lengths
+ */
+int ext2_df(ext2_fs_t *fs) {
+    const ext2_superblock_t *sb = &fs->superblock;
+    uint32_t block_size = 1024 << sb->s_log_block_size;
+    uint64_t total_blocks = sb->s_blocks_count - sb->s_first_data_block;
+    df_totals_t df;
+    memset(&df, 0, sizeof(df));
+    
+    uint8_t *buf = (uint8_t *)malloc(block_size);
+    if (!buf) {
+        perror("Error allocating bitmap buffer");
+        return -1;
+    }
+    
+    for (int g = 0; g < fs->num_groups; g++) {
+        const ext2_group_desc_t *gd = &fs->group_descs[g];
+        uint64_t first = (uint64_t)g * sb->s_blocks_per_group;
+        uint32_t nblocks = (total_blocks - first < sb->s_blocks_per_group)
+                               ? (uint32_t)(total_blocks - first) : sb->s_blocks_per_group;
+        uint32_t ninodes = sb->s_inodes_per_group;
+        
+        const uint8_t *bitmap = ext2_get_block(fs, gd->bg_block_bitmap, buf);
+        if (!bitmap) {
+            free(buf);
+            return -1;
+        }
+        uint32_t free_blocks = nblocks - (uint32_t)ext2_bitmap_count(bitmap, nblocks);
+        df_free_runs(&df, bitmap, nblocks);
+        
+        bitmap = ext2_get_block(fs, gd->bg_inode_bitmap, buf);
+        if (!bitmap) {
+            free(buf);
+            return -1;
+        }
+        uint32_t free_inodes = ninodes - (uint32_t)ext2_bitmap_count(bitmap, ninodes);
+        
+        if (free_blocks != gd->bg_free_blocks_count || free_inodes != gd->bg_free_inodes_count) {
+            if (df.bad_groups++ == 0) {
+                printf("Groups whose free counts differ from their bitmaps:\n");
+            }
+            printf("  group %d: blocks %u (descriptor %u), inodes %u (descriptor %u)\n", g,
+                   free_blocks, gd->bg_free_blocks_count, free_inodes, gd->bg_free_inodes_count);
+        }
+        df.free_blocks += free_blocks;
+        df.free_inodes += free_inodes;
+    }
+    df_end_run(&df);
+    free(buf);
+    
+    uint64_t kib_per_block = block_size / 1024;
+    uint64_t avail = df.free_blocks > sb->s_r_blocks_count ? df.free_blocks - sb->s_r_blocks_count : 0;
+    printf("Free space from bitmaps (popcount: %s)\n", popcount_name);
+    printf("  Blocks: %llu total, %llu used, %llu free (superblock: %u)%s\n",
+           (unsigned long long)total_blocks, (unsigned long long)(total_blocks - df.free_blocks),
+           (unsigned long long)df.free_blocks, sb->s_free_blocks_count,
+           df.free_blocks != sb->s_free_blocks_count ? "  MISMATCH" : "");
+    printf("  Inodes: %u total, %llu used, %llu free (superblock: %u)%s\n", sb->s_inodes_count,
+           (unsigned long long)(sb->s_inodes_count - df.free_inodes),
+           (unsigned long long)df.free_inodes, sb->s_free_inodes_count,
+           df.free_inodes != sb->s_free_inodes_count ? "  MISMATCH" : "");
+    printf("  Size: %llu KiB  Used: %llu KiB  Available: %llu KiB  Use: %.1f%%\n",
+           (unsigned long long)(total_blocks * kib_per_block),
+           (unsigned long long)((total_blocks - df.free_blocks) * kib_per_block),
+           (unsigned long long)(avail * kib_per_block),
+           total_blocks ? 100.0 * (total_blocks - df.free_blocks) / total_blocks : 0.0);
+    
+    printf("Free extents: %llu, largest %llu blocks, average %.1f blocks\n",
+           (unsigned long long)df.extents, (unsigned long long)df.largest,
+           df.extents ? (double)df.free_blocks / df.extents : 0.0);
+    printf("  %-21s %10s %12s %7s\n", "Length (blocks)", "Extents", "Blocks", "Free%");
+    for (int b = 0; b < 32; b++) {
+        if (df.hist_extents[b] == 0) {
+            continue;
+        }
+        char range[32];
+        snprintf(range, sizeof(range), "%llu-%llu", 1ULL << b, (2ULL << b) - 1);
+        printf("  %-21s %10llu %12llu %6.1f%%\n", range, (unsigned long long)df.hist_extents[b],
+               (unsigned long long)df.hist_blocks[b], 100.0 * df.hist_blocks[b] / df.free_blocks);
+    }
+    
+    return 0;
+}
+
+/* Problems counted by the check command */
+#define CHECK_RANGE 0                   /* Block pointer outside the file system */
+#define CHECK_DUPLICATE 1               /* Block claimed more than once */
+#define CHECK_UNMARKED 2                /* Block in use but free in the bitmap */
+#define CHECK_UNREFERENCED 3            /* Block allocated in the bitmap but never claimed */
+#define CHECK_IBLOCKS 4                 /* i_blocks disagrees with the block pointers */
+#define CHECK_DIRENT 5                  /* Broken directory entry chain */
+#define CHECK_COUNTS 6                  /* Descriptor or superblock counter is wrong */
+#define CHECK_KINDS 7
+
+#define CHECK_SHOWN 20                  /* Problems of one kind printed before only counting */
+#define CHECK_SUSPECTS 256              /* Blocks whose owners are looked up afterwards */
+
+static const char *check_kind_names[CHECK_KINDS] = {
+    "block pointers out of range",
+    "blocks claimed more than once",
+    "blocks in use but marked free",
+    "blocks marked in use but unreferenced",
+    "inodes with a wrong block count",
+    "bad directory entries",
+    "wrong free or directory counts",
+};
+
+/* Shared state of one check */
+typedef struct {
+    ext2_fs_t *fs;
+    uint32_t block_size;
+    uint64_t total_blocks;              /* Blocks covered by the bitmaps */
+    uint64_t *claimed;                  /* One bit per block, set with atomic OR */
+    uint32_t *group_dirs;               /* Directories found in each group */
+    uint64_t inodes;
+    uint64_t dirs;
+    uint64_t free_blocks;               /* Totals of the bitmaps */
+    uint64_t free_inodes;
+    uint64_t problems[CHECK_KINDS];
+    pthread_mutex_t lock;               /* Serializes output and the suspect list */
+    uint32_t suspects[CHECK_SUSPECTS];  /* Blocks whose owners are listed at the end */
+    uint32_t nsuspects;
+    int resolve;                        /* Owner lookup pass: print owners, claim nothing */
+    int failed;
+} check_job_t;
+
+/* The owner of the blocks being claimed: an inode or a piece of metadata */
+typedef struct {
+    check_job_t *job;
+    const ext2_inode_t *inode;          /* NULL for metadata */
+    uint32_t ino;
+    char label[48];
+    uint64_t blocks;                    /* Blocks claimed so far */
+    uint8_t *bufs;                      /* Indirect and directory blocks, pread only */
+} check_owner_t;
+
+/* One block group, the unit of work of the bitmap pass */
+typedef struct {
+    check_job_t *job;
+    uint32_t group;
+} check_task_t;
+
+/*
+ * Counts a problem and prints it, until CHECK_SHOWN of its kind have
+ * been printed
+ */
+__attribute__((format(printf, 3, 4)))
+static void check_problem(check_job_t *job, int kind, const char *fmt, ...) {
+    uint64_t n = __atomic_add_fetch(&job->problems[kind], 1, __ATOMIC_RELAXED);
+    if (n > CHECK_SHOWN) {
+        return;
+    }
+    
+    va_list ap;
+    va_start(ap, fmt);
+    pthread_mutex_lock(&job->lock);
+    printf("  ");
+    vprintf(fmt, ap);
+    printf("\n");
+    if (n == CHECK_SHOWN) {
+        printf("  (further %s are only counted)\n", check_kind_names[kind]);
+    }
+    pthread_mutex_unlock(&job->lock);
+    va_end(ap);
+}
+
+/*
+ * Remembers a block whose owners are listed once the check is done
+ */
+static void check_suspect(check_job_t *job, uint32_t block) {
+    pthread_mutex_lock(&job->lock);
+    uint32_t i = 0;
+    while (i < job->nsuspects && job->suspects[i] != block) {
+        i++;
+    }
+    if (i == job->nsuspects && job->nsuspects < CHECK_SUSPECTS) {
+        job->suspects[job->nsuspects++] = block;
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+static int check_block_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Marks a block as used by owner. Blocks claimed a second time are
+ * reported, unless shared is set (extended attribute blocks may be
+ * shared between inodes). Returns 0 when the block lies outside the
+ * file system and must not be followed.
+ */
+static int check_claim(check_owner_t *owner, uint32_t block, int shared) {
+    check_job_t *job = owner->job;
+    const ext2_superblock_t *sb = &job->fs->superblock;
+    
+    if (block < sb->s_first_data_block || block >= sb->s_blocks_count) {
+        if (!job->resolve) {
+            check_problem(job, CHECK_RANGE, "%s: block pointer %u out of range", owner->label,
+                          block);
+        }
+        return 0;
+    }
+    owner->blocks++;
+    
+    if (job->resolve) {
+        if (bsearch(&block, job->suspects, job->nsuspects, sizeof(uint32_t), check_block_cmp)) {
+            pthread_mutex_lock(&job->lock);
+            printf("  block %u: %s\n", block, owner->label);
+            pthread_mutex_unlock(&job->lock);
+        }
+        return 1;
+    }
+    
+    uint64_t bit = block - sb->s_first_data_block;
+    uint64_t mask = 1ULL << (bit % 64);
+    uint64_t old = __atomic_fetch_or(&job->claimed[bit / 64], mask, __ATOMIC_RELAXED);
+    if ((old & mask) && !shared) {
+        check_problem(job, CHECK_DUPLICATE, "%s: block %u is already in use", owner->label, block);
+        check_suspect(job, block);
+    }
+    return 1;
+}
+
+/*
+ * Follows the rec_len chain of one directory block: every entry must be
+ * aligned, hold its name and end inside the block, and the last one
+ * must end exactly at the block end
+ */
+static void check_dir_block(check_owner_t *owner, uint32_t block) {
+    check_job_t *job = owner->job;
+    uint32_t block_size = job->block_size;
+    uint8_t *buf = owner->bufs ? owner->bufs + 3 * (size_t)block_size : NULL;
+    const uint8_t *data = ext2_get_block(job->fs, block, buf);
+    if (!data) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    
+    uint32_t offset = 0;
+    while (offset < block_size) {
+        const ext2_dir_entry_t *entry = (const ext2_dir_entry_t *)(data + offset);
+        
+        if (block_size - offset < sizeof(ext2_dir_entry_t)) {
+            check_problem(job, CHECK_DIRENT, "%s: directory block %u: entries end %u bytes "
+                          "before the block end", owner->label, block, block_size - offset);
+            return;
+        }
+        if (entry->rec_len < sizeof(ext2_dir_entry_t) || entry->rec_len % 4 != 0 ||
+            entry->rec_len > block_size - offset) {
+            check_problem(job, CHECK_DIRENT, "%s: directory block %u: bad rec_len %u at offset %u",
+                          owner->label, block, entry->rec_len, offset);
+            return;
+        }
+        if (entry->name_len + sizeof(ext2_dir_entry_t) > entry->rec_len) {
+            check_problem(job, CHECK_DIRENT, "%s: directory block %u: name of %u bytes does not "
+                          "fit rec_len %u at offset %u", owner->label, block, entry->name_len,
+                          entry->rec_len, offset);
+        } else if (entry->inode > job->fs->superblock.s_inodes_count) {
+            check_problem(job, CHECK_DIRENT, "%s: entry \"%.*s\" points at inode %u of %u",
+                          owner->label, entry->name_len, (const char *)(entry + 1),
+                          entry->inode, job->fs->superblock.s_inodes_count);
+        }
+        offset += entry->rec_len;
+    }
+    
+    if (block == owner->inode->i_block[0]) {
+        const ext2_dir_entry_t *dot = (const ext2_dir_entry_t *)data;
+        const ext2_dir_entry_t *dotdot = (const ext2_dir_entry_t *)(data + dot->rec_len);
+        if (dot->inode != owner->ino || dot->name_len != 1 || memcmp(dot + 1, ".", 1) != 0 ||
+            dot->rec_len >= block_size || dotdot->name_len != 2 || memcmp(dotdot + 1, "..", 2) != 0) {
+            check_problem(job, CHECK_DIRENT, "%s: directory does not start with \".\" and \"..\"",
+                          owner->label);
+        }
+    }
+}
+
+/*
+ * Claims a block and, for indirect blocks (depth > 0), every block it
+ * points to. Directory data blocks have their entries checked.
+ */
+static void check_walk(check_owner_t *owner, uint32_t block, int depth) {
+    check_job_t *job = owner->job;
+    if (!check_claim(owner, block, 0)) {
+        return;
+    }
+    if (depth == 0) {
+        if (!job->resolve && (owner->inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR) {
+            check_dir_block(owner, block);
+        }
+        return;
+    }
+    
+    uint32_t per_block = job->block_size / sizeof(uint32_t);
+    uint8_t *buf = owner->bufs ? owner->bufs + (size_t)(depth - 1) * job->block_size : NULL;
+    const uint32_t *ptrs = ext2_get_block(job->fs, block, buf);
+    if (!ptrs) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    for (uint32_t i = 0; i < per_block; i++) {
+        if (ptrs[i]) {
+            check_walk(owner, ptrs[i], depth - 1);
+        }
+    }
+}
+
+/*
+ * ext2_scan_inodes callback: claims every block of an inode, checks
+ * directory blocks and compares i_blocks with what was claimed
+ */
+static int check_inode(void *arg, uint32_t ino, const ext2_inode_t *inode) {
+    check_job_t *job = (check_job_t *)arg;
+    uint32_t sectors = job->block_size / 512;
+    uint16_t type = inode->i_mode & EXT2_S_IFMT;
+    check_owner_t owner;
+    memset(&owner, 0, sizeof(owner));
+    owner.job = job;
+    owner.inode = inode;
+    owner.ino = ino;
+    snprintf(owner.label, sizeof(owner.label), "inode %u", ino);
+    
+    if (!job->resolve) {
+        __atomic_add_fetch(&job->inodes, 1, __ATOMIC_RELAXED);
+        if (type == EXT2_S_IFDIR) {
+            __atomic_add_fetch(&job->dirs, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&job->group_dirs[(ino - 1) / job->fs->superblock.s_inodes_per_group],
+                               1, __ATOMIC_RELAXED);
+        }
+    }
+    if (inode->i_file_acl) {
+        check_claim(&owner, inode->i_file_acl, 1);
+    }
+    
+    /* Device nodes keep their numbers in i_block, and symlinks with no
+     * data blocks (beyond the attribute block) their target */
+    int has_blocks = type == EXT2_S_IFREG || type == EXT2_S_IFDIR ||
+                     (type == EXT2_S_IFLNK && inode->i_blocks != owner.blocks * sectors);
+    if (has_blocks) {
+        if (!job->fs->map && (type == EXT2_S_IFDIR || inode->i_block[12] ||
+                              inode->i_block[13] || inode->i_block[14])) {
+            owner.bufs = (uint8_t *)malloc(4 * (size_t)job->block_size);
+            if (!owner.bufs) {
+                perror("Error allocating check buffers");
+                __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+                return 1;
+            }
+        }
+        for (int i = 0; i < 15; i++) {
+            if (inode->i_block[i]) {
+                check_walk(&owner, inode->i_block[i], i < 12 ? 0 : i - 11);
+            }
+        }
+        free(owner.bufs);
+        
+        if (type == EXT2_S_IFDIR && inode->i_block[0] == 0 && !job->resolve) {
+            check_problem(job, CHECK_DIRENT, "inode %u: directory has no first block", ino);
+        }
+    }
+    
+    if (!job->resolve && owner.blocks * sectors != inode->i_blocks) {
+        check_problem(job, CHECK_IBLOCKS, "inode %u: i_blocks is %u, its pointers account for %llu",
+                      ino, inode->i_blocks, (unsigned long long)(owner.blocks * sectors));
+    }
+    return __atomic_load_n(&job->failed, __ATOMIC_RELAXED);
+}
+
+/*
+ * Whether group g holds a copy of the superblock and descriptors
+ */
+static int check_has_super(const ext2_superblock_t *sb, uint32_t g) {
+    if (g <= 1 || !(sb->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER)) {
+        return 1;
+    }
+    for (uint32_t base = 3; base <= 7; base += 2) {
+        uint64_t n = base;
+        while (n < g) {
+            n *= base;
+        }
+        if (n == g) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Claims the blocks the file system keeps for itself: superblock and
+ * descriptor copies, reserved descriptor blocks (owned by the resize
+ * inode when there is one), bitmaps and inode tables
+ */
+static void check_metadata(check_job_t *job) {
+    ext2_fs_t *fs = job->fs;
+    const ext2_superblock_t *sb = &fs->superblock;
+    uint32_t block_size = job->block_size;
+    uint32_t gdt_blocks = (fs->num_groups * sizeof(ext2_group_desc_t) + block_size - 1) / block_size;
+    uint32_t reserved = (sb->s_feature_compat & EXT2_FEATURE_COMPAT_RESIZE_INODE)
+                            ? 0 : sb->s_reserved_gdt_blocks;
+    uint32_t table_blocks = (uint32_t)(((uint64_t)sb->s_inodes_per_group * sb->s_inode_size +
+                                        block_size - 1) / block_size);
+    check_owner_t owner;
+    memset(&owner, 0, sizeof(owner));
+    owner.job = job;
+    
+    for (int g = 0; g < fs->num_groups; g++) {
+        const ext2_group_desc_t *gd = &fs->group_descs[g];
+        
+        if (check_has_super(sb, (uint32_t)g)) {
+            uint32_t first = sb->s_first_data_block + (uint32_t)g * sb->s_blocks_per_group;
+            snprintf(owner.label, sizeof(owner.label), "group %d superblock and descriptors", g);
+            for (uint32_t b = 0; b < 1 + gdt_blocks + reserved; b++) {
+                check_claim(&owner, first + b, 0);
+            }
+        }
+        snprintf(owner.label, sizeof(owner.label), "group %d bitmaps", g);
+        check_claim(&owner, gd->bg_block_bitmap, 0);
+        check_claim(&owner, gd->bg_inode_bitmap, 0);
+        snprintf(owner.label, sizeof(owner.label), "group %d inode table", g);
+        for (uint32_t b = 0; b < table_blocks; b++) {
+            check_claim(&owner, gd->bg_inode_table + b, 0);
+        }
+    }
+}
+
+/*
+ * Pool task: compares one group's block bitmap with the blocks claimed
+ * in it, 64 at a time, and its free and directory counts with the
+ * group descriptor
+ */
+static void check_group_run(void *arg) {
+    check_task_t *task = (check_task_t *)arg;
+    check_job_t *job = task->job;
+    ext2_fs_t *fs = job->fs;
+    const ext2_superblock_t *sb = &fs->superblock;
+    const ext2_group_desc_t *gd = &fs->group_descs[task->group];
+    uint64_t first = (uint64_t)task->group * sb->s_blocks_per_group;
+    uint8_t *buf = NULL;
+    
+    if (first >= job->total_blocks) {
+        goto out;
+    }
+    uint32_t nblocks = (job->total_blocks - first < sb->s_blocks_per_group)
+                           ? (uint32_t)(job->total_blocks - first) : sb->s_blocks_per_group;
+    
+    buf = (uint8_t *)malloc(job->block_size);
+    if (!buf) {
+        perror("Error allocating bitmap buffer");
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        goto out;
+    }
+    const uint8_t *bitmap = ext2_get_block(fs, gd->bg_block_bitmap, buf);
+    if (!bitmap) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        goto out;
+    }
+    
+    for (uint32_t i = 0; i < nblocks; i += 64) {
+        uint64_t bit = first + i;
+        uint64_t marked;
+        uint64_t claimed = job->claimed[bit / 64] >> (bit % 64);
+        if (bit % 64) {
+            claimed |= job->claimed[bit / 64 + 1] << (64 - bit % 64);
+        }
+        memcpy(&marked, bitmap + i / 8, sizeof(marked));
+        
+        uint64_t diff = marked ^ claimed;
+        if (nblocks - i < 64) {
+            diff &= (1ULL << (nblocks - i)) - 1;
+        }
+        while (diff) {
+            int b = __builtin_ctzll(diff);
+            uint32_t block = sb->s_first_data_block + (uint32_t)(bit + b);
+            diff &= diff - 1;
+            if (claimed & (1ULL << b)) {
+                check_problem(job, CHECK_UNMARKED, "group %u: block %u is in use but marked free",
+                              task->group, block);
+                check_suspect(job, block);
+            } else {
+                check_problem(job, CHECK_UNREFERENCED, "group %u: block %u is marked in use but "
+                              "nothing refers to it", task->group, block);
+            }
+        }
+    }
+    uint32_t free_blocks = nblocks - (uint32_t)ext2_bitmap_count(bitmap, nblocks);
+    
+    bitmap = ext2_get_block(fs, gd->bg_inode_bitmap, buf);
+    if (!bitmap) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        goto out;
+    }
+    uint32_t ninodes = sb->s_inodes_per_group;
+    uint32_t free_inodes = ninodes - (uint32_t)ext2_bitmap_count(bitmap, ninodes);
+    uint32_t dirs = job->group_dirs[task->group];
+    
+    if (free_blocks != gd->bg_free_blocks_count) {
+        check_problem(job, CHECK_COUNTS, "group %u: %u free blocks in the bitmap, descriptor says %u",
+                      task->group, free_blocks, gd->bg_free_blocks_count);
+    }
+    if (free_inodes != gd->bg_free_inodes_count) {
+        check_problem(job, CHECK_COUNTS, "group %u: %u free inodes in the bitmap, descriptor says %u",
+                      task->group, free_inodes, gd->bg_free_inodes_count);
+    }
+    if (dirs != gd->bg_used_dirs_count) {
+        check_problem(job, CHECK_COUNTS, "group %u: %u directories found, descriptor says %u",
+                      task->group, dirs, gd->bg_used_dirs_count);
+    }
+    __atomic_add_fetch(&job->free_blocks, free_blocks, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&job->free_inodes, free_inodes, __ATOMIC_RELAXED);
+    
+out:
+    free(buf);
+    free(task);
+}
+
+/*
+ * Checks the image without writing to it (check command). Every block
+ * is claimed once in a shared bitset, one bit per block, by the group
+ * metadata and by the pointers of every used inode, so blocks claimed
+ * twice show up as the claim is made. Each group's block bitmap is then
+ * compared with the claims, and its counters with the bitmaps. Both
+ * passes run per group on nthreads workers. Blocks that were claimed
+ * twice or are not marked in use get their owners listed by a final
+ * inode scan. Returns 0 when the image is clean, 1 when problems were
+ * found and -1 when it could not be read.
+ */
+int ext2_check(ext2_fs_t *fs, int nthreads) {
+    const ext2_superblock_t *sb = &fs->superblock;
+    check_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.fs = fs;
+    job.block_size = 1024 << sb->s_log_block_size;
+    job.total_blocks = sb->s_blocks_count - sb->s_first_data_block;
+    
+    /* One spare word lets a group's bits be read unaligned */
+    size_t words = job.total_blocks / 64 + 2;
+    job.claimed = (uint64_t *)calloc(words, sizeof(uint64_t));
+    job.group_dirs = (uint32_t *)calloc(fs->num_groups, sizeof(uint32_t));
+    if (!job.claimed || !job.group_dirs) {
+        perror("Error allocating check bitmaps");
+        free(job.claimed);
+        free(job.group_dirs);
+        return -1;
+    }
+    pthread_mutex_init(&job.lock, NULL);
+    
+    printf("Checking %d groups with %d threads (%zu KiB for block claims)\n", fs->num_groups,
+           nthreads, (words * sizeof(uint64_t) + 1023) / 1024);
+    check_metadata(&job);
+    if (ext2_scan_inodes(fs, check_inode, &job, nthreads) != 0) {
+        job.failed = 1;
+    }
+    
+    ext2_pool_t *pool = job.failed ? NULL : ext2_pool_create(nthreads);
+    if (pool) {
+        for (int g = 0; g < fs->num_groups; g++) {
+            check_task_t *task = (check_task_t *)malloc(sizeof(check_task_t));
+            if (!task) {
+                perror("Error allocating check task");
+                job.failed = 1;
+                break;
+            }
+            task->job = &job;
+            task->group = (uint32_t)g;
+            if (ext2_pool_submit(pool, check_group_run, task) != 0) {
+                free(task);
+                job.failed = 1;
+                break;
+            }
+        }
+        ext2_pool_wait(pool);
+        ext2_pool_destroy(pool);
+    } else {
+        job.failed = 1;
+    }
+    
+    if (!job.failed) {
+        if (job.free_blocks != sb->s_free_blocks_count) {
+            check_problem(&job, CHECK_COUNTS, "superblock: %llu free blocks in the bitmaps, "
+                          "superblock says %u", (unsigned long long)job.free_blocks,
+                          sb->s_free_blocks_count);
+        }
+        if (job.free_inodes != sb->s_free_inodes_count) {
+            check_problem(&job, CHECK_COUNTS, "superblock: %llu free inodes in the bitmaps, "
+                          "superblock says %u", (unsigned long long)job.free_inodes,
+                          sb->s_free_inodes_count);
+        }
+    }
+    
+    if (!job.failed && job.nsuspects > 0) {
+        if (job.nsuspects == CHECK_SUSPECTS) {
+            printf("Owners of the first %d blocks above:\n", CHECK_SUSPECTS);
+        } else {
+            printf("Owners of the blocks above:\n");
+        }
+        qsort(job.suspects, job.nsuspects, sizeof(uint32_t), check_block_cmp);
+        job.resolve = 1;
+        check_metadata(&job);
+        if (ext2_scan_inodes(fs, check_inode, &job, nthreads) != 0) {
+            job.failed = 1;
+        }
+    }
+    
+    uint64_t used = ext2_bitmap_count((const uint8_t *)job.claimed, (uint32_t)job.total_blocks);
+    uint64_t total = 0;
+    printf("Checked %llu inodes (%llu directories) and %llu blocks in use\n",
+           (unsigned long long)job.inodes, (unsigned long long)job.dirs, (unsigned long long)used);
+    for (int k = 0; k < CHECK_KINDS; k++) {
+        if (job.problems[k]) {
+            printf("  %s: %llu\n", check_kind_names[k], (unsigned long long)job.problems[k]);
+            total += job.problems[k];
+        }
+    }
+    if (job.failed) {
+        fprintf(stderr, "Check incomplete: the image could not be read\n");
+    } else if (total == 0) {
+        printf("No problems found\n");
+    } else {
+        printf("%llu problems found\n", (unsigned long long)total);
+    }
+    
+    pthread_mutex_destroy(&job.lock);
+    free(job.claimed);
+    free(job.group_dirs);
+    return job.failed ? -1 : (total ? 1 : 0);
+}
+
+/* What the diff command learned about one inode number */
+#define DIFF_IN_A 0x01                  /* In use in the first image */
+#define DIFF_IN_B 0x02                  /* In use in the second image */
+#define DIFF_DATA 0x04                  /* Contents differ */
+#define DIFF_META 0x08                  /* Other inode fields differ */
+#define DIFF_REUSED 0x10                /* The number now holds another kind of file */
+#define DIFF_DIR_A 0x20                 /* A directory in the first image */
+#define DIFF_DIR_B 0x40                 /* A directory in the second image */
+
+/* A changed inode to be named and printed */
+typedef struct {
+    uint32_t ino;
+    char status;                        /* A, D, M or m */
+    int dir;
+    char *path;                         /* Shortest name found in the walk */
+} diff_change_t;
+
+/* Shared state of one image diff */
+typedef struct {
+    ext2_fs_t *a;
+    ext2_fs_t *b;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t *changed;                  /* One bit per block, set with atomic OR */
+    uint8_t *state;                     /* DIFF_* flags per inode */
+    uint64_t compared;                  /* Blocks allocated in both images */
+    uint64_t differ;                    /* Blocks that differ or are allocated in one only */
+    pthread_mutex_t lock;               /* Guards the names of changes */
+    int failed;
+} diff_job_t;
+
+/* One block group, the unit of work of the block pass */
+typedef struct {
+    diff_job_t *job;
+    uint32_t group;
+    uint8_t *buf_a;                     /* Runs read from each image, pread only */
+    uint8_t *buf_b;
+} diff_task_t;
+
+/* The changes named from one image's tree */
+typedef struct {
+    diff_job_t *job;
+    ext2_fs_t *fs;
+    ext2_pool_t *pool;
+    diff_change_t *changes;             /* Sorted by inode number */
+    size_t count;
+} diff_side_t;
+
+/* A directory waiting to be read by the naming walk */
+typedef struct {
+    diff_side_t *side;
+    uint32_t ino;
+    char *path;
+} diff_dir_task_t;
+
+static void diff_mark(diff_job_t *job, uint64_t bit) {
+    __atomic_fetch_or(&job->changed[bit / 64], 1ULL << (bit % 64), __ATOMIC_RELAXED);
+}
+
+/*
+ * Compares a run of blocks allocated in both images, block by block
+ */
+static int diff_compare_run(diff_task_t *task, uint64_t bit, uint32_t count) {
+    diff_job_t *job = task->job;
+    uint32_t block = job->a->superblock.s_first_data_block + (uint32_t)bit;
+    
+    const uint8_t *pa = ext2_get_blocks(job->a, block, count, task->buf_a);
+    const uint8_t *pb = ext2_get_blocks(job->b, block, count, task->buf_b);
+    if (!pa || !pb) {
+        return -1;
+    }
+    for (uint32_t k = 0; k < count; k++) {
+        if (memcmp(pa + (size_t)k * job->block_size, pb + (size_t)k * job->block_size,
+                   job->block_size) != 0) {
+            diff_mark(job, bit + k);
+            __atomic_add_fetch(&job->differ, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Pool task: walks the two block bitmaps of one group 64 blocks at a
+ * time. Blocks free in both are skipped, blocks allocated in only one
+ * count as changed and runs allocated in both are read and compared.
+ */
+static void diff_group_run(void *arg) {
+    diff_task_t *task = (diff_task_t *)arg;
+    diff_job_t *job = task->job;
+    const ext2_superblock_t *sb = &job->a->superblock;
+    uint64_t first = (uint64_t)task->group * sb->s_blocks_per_group;
+    uint32_t max_run = EXT2_COPY_CHUNK / job->block_size;
+    uint8_t *bitmap_bufs = NULL;
+    
+    if (first >= job->total_blocks) {
+        goto out;
+    }
+    uint32_t nblocks = (job->total_blocks - first < sb->s_blocks_per_group)
+                           ? (uint32_t)(job->total_blocks - first) : sb->s_blocks_per_group;
+    
+    bitmap_bufs = (uint8_t *)malloc(2 * (size_t)job->block_size);
+    if (!job->a->map) {
+        task->buf_a = (uint8_t *)malloc(EXT2_COPY_CHUNK);
+    }
+    if (!job->b->map) {
+        task->buf_b = (uint8_t *)malloc(EXT2_COPY_CHUNK);
+    }
+    if (!bitmap_bufs || (!job->a->map && !task->buf_a) || (!job->b->map && !task->buf_b)) {
+        perror("Error allocating diff buffers");
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        goto out;
+    }
+    const uint8_t *bitmap_a = ext2_get_block(job->a, job->a->group_descs[task->group].bg_block_bitmap,
+                                             bitmap_bufs);
+    const uint8_t *bitmap_b = ext2_get_block(job->b, job->b->group_descs[task->group].bg_block_bitmap,
+                                             bitmap_bufs + job->block_size);
+    if (!bitmap_a || !bitmap_b) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        goto out;
+    }
+    
+    uint32_t run_start = 0, run_len = 0;
+    uint64_t compared = 0;
+    for (uint32_t i = 0; i < nblocks; i += 64) {
+        uint64_t wa, wb;
+        memcpy(&wa, bitmap_a + i / 8, sizeof(wa));
+        memcpy(&wb, bitmap_b + i / 8, sizeof(wb));
+        if (nblocks - i < 64) {
+            uint64_t mask = (1ULL << (nblocks - i)) - 1;
+            wa &= mask;
+            wb &= mask;
+        }
+        
+        uint64_t one = wa ^ wb;
+        if (one) {
+            __atomic_add_fetch(&job->differ, (uint64_t)__builtin_popcountll(one), __ATOMIC_RELAXED);
+        }
+        for (; one; one &= one - 1) {
+            diff_mark(job, first + i + (uint32_t)__builtin_ctzll(one));
+        }
+        
+        for (uint64_t both = wa & wb; both; both &= both - 1) {
+            uint32_t idx = i + (uint32_t)__builtin_ctzll(both);
+            compared++;
+            if (run_len > 0 && run_start + run_len == idx && run_len < max_run) {
+                run_len++;
+                continue;
+            }
+            if (run_len > 0 && diff_compare_run(task, first + run_start, run_len) != 0) {
+                __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+                goto out;
+            }
+            run_start = idx;
+            run_len = 1;
+        }
+    }
+    if (run_len > 0 && diff_compare_run(task, first + run_start, run_len) != 0) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&job->compared, compared, __ATOMIC_RELAXED);
+    
+out:
+    free(bitmap_bufs);
+    free(task->buf_a);
+    free(task->buf_b);
+    free(task);
+}
+
+/*
+ * Whether any data block of an inode was marked changed. Returns 1 if
+ * so, 0 if not and -1 on read errors.
+ */
+static int diff_data_changed(diff_job_t *job, ext2_fs_t *fs, const ext2_inode_t *inode) {
+    uint16_t type = inode->i_mode & EXT2_S_IFMT;
+    if (type != EXT2_S_IFREG && type != EXT2_S_IFDIR &&
+        (type != EXT2_S_IFLNK || ext2r_fast_symlink(&fs->superblock, inode))) {
+        return 0;  /* No data blocks: devices and short symlinks */
+    }
+    
+    ext2_bmap_t bm;
+    ext2_extent_t ext;
+    int more;
+    if (ext2_bmap_open(&bm, fs, inode) != 0) {
+        return -1;
+    }
+    int result = 0;
+    while (result == 0 && (more = ext2_bmap_next(&bm, &ext)) > 0) {
+        if (ext.physical == 0) {
+            continue;
+        }
+        if (ext.physical < fs->superblock.s_first_data_block ||
+            (uint64_t)ext.physical + ext.length > fs->superblock.s_blocks_count) {
+            fprintf(stderr, "Corrupt block pointer: %u\n", ext.physical);
+            result = -1;
+            break;
+        }
+        uint64_t bit = ext.physical - fs->superblock.s_first_data_block;
+        uint64_t end = bit + ext.length;
+        while (bit < end) {
+            uint64_t word = job->changed[bit / 64] >> (bit % 64);
+            uint64_t n = 64 - bit % 64;
+            if (n > end - bit) {
+                word &= (1ULL << (end - bit)) - 1;
+                n = end - bit;
+            }
+            if (word) {
+                result = 1;
+                break;
+            }
+            bit += n;
+        }
+    }
+    if (more < 0) {
+        result = -1;
+    }
+    ext2_bmap_close(&bm);
+    return result;
+}
+
+/*
+ * ext2_scan_inodes callback for the first image: compares each used
+ * inode with the same inode number in the second image
+ */
+static int diff_inode_a(void *arg, uint32_t ino, const ext2_inode_t *inode) {
+    diff_job_t *job = (diff_job_t *)arg;
+    uint8_t state = DIFF_IN_A;
+    ext2_inode_t other_buf;
+    const ext2_inode_t *other = ext2_get_inode(job->b, ino, &other_buf);
+    if (!other) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+    
+    if ((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR) {
+        state |= DIFF_DIR_A;
+    }
+    if (((inode->i_mode ^ other->i_mode) & EXT2_S_IFMT) || inode->i_generation != other->i_generation) {
+        state |= DIFF_REUSED;
+    }
+    
+    /* Access times change on every read and are not a difference */
+    ext2_inode_t x = *inode;
+    ext2_inode_t y = *other;
+    x.i_atime = y.i_atime = 0;
+    if (memcmp(&x, &y, sizeof(x)) != 0) {
+        state |= DIFF_META;
+    }
+    if (x.i_size != y.i_size || x.i_dir_acl != y.i_dir_acl ||
+        (memcmp(x.i_block, y.i_block, sizeof(x.i_block)) != 0 &&
+         ext2r_fast_symlink(&job->a->superblock, &x))) {
+        state |= DIFF_DATA;  /* Resized, or a short symlink retargeted */
+    }
+    
+    int changed = diff_data_changed(job, job->a, inode);
+    if (changed < 0) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+    if (changed) {
+        state |= DIFF_DATA;
+    }
+    job->state[ino - 1] = state;
+    return 0;
+}
+
+/*
+ * ext2_scan_inodes callback for the second image, run after the first
+ * image's pass: adds its own data blocks to the comparison
+ */
+static int diff_inode_b(void *arg, uint32_t ino, const ext2_inode_t *inode) {
+    diff_job_t *job = (diff_job_t *)arg;
+    uint8_t state = job->state[ino - 1] | DIFF_IN_B;
+    
+    if ((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR) {
+        state |= DIFF_DIR_B;
+    }
+    if (!(state & DIFF_DATA)) {
+        int changed = diff_data_changed(job, job->b, inode);
+        if (changed < 0) {
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+        if (changed) {
+            state |= DIFF_DATA;
+        }
+    }
+    job->state[ino - 1] = state;
+    return 0;
+}
+
+static int diff_change_cmp(const void *a, const void *b) {
+    uint32_t x = ((const diff_change_t *)a)->ino;
+    uint32_t y = ((const diff_change_t *)b)->ino;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Keeps the shortest (then smallest) of the names of a hard linked
+ * inode, so the output does not depend on the walk order
+ */
+static void diff_name(diff_side_t *side, diff_change_t *change, const char *path) {
+    pthread_mutex_lock(&side->job->lock);
+    if (!change->path || strlen(path) < strlen(change->path) ||
+        (strlen(path) == strlen(change->path) && strcmp(path, change->path) < 0)) {
+        char *copy = strdup(path);
+        if (copy) {
+            free(change->path);
+            change->path = copy;
+        }
+    }
+    pthread_mutex_unlock(&side->job->lock);
+}
+
+static void diff_dir_run(void *arg);
+
+/*
+ * Queues a directory of the naming walk, taking ownership of path
+ */
+static void diff_schedule_dir(diff_side_t *side, uint32_t ino, char *path) {
+    diff_dir_task_t *task = (diff_dir_task_t *)malloc(sizeof(diff_dir_task_t));
+    if (!task) {
+        perror("Error allocating walk task");
+        __atomic_store_n(&side->job->failed, 1, __ATOMIC_RELAXED);
+        free(path);
+        return;
+    }
+    task->side = side;
+    task->ino = ino;
+    task->path = path;
+    if (ext2_pool_submit(side->pool, diff_dir_run, task) != 0) {
+        __atomic_store_n(&side->job->failed, 1, __ATOMIC_RELAXED);
+        free(path);
+        free(task);
+    }
+}
+
+/*
+ * Pool task: reads one directory, names the changed inodes among its
+ * entries and queues its subdirectories. Entries carry their file type,
+ * so only entries of unknown type need their inode read.
+ */
+static void diff_dir_run(void *arg) {
+    diff_dir_task_t *task = (diff_dir_task_t *)arg;
+    diff_side_t *side = task->side;
+    ext2_inode_t inode_buf;
+    const ext2_inode_t *inode = ext2_get_inode(side->fs, task->ino, &inode_buf);
+    ext2_dir_t it;
+    ext2_dirent_t ent;
+    int more = -1;
+    
+    if (inode && ext2_dir_open(&it, side->fs, inode) == 0) {
+        while ((more = ext2_dir_next(&it, &ent)) > 0) {
+            if ((ent.name_len == 1 && ent.name[0] == '.') ||
+                (ent.name_len == 2 && ent.name[0] == '.' && ent.name[1] == '.')) {
+                continue;
+            }
+            diff_change_t key = { ent.ino, 0, 0, NULL };
+            diff_change_t *change = (diff_change_t *)bsearch(&key, side->changes, side->count,
+                                                             sizeof(diff_change_t), diff_change_cmp);
+            int is_dir = ent.file_type == EXT2_FT_DIR;
+            if (ent.file_type == EXT2_FT_UNKNOWN) {
+                ext2_inode_t child_buf;
+                const ext2_inode_t *child = ext2_get_inode(side->fs, ent.ino, &child_buf);
+                is_dir = child && (child->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+            }
+            if (!change && !is_dir) {
+                continue;
+            }
+            
+            char *path = walk_join(task->path, ent.name, ent.name_len);
+            if (!path) {
+                __atomic_store_n(&side->job->failed, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            if (change) {
+                diff_name(side, change, path);
+            }
+            if (is_dir) {
+                diff_schedule_dir(side, ent.ino, path);
+            } else {
+                free(path);
+            }
+        }
+        ext2_dir_close(&it);
+    }
+    if (more < 0) {
+        fprintf(stderr, "Error reading directory: %s\n", task->path);
+        __atomic_store_n(&side->job->failed, 1, __ATOMIC_RELAXED);
+    }
+    free(task->path);
+    free(task);
+}
+
+/*
+ * Names the changes of one side by walking its tree from the root
+ */
+static int diff_name_side(diff_side_t *side, int nthreads) {
+    if (side->count == 0) {
+        return 0;
+    }
+    diff_change_t key = { EXT2_ROOT_INODE, 0, 0, NULL };
+    diff_change_t *root = (diff_change_t *)bsearch(&key, side->changes, side->count,
+                                                   sizeof(diff_change_t), diff_change_cmp);
+    if (root) {
+        diff_name(side, root, "/");
+    }
+    
+    char *top = strdup("/");
+    side->pool = ext2_pool_create(nthreads);
+    if (!top || !side->pool) {
+        free(top);
+        if (side->pool) {
+            ext2_pool_destroy(side->pool);
+        }
+        return -1;
+    }
+    diff_schedule_dir(side, EXT2_ROOT_INODE, top);
+    ext2_pool_wait(side->pool);
+    ext2_pool_destroy(side->pool);
+    side->pool = NULL;
+    return 0;
+}
+
+static int diff_add_change(diff_side_t *side, size_t *capacity, uint32_t ino, char status, int dir) {
+    if (side->count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        diff_change_t *grown = (diff_change_t *)realloc(side->changes,
+                                                        *capacity * sizeof(diff_change_t));
+        if (!grown) {
+            perror("Error allocating change list");
+            return -1;
+        }
+        side->changes = grown;
+    }
+    diff_change_t *change = &side->changes[side->count++];
+    change->ino = ino;
+    change->status = status;
+    change->dir = dir;
+    change->path = NULL;
+    return 0;
+}
+
+static int diff_path_cmp(const void *a, const void *b) {
+    const diff_change_t *x = *(const diff_change_t *const *)a;
+    const diff_change_t *y = *(const diff_change_t *const *)b;
+    int c = strcmp(x->path, y->path);
+    if (c != 0) {
+        return c;
+    }
+    return (y->status == 'D') - (x->status == 'D');  /* A replaced file: D before A */
+}
+
+/*
+ * Lists the files that differ between the image in fs and the image at
+ * other_path (diff command). The block bitmaps of each group are walked
+ * in parallel: blocks free in both images are skipped, blocks allocated
+ * in one only count as changed and the rest are compared with memcmp.
+ * Used inodes of both images are then matched against the changed
+ * blocks and against each other, and the changed ones are named by a
+ * walk of each tree. Prints one line per file, A(dded), D(eleted),
+ * M(odified) or m (metadata only), sorted by path; directories end in
+ * a slash. Both images must share the same layout. Returns 0 when the
+ * images hold the same files, 1 when they differ and -1 on errors.
+ */
+int ext2_diff(ext2_fs_t *fs, const char *other_path, int nthreads) {
+    ext2_fs_t other;
+    memset(&other, 0, sizeof(other));
+    if (ext2_open(other_path, &other, EXT2_OPEN_QUIET | (fs->map ? EXT2_OPEN_MMAP : 0)) != 0) {
+        fprintf(stderr, "Failed to open EXT2 image: %s\n", other_path);
+        return -1;
+    }
+    
+    const ext2_superblock_t *sa = &fs->superblock;
+    const ext2_superblock_t *sb = &other.superblock;
+    if (sa->s_log_block_size != sb->s_log_block_size || sa->s_blocks_count != sb->s_blocks_count ||
+        sa->s_first_data_block != sb->s_first_data_block ||
+        sa->s_blocks_per_group != sb->s_blocks_per_group ||
+        sa->s_inodes_count != sb->s_inodes_count || sa->s_inode_size != sb->s_inode_size) {
+        fprintf(stderr, "Images differ in block size, block count or inode layout; "
+                        "a block diff needs the same layout\n");
+        ext2_close(&other);
+        return -1;
+    }
+    
+    diff_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.a = fs;
+    job.b = &other;
+    job.block_size = 1024 << sa->s_log_block_size;
+    job.total_blocks = sa->s_blocks_count - sa->s_first_data_block;
+    job.changed = (uint64_t *)calloc(job.total_blocks / 64 + 1, sizeof(uint64_t));
+    job.state = (uint8_t *)calloc(sa->s_inodes_count, 1);
+    diff_side_t side_a = { &job, fs, NULL, NULL, 0 };
+    diff_side_t side_b = { &job, &other, NULL, NULL, 0 };
+    diff_change_t **sorted = NULL;
+    int result = -1;
+    if (!job.changed || !job.state) {
+        perror("Error allocating diff bitmaps");
+        goto out;
+    }
+    pthread_mutex_init(&job.lock, NULL);
+    
+    /* Block pass: allocated blocks are read once, front to back */
+    ext2_pool_t *pool = ext2_pool_create(nthreads);
+    if (!pool) {
+        goto out_lock;
+    }
+    ext2_advise(fs, 0, 0, EXT2_ADVISE_SEQUENTIAL);
+    ext2_advise(&other, 0, 0, EXT2_ADVISE_SEQUENTIAL);
+    for (int g = 0; g < fs->num_groups; g++) {
+        diff_task_t *task = (diff_task_t *)calloc(1, sizeof(diff_task_t));
+        if (!task) {
+            perror("Error allocating diff task");
+            job.failed = 1;
+            break;
+        }
+        task->job = &job;
+        task->group = (uint32_t)g;
+        if (ext2_pool_submit(pool, diff_group_run, task) != 0) {
+            free(task);
+            job.failed = 1;
+            break;
+        }
+    }
+    ext2_pool_wait(pool);
+    ext2_pool_destroy(pool);
+    ext2_advise(fs, 0, 0, EXT2_ADVISE_RANDOM);
+    ext2_advise(&other, 0, 0, EXT2_ADVISE_RANDOM);
+    if (job.failed) {
+        goto out_lock;
+    }
+    
+    /* Inode passes: the first one needs the whole bitset, the second the first's flags */
+    if (ext2_scan_inodes(fs, diff_inode_a, &job, nthreads) != 0 ||
+        ext2_scan_inodes(&other, diff_inode_b, &job, nthreads) != 0 || job.failed) {
+        goto out_lock;
+    }
+    
+    size_t cap_a = 0, cap_b = 0;
+    size_t added = 0, deleted = 0, modified = 0, meta = 0;
+    for (uint32_t ino = 1; ino <= sa->s_inodes_count; ino++) {
+        uint8_t s = job.state[ino - 1];
+        int err = 0;
+        if (!s || (ino < sa->s_first_ino && ino != EXT2_ROOT_INODE)) {
+            continue;  /* Unused, or reserved for the file system itself */
+        }
+        if ((s & DIFF_IN_A) && (!(s & DIFF_IN_B) || (s & DIFF_REUSED))) {
+            err |= diff_add_change(&side_a, &cap_a, ino, 'D', !!(s & DIFF_DIR_A));
+            deleted++;
+        }
+        if ((s & DIFF_IN_B) && (!(s & DIFF_IN_A) || (s & DIFF_REUSED))) {
+            err |= diff_add_change(&side_b, &cap_b, ino, 'A', !!(s & DIFF_DIR_B));
+            added++;
+        } else if ((s & DIFF_IN_A) && (s & DIFF_IN_B) && (s & (DIFF_DATA | DIFF_META))) {
+            char status = (s & DIFF_DATA) ? 'M' : 'm';
+            err |= diff_add_change(&side_b, &cap_b, ino, status, !!(s & DIFF_DIR_B));
+            if (status == 'M') {
+                modified++;
+            } else {
+                meta++;
+            }
+        }
+        if (err) {
+            goto out_lock;
+        }
+    }
+    
+    if (diff_name_side(&side_a, nthreads) != 0 || diff_name_side(&side_b, nthreads) != 0 ||
+        job.failed) {
+        goto out_lock;
+    }
+    
+    size_t total = side_a.count + side_b.count;
+    sorted = (diff_change_t **)malloc((total ? total : 1) * sizeof(diff_change_t *));
+    if (!sorted) {
+        perror("Error allocating change list");
+        goto out_lock;
+    }
+    for (size_t i = 0; i < total; i++) {
+        diff_change_t *change = i < side_a.count ? &side_a.changes[i]
+                                                 : &side_b.changes[i - side_a.count];
+        if (!change->path) {
+            /* Not reachable from the root, e.g. open but unlinked */
+            char name[32];
+            snprintf(name, sizeof(name), "<inode %u>", change->ino);
+            change->path = strdup(name);
+            if (!change->path) {
+                perror("Error allocating path");
+                goto out_lock;
+            }
+        }
+        sorted[i] = change;
+    }
+    qsort(sorted, total, sizeof(diff_change_t *), diff_path_cmp);
+    
+    for (size_t i = 0; i < total; i++) {
+        const diff_change_t *change = sorted[i];
+        int slash = change->dir && strcmp(change->path, "/") != 0;
+        printf("%c  %s%s\n", change->status, change->path, slash ? "/" : "");
+    }
+    fprintf(stderr, "%zu changed: %zu added, %zu deleted, %zu modified, %zu metadata only; "
+                    "%llu blocks differ, %llu compared\n", total, added, deleted, modified, meta,
+            (unsigned long long)job.differ, (unsigned long long)job.compared);
+    result = total ? 1 : 0;
+    
+out_lock:
+    pthread_mutex_destroy(&job.lock);
+out:
+    for (size_t i = 0; i < side_a.count; i++) {
+        free(side_a.changes[i].path);
+    }
+    for (size_t i = 0; i < side_b.count; i++) {
+        free(side_b.changes[i].path);
+    }
+    free(side_a.changes);
+    free(side_b.changes);
+    free(sorted);
+    free(job.changed);
+    free(job.state);
+    ext2_close(&other);
+    return result;
+}
+
+/*
+ * Scans every block of a directory for a name. Returns its inode number,
+ * 0 when the name is not present and (uint32_t)-1 on read errors.
+ */
+static uint32_t ext2_dir_scan(ext2_fs_t *fs, const ext2_inode_t *inode,
+                              const char *component, size_t component_len) {
+    ext2_dir_t it;
+    ext2_dirent_t ent;
+    int more;
+    
+    if (ext2_dir_open(&it, fs, inode) != 0) {
+        return (uint32_t)-1;
+    }
+    while ((more = ext2_dir_next(&it, &ent)) > 0) {
+        if (ent.name_len == component_len && memcmp(ent.name, component, component_len) == 0) {
+            break;
+        }
+    }
+    ext2_dir_close(&it);
+    
+    if (more < 0) {
+        return (uint32_t)-1;
+    }
+    return more ? ent.ino : 0;
+}
+
+/*
+ * Reads logical block lblk of a directory for ext2r_dx_find; ctx is the
+ * directory's block map
+ */
+static const uint8_t *ext2_dx_read(void *ctx, uint32_t lblk, uint8_t *buf) {
+    ext2_bmap_t *bm = (ext2_bmap_t *)ctx;
+    uint32_t block_num;
+    if (ext2_bmap_lookup(bm, lblk, &block_num) != 0 || block_num == 0) {
+        return NULL;
+    }
+    return ext2_get_block(bm->fs, block_num, buf);
+}
+
+/*
+ * Looks a name up through a directory's HTree index, reading its blocks
+ * through the cache or the mapping. Returns the inode number, 0 when
+ * absent, (uint32_t)-1 on read errors and (uint32_t)-2 when the index is
+ * unusable and a linear scan is needed.
+ */
+static uint32_t ext2_dx_lookup(ext2_fs_t *fs, const ext2_inode_t *dir,
+                               const char *name, size_t name_len) {
+    uint32_t block_size = 1024 << fs->superblock.s_log_block_size;
+    uint32_t ino;
+    
+    uint8_t *bufs = (uint8_t *)malloc((size_t)block_size * 4);
+    if (!bufs) {
+        return (uint32_t)-1;
+    }
+    
+    ext2_bmap_t bm;
+    if (ext2_bmap_open(&bm, fs, dir) != 0) {
+        free(bufs);
+        return (uint32_t)-1;
+    }
+    int err = ext2r_dx_find(&fs->superblock, ext2_dx_read, &bm, bufs, name, name_len, &ino);
+    ext2_bmap_close(&bm);
+    free(bufs);
+    
+    return err == EXT2R_OK ? ino : (uint32_t)-2;
+}
+
+/*
+ * Looks up one name in a directory, going through the dentry cache.
+ * Returns the inode number or 0 if the name does not exist or dir_ino is
+ * not a directory.
+ */
+uint32_t ext2_lookup(ext2_fs_t *fs, uint32_t dir_ino, const char *name, size_t name_len) {
+    uint32_t hash = ext2_name_hash(name, name_len);
+    uint32_t ino;
+    
+    if (ext2_dcache_lookup(fs, dir_ino, hash, name, name_len, &ino)) {
+        return ino;
+    }
+    
+    ext2_inode_t inode_buf;
+    const ext2_inode_t *inode = ext2_get_inode(fs, dir_ino, &inode_buf);
+    if (!inode) {
+        return 0;
+    }
+    
+    /* Check if current inode is a directory */
+    if ((inode->i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR) {
+        return 0;
+    }
+    
+    ino = (uint32_t)-2;
+    if ((inode->i_flags & EXT2_INDEX_FL) &&
+        (fs->superblock.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)) {
+        ino = ext2_dx_lookup(fs, inode, name, name_len);
+    }
+    if (ino == (uint32_t)-2) {
+        ino = fs->dindex ? ext2_dindex_lookup(fs, dir_ino, inode, hash, name, name_len)
+                         : ext2_dir_scan(fs, inode, name, name_len);
+    }
+    if (ino == (uint32_t)-1) {
+        return 0;  /* Don't remember I/O errors */
+    }
+    
+    /* Misses are cached too, as negative entries */
+    ext2_dcache_insert(fs, dir_ino, hash, name, name_len, ino);
+    return ino;
+}
+
+/*
+ * Walks a path for ext2_find_inode
+ */
+static uint32_t ext2_resolve_path(ext2_fs_t *fs, const char *path) {
+    /* Start with root inode */
+    uint32_t current_inode = EXT2_ROOT_INODE;
+    const char *p = path;
+    
+    /* Walk the components in place, without copying the path */
+    while (*p) {
+        while (*p == '/') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
         
-        /* Check if current inode is a directory */
-        if ((inode.i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR) {
-            free(path_copy);
+        const char *component = p;
+        while (*p && *p != '/') {
+            p++;
+        }
+        
+        size_t component_len = p - component;
+        if (component_len > EXT2_NAME_LEN) {
             return 0;
         }
         
-        /* Search for component in directory */
-        int block_size = 1024 << fs->superblock.s_log_block_size;
-        uint8_t *dir_block = (uint8_t *)malloc(block_size);
-        if (!dir_block) {
-            free(path_copy);
+        current_inode = ext2_lookup(fs, current_inode, component, component_len);
+        if (current_inode == 0) {
             return 0;
         }
+    }
+    
+    return current_inode;
+}
+
+/*
+ * Finds an inode by path
+ */
+uint32_t ext2_find_inode(ext2_fs_t *fs, const char *path) {
+    uint64_t start = ext2_stats_begin();
+    uint32_t ino = fs->index ? ext2_index_find(fs->index, path) : EXT2_INDEX_UNKNOWN;
+    if (ino == EXT2_INDEX_UNKNOWN) {
+        ino = ext2_resolve_path(fs, path);
+    }
+    ext2_stats_end(EXT2_STAT_LOOKUP, start, 0, 0);
+    return ino;
+}
+
+/*
+ * Parses a find test value "[+-]N[kMG]" into a comparison and a number.
+ * Returns -1 if the text is not a number.
+ */
+static int parse_find_value(const char *arg, int *cmp, uint64_t *value) {
+    *cmp = 0;
+    if (*arg == '+' || *arg == '-') {
+        *cmp = (*arg == '+') ? 1 : -1;
+        arg++;
+    }
+    
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if (end == arg || errno != 0) {
+        return -1;
+    }
+    switch (*end) {
+    case 'k': n <<= 10; end++; break;
+    case 'M': n <<= 20; end++; break;
+    case 'G': n <<= 30; end++; break;
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+    *value = n;
+    return 0;
+}
+
+/*
+ * Runs one command against an opened image. argv[0] is the command name.
+ */
+int run_command(ext2_fs_t *fs, const char *prog, int argc, char *argv[]) {
+    const char *command = argv[0];
+    
+    if (strcmp(command, "ls") == 0) {
+        const char *path = (argc > 1) ? argv[1] : "/";
+        return ext2_ls(fs, path);
+    } else if (strcmp(command, "cp") == 0) {
+        int recursive = 0;
+        int nthreads = 0;
+        int argi = 1;
+        
+        while (argi < argc && argv[argi][0] == '-' && argv[argi][1] != '\0') {
+            if (strcmp(argv[argi], "-r") == 0) {
+                recursive = 1;
+            } else if (strcmp(argv[argi], "-j") == 0 && argi + 1 < argc) {
+                nthreads = atoi(argv[++argi]);
+            } else {
+                fprintf(stderr, "Unknown cp option: %s\n", argv[argi]);
+                return 1;
+            }
+            argi++;
+        }
+        
+        if (argc - argi < 2) {
+            fprintf(stderr, "Usage: %s <disk_image> cp [-r] [-j threads] <src>... <dst>\n", prog);
+            return 1;
+        }
         
-        int found = 0;
-        uint32_t dir_size = inode.i_size;
+        /* A single file keeps the plain copy; everything else fans out */
+        if (!recursive && nthreads == 0 && argc - argi == 2) {
+            const char *src = argv[argi];
+            const char *dst = argv[argi + 1];
+            return ext2_cp(fs, src, dst);
+        }
         
-        for (int i = 0; i < 12 && !found; i++) {
-            if (inode.i_block[i] == 0) break;
-            
-            if (ext2_read_block(fs, inode.i_block[i], dir_block) != 0) {
-                free(dir_block);
-                free(path_copy);
-                return 0;
+        if (nthreads <= 0) {
+            nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        return ext2_cp_parallel(fs, argv + argi, argc - argi - 1, argv[argc - 1],
+                                recursive, nthreads);
+    } else if (strcmp(command, "cat") == 0) {
+        if (argc < 2 || argc > 4) {
+            fprintf(stderr, "Usage: %s <disk_image> cat <path> [offset] [length]\n", prog);
+            return 1;
+        }
+        
+        int64_t offset = 0;
+        uint64_t length = 0;
+        char *end;
+        errno = 0;
+        if (argc > 2) {
+            offset = strtoll(argv[2], &end, 10);
+            if (end == argv[2] || *end != '\0' || errno != 0) {
+                fprintf(stderr, "Bad offset: %s\n", argv[2]);
+                return 1;
+            }
+        }
+        if (argc > 3) {
+            length = strtoull(argv[3], &end, 10);
+            if (end == argv[3] || *end != '\0' || errno != 0 || argv[3][0] == '-') {
+                fprintf(stderr, "Bad length: %s\n", argv[3]);
+                return 1;
+            }
+        }
+        return ext2_cat(fs, argv[1], offset, length) == 0 ? 0 : 1;
+    } else if (strcmp(command, "df") == 0) {
+        return ext2_df(fs);
+    } else if (strcmp(command, "index") == 0) {
+        if (argc != 2) {
+            fprintf(stderr, "Usage: %s <disk_image> index <index_file>\n", prog);
+            return 1;
+        }
+        return ext2_index_build(fs, argv[1]) == 0 ? 0 : 1;
+    } else if (strcmp(command, "scan") == 0) {
+        int list = 0;
+        int nthreads = 0;
+        
+        for (int argi = 1; argi < argc; argi++) {
+            if (strcmp(argv[argi], "-l") == 0) {
+                list = 1;
+            } else if (strcmp(argv[argi], "-j") == 0 && argi + 1 < argc) {
+                nthreads = atoi(argv[++argi]);
+            } else {
+                fprintf(stderr, "Usage: %s <disk_image> scan [-l] [-j threads]\n", prog);
+                return 1;
+            }
+        }
+        
+        if (nthreads <= 0) {
+            nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        return ext2_scan(fs, list, nthreads);
+    } else if (strcmp(command, "hash") == 0) {
+        int algo = EXT2_DIGEST_SHA256;
+        int recursive = 0;
+        int nthreads = 0;
+        int argi = 1;
+        
+        for (; argi < argc && argv[argi][0] == '-'; argi++) {
+            if (strcmp(argv[argi], "-r") == 0) {
+                recursive = 1;
+            } else if (strcmp(argv[argi], "-j") == 0 && argi + 1 < argc) {
+                nthreads = atoi(argv[++argi]);
+            } else if (strcmp(argv[argi], "-a") == 0 && argi + 1 < argc &&
+                       (strcmp(argv[argi + 1], "sha256") == 0 ||
+                        strcmp(argv[argi + 1], "xxh64") == 0)) {
+                algo = strcmp(argv[++argi], "xxh64") == 0 ? EXT2_DIGEST_XXH64 : EXT2_DIGEST_SHA256;
+            } else {
+                break;
+            }
+        }
+        if (argi >= argc) {
+            fprintf(stderr, "Usage: %s <disk_image> hash [-a sha256|xxh64] [-r] [-j threads] "
+                            "<path>...\n", prog);
+            return 1;
+        }
+        
+        if (nthreads <= 0) {
+            nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        return ext2_hash(fs, argv + argi, argc - argi, algo, recursive, nthreads) == 0 ? 0 : 1;
+    } else if (strcmp(command, "diff") == 0) {
+        int nthreads = 0;
+        const char *other = NULL;
+        
+        for (int argi = 1; argi < argc; argi++) {
+            if (strcmp(argv[argi], "-j") == 0 && argi + 1 < argc) {
+                nthreads = atoi(argv[++argi]);
+            } else if (!other) {
+                other = argv[argi];
+            } else {
+                other = NULL;
+                break;
+            }
+        }
+        if (!other) {
+            fprintf(stderr, "Usage: %s <disk_image> diff [-j threads] <other_image>\n", prog);
+            return 2;
+        }
+        
+        if (nthreads <= 0) {
+            nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        int result = ext2_diff(fs, other, nthreads);
+        return result < 0 ? 2 : result;
+    } else if (strcmp(command, "check") == 0) {
+        int nthreads = 0;
+        
+        for (int argi = 1; argi < argc; argi++) {
+            if (strcmp(argv[argi], "-j") == 0 && argi + 1 < argc) {
+                nthreads = atoi(argv[++argi]);
+            } else {
+                fprintf(stderr, "Usage: %s <disk_image> check [-j threads]\n", prog);
+                return 1;
             }
+        }
+        
+        if (nthreads <= 0) {
+            nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        return ext2_check(fs, nthreads) == 0 ? 0 : 1;
+    } else if (strcmp(command, "find") == 0 || strcmp(command, "du") == 0) {
+        int is_find = command[0] == 'f';
+        const char *path = "/";
+        int summary = 0;
+        int nthreads = 0;
+        ext2_find_filter_t filter;
+        memset(&filter, 0, sizeof(filter));
+        
+        int argi = 1;
+        if (argi < argc && argv[argi][0] != '-') {
+            path = argv[argi++];
+        }
+        for (; argi < argc; argi++) {
+            const char *opt = argv[argi];
+            const char *val = (argi + 1 < argc) ? argv[argi + 1] : NULL;
+            int bad = 0;
             
-            /* Parse directory entries */
-            uint32_t offset = 0;
-            while (offset < (uint32_t)block_size && offset < dir_size && !found) {
-                if (offset + sizeof(ext2_dir_entry_t) > (uint32_t)block_size) {
-                    break;  /* Not enough space for even the header */
-                }
-                
-                ext2_dir_entry_t *entry = (ext2_dir_entry_t *)(dir_block + offset);
-                
-                if (entry->rec_len == 0) {
-                    break;  /* Prevent infinite loop */
-                }
-                
-                if (entry->inode == 0) {
-                    offset += entry->rec_len;
-                    continue;
+            if (strcmp(opt, "-j") == 0 && val) {
+                nthreads = atoi(val);
+                argi++;
+            } else if (!is_find && strcmp(opt, "-s") == 0) {
+                summary = 1;
+            } else if (is_find && strcmp(opt, "-name") == 0 && val) {
+                filter.name = val;
+                argi++;
+            } else if (is_find && strcmp(opt, "-type") == 0 && val) {
+                switch (val[0]) {
+                case 'f': filter.mode = EXT2_S_IFREG; break;
+                case 'd': filter.mode = EXT2_S_IFDIR; break;
+                case 'l': filter.mode = EXT2_S_IFLNK; break;
+                default: bad = 1;
                 }
-                
-                /* Bounds check: name_len should not exceed rec_len - header size */
-                uint16_t max_name_len = entry->rec_len - sizeof(ext2_dir_entry_t);
-                if (entry->name_len > max_name_len) {
-                    entry->name_len = max_name_len;
-                }
-                
-                if (entry->name_len > 255) {
-                    entry->name_len = 255;
-                }
-                
-                char name[256];
-                char *name_ptr = (char *)(entry + 1);  /* Name starts right after the header */
-                strncpy(name, name_ptr, entry->name_len);
-                name[entry->name_len] = '\0';
-                
-                if (strcmp(name, component) == 0) {
-                    current_inode = entry->inode;
-                    found = 1;
+                argi++;
+            } else if (is_find && strcmp(opt, "-size") == 0 && val) {
+                filter.has_size = 1;
+                bad = parse_find_value(val, &filter.size_cmp, &filter.size) != 0;
+                argi++;
+            } else if (is_find && strcmp(opt, "-mtime") == 0 && val) {
+                filter.has_mtime = 1;
+                bad = parse_find_value(val, &filter.mtime_cmp, &filter.mtime_days) != 0;
+                argi++;
+            } else {
+                bad = 1;
+            }
+            
+            if (bad) {
+                if (is_find) {
+                    fprintf(stderr, "Usage: %s <disk_image> find [path] [-name glob] [-type f|d|l] "
+                            "[-size [+-]n[kMG]] [-mtime [+-]days] [-j threads]\n", prog);
+                } else {
+                    fprintf(stderr, "Usage: %s <disk_image> du [path] [-s] [-j threads]\n", prog);
                 }
-                
-                offset += entry->rec_len;
-                if (entry->rec_len == 0) break;
+                return 1;
             }
         }
         
-        free(dir_block);
+        if (nthreads <= 0) {
+            nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        return is_find ? ext2_find(fs, path, &filter, nthreads)
+                       : ext2_du(fs, path, summary, nthreads);
+    }
+    
+    fprintf(stderr, "Unknown command: %s\n", command);
+    return 1;
+}
+
+/*
+ * Splits a script line into words in place. Words are separated by
+ * blanks; double quotes group a word that contains blanks.
+ */
+static int split_words(char *line, char *words[], int max_words) {
+    int count = 0;
+    char *p = line;
+    
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+            p++;
+        }
+        if (*p == '\0' || *p == '#') {
+            break;
+        }
+        if (count == max_words) {
+            return -1;
+        }
         
-        if (!found) {
-            free(path_copy);
-            return 0;
+        char *out = p;
+        words[count++] = out;
+        int quoted = 0;
+        while (*p && (quoted || (*p != ' ' && *p != '\t' && *p != '\r' && *p != '\n'))) {
+            if (*p == '"') {
+                quoted = !quoted;
+                p++;
+                continue;
+            }
+            *out++ = *p++;
+        }
+        if (*p) {
+            p++;
+        }
+        *out = '\0';
+    }
+    
+    return count;
+}
+
+/*
+ * Runs commands read one per line from a script ("-" for stdin)
+ * against the already opened image, printing a status line after each.
+ * Returns 0 when every command succeeded.
+ */
+int run_batch(ext2_fs_t *fs, const char *prog, const char *script) {
+    FILE *in = stdin;
+    if (strcmp(script, "-") != 0) {
+        in = fopen(script, "r");
+        if (!in) {
+            perror("Error opening batch script");
+            return 1;
+        }
+    }
+    
+    char *line = NULL;
+    size_t line_size = 0;
+    unsigned long line_no = 0;
+    unsigned long total = 0;
+    unsigned long failed = 0;
+    
+    while (getline(&line, &line_size, in) >= 0) {
+        char *words[16];
+        line_no++;
+        
+        int count = split_words(line, words, 16);
+        if (count == 0) {
+            continue;  /* Blank line or comment */
+        }
+        
+        total++;
+        int rc;
+        if (count < 0) {
+            fprintf(stderr, "Too many arguments\n");
+            rc = 1;
+        } else if (strcmp(words[0], "batch") == 0) {
+            fprintf(stderr, "Batch scripts cannot be nested\n");
+            rc = 1;
+        } else {
+            rc = run_command(fs, prog, count, words);
+        }
+        
+        if (rc != 0) {
+            failed++;
         }
         
-        component = strtok_r(NULL, "/", &saveptr);
+        /* Keep stdout and stderr in step so the status follows its output */
+        fflush(stdout);
+        printf("[%s] line %lu: %s\n", rc == 0 ? "ok" : "FAILED", line_no,
+               count > 0 ? words[0] : "?");
+        fflush(stdout);
     }
     
-    free(path_copy);
-    return current_inode;
+    free(line);
+    if (in != stdin) {
+        fclose(in);
+    }
+    
+    printf("Batch complete: %lu commands, %lu failed\n", total, failed);
+    return failed ? 1 : 0;
 }
 
+#ifndef MYFS_NO_MAIN
 /*
  * Main function
  */
 int main(int argc, char *argv[]) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <disk_image> <command> [args]\n", argv[0]);
+    int open_flags = EXT2_OPEN_MMAP;
+    int zero_copy = 1;
+    uint32_t cache_mb = 16;
+    uint32_t dindex_mb = EXT2_DINDEX_DEFAULT_MB;
+    int cache_stats = 0;
+    int stats = 0;                      /* 1: text, 2: JSON */
+    int uring_depth = 0;
+    uint32_t readahead_kb = EXT2_READAHEAD_DEFAULT_KB;
+    const char *index_path = NULL;
+    int argi = 1;
+    
+    /* Options come before the disk image */
+    while (argi < argc && strncmp(argv[argi], "--", 2) == 0) {
+        if (strcmp(argv[argi], "--no-mmap") == 0) {
+            open_flags &= ~EXT2_OPEN_MMAP;
+        } else if (strcmp(argv[argi], "--no-zerocopy") == 0) {
+            zero_copy = 0;
+        } else if (strcmp(argv[argi], "--cache-mb") == 0 && argi + 1 < argc) {
+            cache_mb = (uint32_t)strtoul(argv[++argi], NULL, 10);
+        } else if (strcmp(argv[argi], "--dir-index-mb") == 0 && argi + 1 < argc) {
+            dindex_mb = (uint32_t)strtoul(argv[++argi], NULL, 10);
+        } else if (strcmp(argv[argi], "--cache-stats") == 0) {
+            cache_stats = 1;
+        } else if (strcmp(argv[argi], "--stats") == 0 || strcmp(argv[argi], "--stats=text") == 0) {
+            stats = 1;
+        } else if (strcmp(argv[argi], "--stats=json") == 0) {
+            stats = 2;
+        } else if (strcmp(argv[argi], "--uring") == 0 && argi + 1 < argc) {
+            uring_depth = atoi(argv[++argi]);
+        } else if (strcmp(argv[argi], "--readahead-kb") == 0 && argi + 1 < argc) {
+            readahead_kb = (uint32_t)strtoul(argv[++argi], NULL, 10);
+        } else if (strcmp(argv[argi], "--index") == 0 && argi + 1 < argc) {
+            index_path = argv[++argi];
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[argi]);
+            return 1;
+        }
+        argi++;
+    }
+    
+    if (argc - argi < 2) {
+        fprintf(stderr, "Usage: %s [options] <disk_image> <command> [args]\n", argv[0]);
+        fprintf(stderr, "Options:\n");
+        fprintf(stderr, "  --no-mmap          - Read the image with pread instead of mapping it\n");
+        fprintf(stderr, "  --no-zerocopy      - Copy file data through user space\n");
+        fprintf(stderr, "  --cache-mb <n>     - Block cache size for --no-mmap (default 16, 0 disables)\n");
+        fprintf(stderr, "  --dir-index-mb <n> - Memory for per-directory name tables (default 16, 0 disables)\n");
+        fprintf(stderr, "  --cache-stats      - Print cache counters on exit\n");
+        fprintf(stderr, "  --stats[=json]     - Print hot path calls, bytes, time and blocks per read on exit\n");
+        fprintf(stderr, "  --uring <depth>    - Copy large files with io_uring, depth reads in flight\n");
+        fprintf(stderr, "  --readahead-kb <n> - Largest readahead window for file walks (0 disables)\n");
+        fprintf(stderr, "  --index <file>     - Resolve paths, inodes and block maps from a sidecar index\n");
         fprintf(stderr, "Commands:\n");
         fprintf(stderr, "  ls [path]          - List files in directory\n");
         fprintf(stderr, "  cp <src> <dst>     - Copy file from image to host\n");
+        fprintf(stderr, "  cp [-r] [-j n] <src>... <dir>\n");
+        fprintf(stderr, "                     - Copy files/trees into a host directory with n threads\n");
+        fprintf(stderr, "  cat <path> [offset] [length]\n");
+        fprintf(stderr, "                     - Write a file, or length bytes from offset (<0: from the end), to stdout\n");
+        fprintf(stderr, "  find [path] [-name glob] [-type f|d|l] [-size [+-]n[kMG]] [-mtime [+-]days] [-j n]\n");
+        fprintf(stderr, "                     - List the tree below path with type, size and usage\n");
+        fprintf(stderr, "  du [path] [-s] [-j n] - Disk usage in KiB of each directory below path\n");
+        fprintf(stderr, "  scan [-l] [-j n]   - Count (or list) every used inode, group by group\n");
+        fprintf(stderr, "  check [-j n]       - Verify block ownership, bitmaps, counters and directories\n");
+        fprintf(stderr, "  hash [-a sha256|xxh64] [-r] [-j n] <path>... - Checksum files without extracting them\n");
+        fprintf(stderr, "  diff [-j n] <image> - List files that differ from another image of the same layout\n");
+        fprintf(stderr, "  df                 - Free space and free extent histogram from the bitmaps\n");
+        fprintf(stderr, "  index <file>       - Write a sidecar index of the tree for --index\n");
+        fprintf(stderr, "  batch [script|-]   - Run commands, one per line (default stdin)\n");
         return 1;
     }
     
-    const char *img_path = argv[1];
-    const char *command = argv[2];
+    const char *img_path = argv[argi];
+    const char *command = argv[argi + 1];
     
     ext2_fs_t fs;
     memset(&fs, 0, sizeof(fs));
     
-    if (ext2_open(img_path, &fs) != 0) {
+    if (stats) {
+        ext2_stats_enable();
+    }
+    
+    /* The banner would end up in the file data or among the digests */
+    if (strcmp(command, "cat") == 0 || strcmp(command, "hash") == 0 ||
+        strcmp(command, "diff") == 0) {
+        open_flags |= EXT2_OPEN_QUIET;
+    }
+    
+    if (ext2_open(img_path, &fs, open_flags) != 0) {
         fprintf(stderr, "Failed to open EXT2 image\n");
         return 1;
     }
+    if (!zero_copy) {
+        fs.copy_mode = EXT2_COPY_BUFFERED;
+    }
+    if (uring_depth > 0) {
+        fs.uring_depth = (uring_depth > 256) ? 256 : uring_depth;
+    }
+    fs.readahead_kb = readahead_kb;
+    if (ext2_cache_init(&fs, cache_mb) != 0 || ext2_dindex_init(&fs, dindex_mb) != 0 ||
+        (index_path && ext2_index_load(&fs, index_path) != 0)) {
+        ext2_close(&fs);
+        return 1;
+    }
     
-    int result = 0;
+    int result;
     
-    if (strcmp(command, "ls") == 0) {
-        const char *path = (argc > 3) ? argv[3] : "/";
-        result = ext2_ls(&fs, path);
-    } else if (strcmp(command, "cp") == 0) {
-        if (argc < 5) {
-            fprintf(stderr, "Usage: %s <disk_image> cp <src> <dst>\n", argv[0]);
-            ext2_close(&fs);
-            return 1;
-        }
-        const char *src = argv[3];
-        const char *dst = argv[4];
-        result = ext2_cp(&fs, src, dst);
+    if (strcmp(command, "batch") == 0) {
+        const char *script = (argc - argi > 2) ? argv[argi + 2] : "-";
+        result = run_batch(&fs, argv[0], script);
     } else {
-        fprintf(stderr, "Unknown command: %s\n", command);
-        result = 1;
+        result = run_command(&fs, argv[0], argc - argi - 1, argv + argi + 1);
+    }
+    
+    if (cache_stats) {
+        ext2_cache_report(&fs, stderr);
+    }
+    if (stats) {
+        ext2_stats_report(stderr, stats == 2);
     }
     
     ext2_close(&fs);
     return result;
 }
+#endif
@@ -0,0 +1,415 @@
+#ifndef MYFS_H
+#define MYFS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "ext2.h"
+#include "ext2reader.h"
+
+/* Flags for ext2_open */
+#define EXT2_OPEN_MMAP 0x01             /* Map the image instead of using pread */
+#define EXT2_OPEN_QUIET 0x02            /* Skip the superblock summary on stdout */
+
+/* How ext2_cp moves file data, from fastest to most portable */
+#define EXT2_COPY_RANGE 0               /* copy_file_range: stays in the kernel */
+#define EXT2_COPY_SENDFILE 1            /* sendfile: kernel pipe, no user copy */
+#define EXT2_COPY_BUFFERED 2            /* pread/pwrite or write from the mapping */
+
+/* Access pattern hints for ext2_advise */
+#define EXT2_ADVISE_NORMAL 0
+#define EXT2_ADVISE_SEQUENTIAL 1
+#define EXT2_ADVISE_RANDOM 2
+#define EXT2_ADVISE_WILLNEED 3          /* Start reading the range in the background */
+
+/* Readahead window used by block map walks: starts small, doubles while
+ * access stays sequential, up to fs->readahead_kb */
+#define EXT2_READAHEAD_MIN_KB 64
+#define EXT2_READAHEAD_DEFAULT_KB 4096
+
+/* One slot of the block cache */
+typedef struct {
+    uint32_t block_num;                 /* Block held in this slot */
+    int32_t hash_next;                  /* Next slot in the same hash bucket, -1 ends */
+    int32_t lru_prev;                   /* Towards the most recently used slot */
+    int32_t lru_next;                   /* Towards the least recently used slot */
+} ext2_cache_slot_t;
+
+/* Fixed-size LRU cache of image blocks for the pread backend */
+typedef struct {
+    uint32_t block_size;                /* Bytes per cached block */
+    uint32_t capacity;                  /* Number of slots */
+    uint32_t used;                      /* Slots handed out from the pool so far */
+    uint8_t *pool;                      /* capacity * block_size bytes of block data */
+    ext2_cache_slot_t *slots;           /* Per-slot bookkeeping */
+    int32_t *buckets;                   /* Hash heads indexed by block hash */
+    uint32_t hash_mask;                 /* Number of buckets - 1 */
+    int32_t lru_head;                   /* Most recently used slot */
+    int32_t lru_tail;                   /* Least recently used slot, evicted first */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    pthread_mutex_t lock;               /* Shared by all threads using the image */
+} ext2_cache_t;
+
+/* One cached name lookup; ino 0 records that the name does not exist */
+typedef struct {
+    uint32_t parent;                    /* Directory inode, 0 marks a free slot */
+    uint32_t hash;                      /* Hash of the name */
+    uint32_t ino;                       /* Inode the name resolves to */
+    uint32_t name_off;                  /* Offset of the name in the arena */
+    uint32_t name_len;
+} ext2_dentry_t;
+
+/* Dentry cache: open-addressed table keyed by (parent, name hash) */
+typedef struct {
+    ext2_dentry_t *entries;
+    uint32_t mask;                      /* Number of slots - 1 */
+    uint32_t count;                     /* Occupied slots */
+    char *names;                        /* Arena holding every cached name */
+    uint32_t names_size;
+    uint32_t names_used;
+    uint64_t hits;
+    uint64_t negative_hits;
+    uint64_t misses;
+    uint64_t flushes;
+    pthread_mutex_t lock;
+} ext2_dcache_t;
+
+/* Default dentry cache size; the arena allows an average name of 32 bytes */
+#define EXT2_DCACHE_ENTRIES 16384
+
+/* One name of an indexed directory */
+typedef struct {
+    uint32_t hash;                      /* Hash of the name */
+    uint32_t ino;                       /* Inode the name resolves to, 0 marks a free slot */
+    uint32_t name_off;                  /* Offset of the name in the arena */
+    uint8_t name_len;
+    uint8_t file_type;
+} ext2_dindex_entry_t;
+
+/* Name table of one directory, built by its first full scan */
+typedef struct ext2_dindex {
+    uint32_t dir_ino;
+    uint32_t mask;                      /* Number of slots - 1 */
+    ext2_dindex_entry_t *entries;
+    char *names;                        /* Arena holding the directory's names */
+    size_t bytes;                       /* Memory charged to this index */
+    struct ext2_dindex *hash_next;      /* Next index in the same bucket */
+    struct ext2_dindex *newer;          /* Next index in build order */
+} ext2_dindex_t;
+
+/* Per-directory indexes, evicted oldest first to stay within a budget */
+#define EXT2_DINDEX_BUCKETS 256
+typedef struct {
+    ext2_dindex_t *buckets[EXT2_DINDEX_BUCKETS];
+    ext2_dindex_t *oldest;
+    ext2_dindex_t *newest;
+    size_t bytes;                       /* Memory held by all indexes */
+    size_t limit;                       /* Memory budget */
+    uint32_t dirs;                      /* Indexed directories */
+    uint64_t hits;
+    uint64_t builds;
+    uint64_t evictions;
+    uint64_t oversized;                 /* Indexes built but too large to keep */
+    pthread_mutex_t lock;
+} ext2_dindex_cache_t;
+
+/* Default memory budget for directory indexes */
+#define EXT2_DINDEX_DEFAULT_MB 16
+
+/* A run of file blocks that is contiguous on disk */
+typedef struct {
+    uint32_t logical;                   /* First file block of the run */
+    uint32_t physical;                  /* First disk block, 0 for a hole */
+    uint32_t length;                    /* Number of blocks in the run */
+} ext2_extent_t;
+
+/* Sidecar index: a flat snapshot of the tree written by "index" and
+ * mapped read-only by ext2_index_load. All offsets are from the start of
+ * the file and every section is 8-byte aligned. */
+#define EXT2_INDEX_MAGIC "MYFSIDX1"
+#define EXT2_INDEX_VERSION 1
+
+typedef struct {
+    char magic[8];                      /* EXT2_INDEX_MAGIC */
+    uint32_t version;
+    uint32_t block_size;
+    char uuid[16];                      /* Copied from the superblock to detect a different */
+    uint32_t wtime;                     /* image, or the same image written since */
+    uint32_t mtime;
+    uint32_t inodes_count;
+    uint32_t blocks_count;
+    uint32_t path_count;
+    uint32_t hash_size;                 /* Slots in the path hash, a power of two */
+    uint32_t inode_count;
+    uint32_t key_count;
+    uint64_t extent_count;
+    uint64_t paths_off;                 /* ext2_index_path_t[path_count] */
+    uint64_t hash_off;                  /* uint32_t[hash_size]: path number + 1, 0 when empty */
+    uint64_t names_off;                 /* Normalized absolute paths, NUL terminated */
+    uint64_t names_size;
+    uint64_t inodes_off;                /* ext2_index_inode_t[inode_count], by inode number */
+    uint64_t keys_off;                  /* ext2_index_key_t[key_count], by block */
+    uint64_t extents_off;               /* ext2_extent_t[extent_count] */
+    uint64_t file_size;
+} ext2_index_header_t;
+
+/* One path of the tree */
+typedef struct {
+    uint64_t name_off;                  /* Into the names section */
+    uint32_t name_len;
+    uint32_t hash;                      /* ext2_name_hash of the path */
+    uint32_t ino;
+    uint32_t reserved;
+} ext2_index_path_t;
+
+/* Attributes of one inode reachable from the root, with its data runs */
+typedef struct {
+    uint32_t ino;
+    uint32_t extent_count;              /* Runs of mapped blocks; holes are left out */
+    uint64_t extent_first;
+    ext2_inode_t inode;
+} ext2_index_inode_t;
+
+/* Finds the extents of a file from its inode alone: the first indirect
+ * block belongs to exactly one file, and files without one have their
+ * whole map in i_block already */
+typedef struct {
+    uint32_t block;
+    uint32_t inode;                     /* Position in the inodes section */
+} ext2_index_key_t;
+
+/* A loaded sidecar index */
+typedef struct {
+    const uint8_t *map;
+    size_t size;
+    const ext2_index_header_t *header;
+    const ext2_index_path_t *paths;
+    const uint32_t *hash;
+    const char *names;
+    const ext2_index_inode_t *inodes;
+    const ext2_index_key_t *keys;
+    const ext2_extent_t *extents;
+} ext2_index_t;
+
+typedef struct {
+    int fd;                             /* File descriptor for disk image */
+    ext2_superblock_t superblock;      /* Superblock */
+    ext2_group_desc_t *group_descs;    /* Group descriptors */
+    int num_groups;                     /* Number of block groups */
+    uint8_t *map;                       /* Read-only image mapping, NULL for pread */
+    size_t map_size;                    /* Length of the mapping in bytes */
+    int copy_mode;                      /* EXT2_COPY_*, degraded when unsupported */
+    ext2_cache_t *cache;                /* Metadata block cache, NULL when disabled */
+    ext2_dcache_t *dcache;              /* Path component cache, NULL when disabled */
+    ext2_dindex_cache_t *dindex;        /* Per-directory name tables, NULL when disabled */
+    ext2_index_t *index;                /* Sidecar index, NULL when not loaded */
+    int uring_depth;                    /* Reads kept in flight by io_uring, 0 = off */
+    uint32_t readahead_kb;              /* Largest readahead window, 0 = off */
+} ext2_fs_t;
+
+/* Block map iterator: resolves direct and indirect pointers of one inode */
+typedef struct ext2_bmap {
+    ext2_fs_t *fs;
+    uint32_t i_block[15];               /* Block pointers copied from the inode */
+    uint32_t next;                      /* Next logical block to map */
+    uint32_t count;                     /* Logical blocks covered by the file size */
+    uint32_t ptrs_per_block;            /* Pointers held by one indirect block */
+    ext2r_map_t map;                    /* Indirect block cached at each depth */
+    uint8_t *ind_buf;                   /* Backing store for map on the pread path */
+    struct ext2_bmap *ra;               /* Cursor running ahead to issue hints, or NULL */
+    uint32_t ra_window;                 /* Blocks currently hinted beyond the reader */
+    uint32_t ra_max;                    /* Window limit in blocks */
+    uint32_t ra_expect;                 /* Where a sequential reader continues */
+    int hint_indirect;                  /* Set on the cursor: hint upcoming indirect blocks */
+    const ext2_extent_t *ix;            /* Runs from the sidecar index instead of the tree */
+    uint32_t ix_count;
+} ext2_bmap_t;
+
+/* Largest single read issued when copying a run of blocks */
+#define EXT2_COPY_CHUNK (1024 * 1024)
+
+/* Files are split into tasks of this many bytes for parallel extraction */
+#define EXT2_PARALLEL_CHUNK (64 * 1024 * 1024)
+
+/* Digests computed by the hash command */
+#define EXT2_DIGEST_SHA256 0
+#define EXT2_DIGEST_XXH64 1
+#define EXT2_DIGEST_HEX 65              /* Longest digest in hex, with its NUL */
+
+/* A directory entry seen through ext2_dir_next: the name points into
+ * the directory block and is not NUL-terminated */
+typedef ext2r_dirent_t ext2_dirent_t;
+
+/* Streaming iterator over the entries of a directory */
+typedef struct {
+    ext2_fs_t *fs;
+    ext2_bmap_t bm;                     /* Walks the directory's blocks */
+    ext2_extent_t ext;                  /* Run of blocks being read */
+    uint32_t ext_pos;                   /* Next block within ext */
+    const uint8_t *data;                /* Current block, NULL between blocks */
+    uint32_t offset;                    /* Next entry within data */
+    uint32_t block_size;
+    uint8_t *buf;                       /* Block buffer, only without a mapping */
+} ext2_dir_t;
+
+/* An open regular file or symlink for reads at arbitrary offsets */
+typedef struct {
+    ext2_fs_t *fs;
+    ext2_inode_t inode;
+    uint64_t size;                      /* File size in bytes */
+    ext2_bmap_t bm;                     /* Keeps the file's indirect blocks cached */
+} ext2_file_t;
+
+/* Tests an entry must pass to be listed by ext2_find */
+typedef struct {
+    const char *name;                   /* Glob matched against the entry name, or NULL */
+    uint16_t mode;                      /* EXT2_S_IF* type wanted, 0 for any */
+    int has_size;
+    int size_cmp;                       /* 1: larger than size, -1: smaller, 0: equal */
+    uint64_t size;                      /* In bytes */
+    int has_mtime;
+    int mtime_cmp;                      /* Same, for the age in whole days */
+    uint64_t mtime_days;
+} ext2_find_filter_t;
+
+/* Callback for ext2_scan_inodes; called from several threads at once,
+ * returning non-zero stops the scan */
+typedef int (*ext2_inode_fn)(void *ctx, uint32_t ino, const ext2_inode_t *inode);
+
+/* Largest piece of an inode table read at once by ext2_scan_inodes */
+#define EXT2_SCAN_CHUNK (1024 * 1024)
+
+/* Callback for ext2_dir_foreach; returning non-zero stops the walk */
+typedef int (*ext2_dir_fn)(void *ctx, uint32_t ino, uint8_t file_type,
+                           const char *name, size_t name_len);
+
+/* Work item run by a pool thread */
+typedef void (*ext2_task_fn)(void *arg);
+
+typedef struct {
+    ext2_task_fn fn;
+    void *arg;
+} ext2_task_t;
+
+/* Per-worker deque: the owner pushes and pops at the tail, idle workers steal from the head */
+typedef struct {
+    pthread_mutex_t lock;
+    ext2_task_t *tasks;                 /* Ring buffer */
+    size_t head;                        /* Oldest task, the one stolen first */
+    size_t count;
+    size_t capacity;
+} ext2_deque_t;
+
+struct ext2_pool;
+
+typedef struct {
+    struct ext2_pool *pool;
+    int index;
+    pthread_t thread;
+} ext2_worker_t;
+
+/* Work-stealing thread pool */
+typedef struct ext2_pool {
+    int nthreads;
+    ext2_worker_t *workers;
+    ext2_deque_t *queues;               /* One per worker */
+    pthread_mutex_t lock;               /* Guards the fields below */
+    pthread_cond_t work_ready;
+    pthread_cond_t all_done;
+    size_t queued;                      /* Tasks sitting in some deque */
+    size_t pending;                     /* Tasks submitted and not yet finished */
+    unsigned next_queue;                /* Round-robin target for outside submits */
+    int stop;
+} ext2_pool_t;
+
+/* Hot paths counted by --stats */
+#define EXT2_STAT_BLOCK_READ 0          /* Image blocks fetched, metadata or file data */
+#define EXT2_STAT_INODE_READ 1          /* ext2_get_inode and ext2_read_inode */
+#define EXT2_STAT_LOOKUP 2              /* ext2_find_inode */
+#define EXT2_STAT_COPY 3                /* cp write loop, one call per run of blocks */
+#define EXT2_STAT_OPS 4
+
+/* Blocks per call histogram: 1, 2-3, 4-7, ..., 1024 and up */
+#define EXT2_STAT_BUCKETS 11
+
+/* Counters for one hot path */
+typedef struct {
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t ns;                        /* Wall time spent inside the calls */
+    uint64_t blocks[EXT2_STAT_BUCKETS]; /* Calls by log2 of the blocks they moved */
+} ext2_stat_t;
+
+/* One thread's counters, kept on a global list so they outlive the thread;
+ * a later thread takes over the counters of one that has exited */
+typedef struct ext2_stats {
+    ext2_stat_t ops[EXT2_STAT_OPS];
+    int busy;                           /* Owned by a running thread */
+    struct ext2_stats *next;
+} ext2_stats_t;
+
+/* Function prototypes */
+int ext2_open(const char *img_path, ext2_fs_t *fs, int flags);
+void ext2_close(ext2_fs_t *fs);
+int ext2_read_superblock(ext2_fs_t *fs);
+int ext2_read_group_descriptors(ext2_fs_t *fs);
+int ext2_read_inode(ext2_fs_t *fs, uint32_t ino, ext2_inode_t *inode);
+int ext2_read_block(ext2_fs_t *fs, uint32_t block_num, void *buffer);
+const ext2_inode_t *ext2_get_inode(ext2_fs_t *fs, uint32_t ino, ext2_inode_t *buffer);
+const void *ext2_get_block(ext2_fs_t *fs, uint32_t block_num, void *buffer);
+int ext2_read_blocks(ext2_fs_t *fs, uint32_t block_num, uint32_t count, void *buffer);
+const void *ext2_get_blocks(ext2_fs_t *fs, uint32_t block_num, uint32_t count, void *buffer);
+int ext2_advise(ext2_fs_t *fs, uint32_t block_num, uint32_t count, int advice);
+int ext2_cache_init(ext2_fs_t *fs, uint32_t capacity_mb);
+void ext2_cache_free(ext2_fs_t *fs);
+void ext2_cache_report(ext2_fs_t *fs, FILE *out);
+void ext2_stats_enable(void);
+void ext2_stats_report(FILE *out, int json);
+int ext2_dcache_init(ext2_fs_t *fs, uint32_t entries);
+void ext2_dcache_free(ext2_fs_t *fs);
+int ext2_dindex_init(ext2_fs_t *fs, uint32_t limit_mb);
+void ext2_dindex_free(ext2_fs_t *fs);
+int ext2_index_build(ext2_fs_t *fs, const char *out_path);
+int ext2_index_load(ext2_fs_t *fs, const char *path);
+void ext2_index_free(ext2_fs_t *fs);
+uint64_t ext2_inode_size(ext2_fs_t *fs, const ext2_inode_t *inode);
+int ext2_bmap_open(ext2_bmap_t *bm, ext2_fs_t *fs, const ext2_inode_t *inode);
+int ext2_bmap_lookup(ext2_bmap_t *bm, uint32_t logical, uint32_t *physical);
+int ext2_bmap_next(ext2_bmap_t *bm, ext2_extent_t *extent);
+void ext2_bmap_close(ext2_bmap_t *bm);
+int ext2_bmap_readahead(ext2_bmap_t *bm);
+int ext2_copy_blocks(ext2_fs_t *fs, const ext2_inode_t *inode, int out_fd,
+                     uint32_t first, uint32_t count);
+int ext2_dir_open(ext2_dir_t *dir, ext2_fs_t *fs, const ext2_inode_t *inode);
+int ext2_dir_next(ext2_dir_t *dir, ext2_dirent_t *ent);
+void ext2_dir_close(ext2_dir_t *dir);
+int ext2_dir_foreach(ext2_fs_t *fs, const ext2_inode_t *dir, ext2_dir_fn fn, void *ctx);
+int ext2_file_open(ext2_file_t *file, ext2_fs_t *fs, const ext2_inode_t *inode);
+ssize_t ext2_file_pread(ext2_file_t *file, void *buf, size_t count, uint64_t offset);
+void ext2_file_close(ext2_file_t *file);
+ssize_t ext2_readlink(ext2_fs_t *fs, const ext2_inode_t *inode, char *buf, size_t size);
+int ext2_cat(ext2_fs_t *fs, const char *path, int64_t offset, uint64_t length);
+ext2_pool_t *ext2_pool_create(int nthreads);
+int ext2_pool_submit(ext2_pool_t *pool, ext2_task_fn fn, void *arg);
+void ext2_pool_wait(ext2_pool_t *pool);
+void ext2_pool_destroy(ext2_pool_t *pool);
+int ext2_ls(ext2_fs_t *fs, const char *path);
+int ext2_cp(ext2_fs_t *fs, const char *src, const char *dst);
+int ext2_cp_parallel(ext2_fs_t *fs, char *const srcs[], int nsrcs, const char *dst_dir,
+                     int recursive, int nthreads);
+int ext2_find(ext2_fs_t *fs, const char *path, const ext2_find_filter_t *filter, int nthreads);
+int ext2_du(ext2_fs_t *fs, const char *path, int summary, int nthreads);
+int ext2_scan_inodes(ext2_fs_t *fs, ext2_inode_fn fn, void *ctx, int nthreads);
+int ext2_scan(ext2_fs_t *fs, int list, int nthreads);
+int ext2_df(ext2_fs_t *fs);
+int ext2_check(ext2_fs_t *fs, int nthreads);
+int ext2_diff(ext2_fs_t *fs, const char *other_path, int nthreads);
+int ext2_hash(ext2_fs_t *fs, char *const paths[], int npaths, int algo, int recursive,
+              int nthreads);
+uint32_t ext2_find_inode(ext2_fs_t *fs, const char *path);
+uint32_t ext2_lookup(ext2_fs_t *fs, uint32_t dir_ino, const char *name, size_t name_len);
+
+#endif
@@ -0,0 +1,266 @@
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 31
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fuse.h>
+#include "myfs.h"
+
+/* Seconds the kernel may keep attributes and names; the image never changes */
+#define MYFS_FUSE_TIMEOUT 3600.0
+
+/* An open file; FUSE may read one handle from several threads at once */
+typedef struct {
+    ext2_file_t file;
+    pthread_mutex_t lock;               /* The block map cache is not shared safely */
+} myfs_handle_t;
+
+static ext2_fs_t *myfs_fs(void) {
+    return (ext2_fs_t *)fuse_get_context()->private_data;
+}
+
+/*
+ * Resolves a path to its inode. Returns 0 or a negative errno.
+ */
+static int myfs_resolve(const char *path, uint32_t *ino, ext2_inode_t *inode) {
+    ext2_fs_t *fs = myfs_fs();
+    
+    *ino = ext2_find_inode(fs, path);
+    if (*ino == 0) {
+        return -ENOENT;
+    }
+    if (ext2_read_inode(fs, *ino, inode) != 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+static void *myfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+    (void)conn;
+    
+    /* Read-only image: let the kernel cache attributes, names and pages */
+    cfg->use_ino = 1;
+    cfg->kernel_cache = 1;
+    cfg->entry_timeout = MYFS_FUSE_TIMEOUT;
+    cfg->negative_timeout = MYFS_FUSE_TIMEOUT;
+    cfg->attr_timeout = MYFS_FUSE_TIMEOUT;
+    return myfs_fs();
+}
+
+static int myfs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+    ext2_fs_t *fs = myfs_fs();
+    ext2_inode_t inode;
+    uint32_t ino;
+    (void)fi;
+    
+    int err = myfs_resolve(path, &ino, &inode);
+    if (err != 0) {
+        return err;
+    }
+    
+    memset(st, 0, sizeof(*st));
+    st->st_ino = ino;
+    st->st_mode = inode.i_mode;
+    st->st_nlink = inode.i_links_count;
+    st->st_uid = inode.i_uid;
+    st->st_gid = inode.i_gid;
+    st->st_size = (off_t)ext2_inode_size(fs, &inode);
+    st->st_blocks = inode.i_blocks;
+    st->st_blksize = 1024 << fs->superblock.s_log_block_size;
+    st->st_atime = inode.i_atime;
+    st->st_mtime = inode.i_mtime;
+    st->st_ctime = inode.i_ctime;
+    return 0;
+}
+
+static int myfs_readlink(const char *path, char *buf, size_t size) {
+    ext2_inode_t inode;
+    uint32_t ino;
+    
+    int err = myfs_resolve(path, &ino, &inode);
+    if (err != 0) {
+        return err;
+    }
+    if ((inode.i_mode & EXT2_S_IFMT) != EXT2_S_IFLNK) {
+        return -EINVAL;
+    }
+    return ext2_readlink(myfs_fs(), &inode, buf, size) < 0 ? -EIO : 0;
+}
+
+static int myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                        struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+    ext2_inode_t inode;
+    uint32_t ino;
+    (void)offset;
+    (void)fi;
+    (void)flags;
+    
+    int err = myfs_resolve(path, &ino, &inode);
+    if (err != 0) {
+        return err;
+    }
+    if ((inode.i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR) {
+        return -ENOTDIR;
+    }
+    
+    ext2_dir_t it;
+    ext2_dirent_t ent;
+    int more;
+    if (ext2_dir_open(&it, myfs_fs(), &inode) != 0) {
+        return -EIO;
+    }
+    while ((more = ext2_dir_next(&it, &ent)) > 0) {
+        char name[EXT2_NAME_LEN + 1];
+        memcpy(name, ent.name, ent.name_len);
+        name[ent.name_len] = '\0';
+        if (filler(buf, name, NULL, 0, 0) != 0) {
+            break;
+        }
+    }
+    ext2_dir_close(&it);
+    return more < 0 ? -EIO : 0;
+}
+
+static int myfs_open(const char *path, struct fuse_file_info *fi) {
+    ext2_inode_t inode;
+    uint32_t ino;
+    
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        return -EROFS;
+    }
+    int err = myfs_resolve(path, &ino, &inode);
+    if (err != 0) {
+        return err;
+    }
+    if ((inode.i_mode & EXT2_S_IFMT) != EXT2_S_IFREG) {
+        return -EISDIR;
+    }
+    
+    myfs_handle_t *h = (myfs_handle_t *)malloc(sizeof(myfs_handle_t));
+    if (!h) {
+        return -ENOMEM;
+    }
+    if (ext2_file_open(&h->file, myfs_fs(), &inode) != 0) {
+        free(h);
+        return -EIO;
+    }
+    pthread_mutex_init(&h->lock, NULL);
+    
+    fi->fh = (uint64_t)(uintptr_t)h;
+    fi->keep_cache = 1;
+    return 0;
+}
+
+static int myfs_read(const char *path, char *buf, size_t size, off_t offset,
+                     struct fuse_file_info *fi) {
+    myfs_handle_t *h = (myfs_handle_t *)(uintptr_t)fi->fh;
+    (void)path;
+    
+    pthread_mutex_lock(&h->lock);
+    ssize_t n = ext2_file_pread(&h->file, buf, size, (uint64_t)offset);
+    pthread_mutex_unlock(&h->lock);
+    return n < 0 ? -EIO : (int)n;
+}
+
+static int myfs_release(const char *path, struct fuse_file_info *fi) {
+    myfs_handle_t *h = (myfs_handle_t *)(uintptr_t)fi->fh;
+    (void)path;
+    
+    ext2_file_close(&h->file);
+    pthread_mutex_destroy(&h->lock);
+    free(h);
+    return 0;
+}
+
+static int myfs_statfs(const char *path, struct statvfs *st) {
+    const ext2_superblock_t *sb = &myfs_fs()->superblock;
+    (void)path;
+    
+    memset(st, 0, sizeof(*st));
+    st->f_bsize = 1024 << sb->s_log_block_size;
+    st->f_frsize = st->f_bsize;
+    st->f_blocks = sb->s_blocks_count;
+    st->f_bfree = sb->s_free_blocks_count;
+    st->f_bavail = sb->s_free_blocks_count > sb->s_r_blocks_count
+                       ? sb->s_free_blocks_count - sb->s_r_blocks_count : 0;
+    st->f_files = sb->s_inodes_count;
+    st->f_ffree = sb->s_free_inodes_count;
+    st->f_favail = sb->s_free_inodes_count;
+    st->f_namemax = EXT2_NAME_LEN;
+    st->f_flag = ST_RDONLY;
+    return 0;
+}
+
+static const struct fuse_operations myfs_ops = {
+    .init = myfs_init,
+    .getattr = myfs_getattr,
+    .readlink = myfs_readlink,
+    .readdir = myfs_readdir,
+    .open = myfs_open,
+    .read = myfs_read,
+    .release = myfs_release,
+    .statfs = myfs_statfs,
+};
+
+/*
+ * Mounts an image read-only. Options before the image are ours; the
+ * mount point and everything after it go to FUSE, which serves requests
+ * from several threads unless -s is given.
+ */
+int main(int argc, char *argv[]) {
+    int open_flags = EXT2_OPEN_MMAP;
+    uint32_t cache_mb = 16;
+    const char *index_path = NULL;
+    int argi = 1;
+    
+    while (argi < argc && strncmp(argv[argi], "--", 2) == 0) {
+        if (strcmp(argv[argi], "--no-mmap") == 0) {
+            open_flags &= ~EXT2_OPEN_MMAP;
+        } else if (strcmp(argv[argi], "--cache-mb") == 0 && argi + 1 < argc) {
+            cache_mb = (uint32_t)strtoul(argv[++argi], NULL, 10);
+        } else if (strcmp(argv[argi], "--index") == 0 && argi + 1 < argc) {
+            index_path = argv[++argi];
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[argi]);
+            return 1;
+        }
+        argi++;
+    }
+    
+    if (argc - argi < 2) {
+        fprintf(stderr, "Usage: %s [--no-mmap] [--cache-mb n] [--index file] <disk_image> <mountpoint> "
+                "[fuse options]\n", argv[0]);
+        return 1;
+    }
+    
+    ext2_fs_t *fs = (ext2_fs_t *)calloc(1, sizeof(ext2_fs_t));
+    if (!fs) {
+        perror("Error allocating file system");
+        return 1;
+    }
+    if (ext2_open(argv[argi], fs, open_flags) != 0) {
+        fprintf(stderr, "Failed to open EXT2 image\n");
+        free(fs);
+        return 1;
+    }
+    if (ext2_cache_init(fs, cache_mb) != 0 ||
+        ext2_dindex_init(fs, EXT2_DINDEX_DEFAULT_MB) != 0 ||
+        (index_path && ext2_index_load(fs, index_path) != 0)) {
+        ext2_close(fs);
+        free(fs);
+        return 1;
+    }
+    
+    /* Hand FUSE the program name followed by the mount point and its options */
+    argv[argi] = argv[0];
+    int result = fuse_main(argc - argi, argv + argi, &myfs_ops, fs);
+    
+    ext2_close(fs);
+    free(fs);
+    return result;
+}
@@ -9,7 +9,8 @@ echo "========================================="
 echo ""
 
 # Clean up previous test outputs
-rm -f test_*.txt test_*.bin 2>/dev/null || true
+rm -f test_*.txt test_*.bin test_*.idx 2>/dev/null || true
+rm -rf test_tree 2>/dev/null || true
 
 echo "Test 1: List Root Directory"
 echo "Command: ./myfs my_partition.img ls"
@@ -64,11 +65,334 @@ echo "Command: ./myfs my_partition.img cp /largefile.bin ./test_large.bin"
 ./myfs my_partition.img cp /largefile.bin ./test_large.bin 2>&1 | grep "File copied"
 if [ -f test_large.bin ]; then
     SIZE=$(ls -lh test_large.bin | awk '{print $5}')
+    BYTES=$(wc -c < test_large.bin)
+    # 10000 random bytes base64-encoded: spans indirect blocks on 1K-block images
+    if [ "$BYTES" -ne 13512 ]; then
+        echo "✗ File truncated ($BYTES of 13512 bytes)"
+        exit 1
+    fi
     echo "✓ File created successfully ($SIZE)"
 else
     echo "✗ File not created"
     exit 1
 fi
+if command -v debugfs > /dev/null 2>&1; then
+    # Cut the image inside the file's last block: the copy must fail
+    BLOCK_SIZE=$(debugfs -R stats my_partition.img 2> /dev/null | awk '/^Block size:/ {print $3}')
+    LAST=$(( (BYTES - 1) / BLOCK_SIZE ))
+    BLOCK=$(debugfs -R "bmap /largefile.bin $LAST" my_partition.img 2> /dev/null)
+    cp my_partition.img test_short.img
+    truncate -s $((BLOCK * BLOCK_SIZE)) test_short.img
+    for opt in "" "--no-zerocopy"; do
+        if ./myfs $opt test_short.img cp /largefile.bin ./test_short.bin > /dev/null 2>&1; then
+            echo "✗ Copy from a truncated image succeeded ($opt)"
+            exit 1
+        fi
+    done
+    rm -f test_short.img test_short.bin
+    echo "✓ Copy from a truncated image fails"
+fi
+echo ""
+
+echo "Test 7: Batch Mode"
+echo "Command: ./myfs my_partition.img batch (ls /docs; cp /hello.txt ./test_batch.txt)"
+printf 'ls /docs\ncp /hello.txt ./test_batch.txt\n' | ./myfs my_partition.img batch 2>&1 | grep -E "^\[|Batch complete"
+if cmp -s test_batch.txt test_hello.txt; then
+    echo "✓ Both commands ran against one opened image"
+else
+    echo "✗ Batch copy missing or different"
+    exit 1
+fi
+# ls scans / in full, so the lookup that follows is answered by its index
+if printf 'ls /\ncat /hello.txt\n' | ./myfs --cache-stats my_partition.img batch 2>&1 | \
+   grep -A1 "^Directory index" | grep -q "hits: 1  builds: 1 "; then
+    echo "✓ Listing a directory indexed it for the next lookup"
+else
+    echo "✗ ls did not build the directory index"
+    exit 1
+fi
+echo ""
+
+echo "Test 8: Parallel Recursive Copy"
+echo "Command: ./myfs my_partition.img cp -r -j 4 /docs /hello.txt ./test_tree"
+./myfs my_partition.img cp -r -j 4 /docs /hello.txt ./test_tree 2>&1 | grep "Copied"
+if cmp -s test_tree/docs/info.txt test_info.txt && cmp -s test_tree/hello.txt test_hello.txt; then
+    echo "✓ Directory tree extracted"
+else
+    echo "✗ Extracted tree incomplete"
+    exit 1
+fi
+if command -v mkfs.ext2 > /dev/null 2>&1; then
+    # Rename an entry to "../pw" in place: it must be skipped, not written above the tree
+    STAGING=$(mktemp -d)
+    mkdir "$STAGING/d"
+    echo escaped > "$STAGING/d/QQpwn"
+    mkfs.ext2 -q -F -b 1024 -d "$STAGING" test_escape.img 8M > /dev/null 2>&1
+    rm -rf "$STAGING"
+    LC_ALL=C sed -i 's|QQpwn|../pw|' test_escape.img
+    mkdir -p test_tree/escape
+    if ./myfs test_escape.img cp -r -j 2 /d ./test_tree/escape/x > /dev/null 2>&1 || \
+       [ -e test_tree/escape/x/pw ] || [ -e test_tree/escape/pw ]; then
+        echo "✗ An entry named ../pw was extracted"
+        exit 1
+    fi
+    rm -f test_escape.img
+    echo "✓ Entry names containing '/' are refused"
+fi
+echo ""
+
+echo "Test 9: Find and Disk Usage"
+echo "Command: ./myfs my_partition.img find / -name '*.txt' -type f"
+./myfs my_partition.img find / -name '*.txt' -type f 2>&1 | grep -E "^file"
+if ./myfs my_partition.img find / -name info.txt 2>&1 | grep -q " /docs/info.txt$" && \
+   ./myfs my_partition.img du -s 2>&1 | grep -qE "^[0-9]+	/$"; then
+    echo "✓ Tree walk found the file and summed usage"
+else
+    echo "✗ find/du output incorrect"
+    exit 1
+fi
+echo ""
+
+echo "Test 10: Inode Table Scan"
+echo "Command: ./myfs my_partition.img scan -j 2"
+./myfs my_partition.img scan -j 2 2>&1 | grep -A2 "^Scanned"
+if ./myfs my_partition.img scan 2>&1 | grep -qE "^Scanned ([0-9]+) used inodes in [0-9]+ groups \(superblock: \1\)"; then
+    echo "✓ Scan agrees with the superblock inode count"
+else
+    echo "✗ Scan count differs from the superblock"
+    exit 1
+fi
+echo ""
+
+echo "Test 11: Free Space Report"
+echo "Command: ./myfs my_partition.img df"
+./myfs my_partition.img df 2>&1 | grep -E "Blocks:|Inodes:|Free extents"
+if ./myfs my_partition.img df 2>&1 | grep -q "MISMATCH"; then
+    echo "✗ Bitmaps disagree with the superblock"
+    exit 1
+else
+    echo "✓ Bitmap counts match the superblock"
+fi
+echo ""
+
+echo "Test 12: Read File Ranges"
+echo "Command: ./myfs my_partition.img cat /largefile.bin [offset] [length]"
+./myfs my_partition.img cat /largefile.bin > test_cat.bin
+./myfs my_partition.img cat /largefile.bin 5000 3000 > test_cat_range.bin
+./myfs my_partition.img cat /largefile.bin -20 > test_cat_tail.bin
+if cmp -s test_cat.bin test_large.bin && \
+   cmp -s test_cat_range.bin <(tail -c +5001 test_large.bin | head -c 3000) && \
+   cmp -s test_cat_tail.bin <(tail -c 20 test_large.bin); then
+    echo "✓ Whole file, range and tail match the copied file"
+else
+    echo "✗ cat output differs from the copied file"
+    exit 1
+fi
+echo ""
+
+echo "Test 13: Hot Path Stats"
+echo "Command: ./myfs --stats=json my_partition.img cp /largefile.bin ./test_stats.bin"
+STATS=$(./myfs --stats=json my_partition.img cp /largefile.bin ./test_stats.bin 2>&1 >/dev/null)
+echo "$STATS" | grep -o '"copy": {"calls": [0-9]*, "bytes": [0-9]*'
+if echo "$STATS" | grep -q "\"bytes\": $(wc -c < test_large.bin), "; then
+    echo "✓ Copy counters match the file size"
+else
+    echo "✗ Copy counters do not match the file size"
+    exit 1
+fi
+echo ""
+
+echo "Test 14: Sidecar Index"
+echo "Command: ./myfs my_partition.img index ./test_index.idx"
+./myfs my_partition.img index ./test_index.idx 2>&1 | grep "Indexed"
+./myfs --index ./test_index.idx my_partition.img cat /largefile.bin > test_index_cat.bin
+./myfs --index ./test_index.idx my_partition.img ls /docs 2>&1 | grep -q "info.txt"
+if cmp -s test_index_cat.bin test_large.bin; then
+    echo "✓ Reads through the index match the copied file"
+else
+    echo "✗ Reads through the index differ"
+    exit 1
+fi
+echo ""
+
+echo "Test 15: Consistency Check"
+echo "Command: ./myfs my_partition.img check -j 4"
+./myfs my_partition.img check -j 4 2>&1 | grep -E "Checked|problems"
+if ./myfs my_partition.img check -j 4 > /dev/null 2>&1; then
+    echo "✓ Block ownership, bitmaps and directories are consistent"
+else
+    echo "✗ check reported problems"
+    exit 1
+fi
+echo ""
+
+echo "Test 16: Content Hashes"
+echo "Command: ./myfs my_partition.img hash -r /"
+./myfs my_partition.img hash -r / > test_hash.txt 2> /dev/null
+cat test_hash.txt
+if grep -q "^$(sha256sum < test_large.bin | cut -d' ' -f1)  /largefile.bin$" test_hash.txt && \
+   ./myfs my_partition.img hash -a xxh64 /largefile.bin 2> /dev/null | grep -qE "^[0-9a-f]{16}  /largefile.bin$"; then
+    echo "✓ SHA-256 of /largefile.bin matches sha256sum"
+else
+    echo "✗ Digest differs from sha256sum"
+    exit 1
+fi
+echo ""
+
+echo "Test 17: Image Diff"
+echo "Command: ./myfs my_partition.img diff test_diff.img"
+cp my_partition.img test_diff.img
+if ./myfs my_partition.img diff test_diff.img > /dev/null 2>&1; then
+    echo "✓ An image has no differences with its copy"
+else
+    echo "✗ Identical images reported as different"
+    exit 1
+fi
+if command -v debugfs > /dev/null 2>&1; then
+    BLOCK=$(debugfs -R "bmap /largefile.bin 3" test_diff.img 2> /dev/null)
+    BLOCK_SIZE=$(debugfs -R stats test_diff.img 2> /dev/null | awk '/^Block size:/ {print $3}')
+    printf 'changed' | dd of=test_diff.img bs=1 seek=$((BLOCK * BLOCK_SIZE)) conv=notrunc 2> /dev/null
+    ./myfs my_partition.img diff test_diff.img 2> /dev/null | tee test_diff.txt
+    if [ "$(cat test_diff.txt)" = "M  /largefile.bin" ]; then
+        echo "✓ The changed block is mapped back to its file"
+    else
+        echo "✗ diff did not find the changed file"
+        exit 1
+    fi
+fi
+if command -v mkfs.ext2 > /dev/null 2>&1 && command -v debugfs > /dev/null 2>&1; then
+    # A short link whose attribute block makes i_blocks non-zero, retargeted in place
+    STAGING=$(mktemp -d)
+    ln -s target_one "$STAGING/lnk"
+    mkfs.ext2 -q -F -b 1024 -I 128 -d "$STAGING" test_link_a.img 8M > /dev/null 2>&1
+    rm -rf "$STAGING"
+    debugfs -w -R "ea_set /lnk user.note value" test_link_a.img > /dev/null 2>&1
+    cp test_link_a.img test_link_b.img
+    LC_ALL=C sed -i 's|target_one|target_two|' test_link_b.img
+    if [ "$(./myfs test_link_a.img diff test_link_b.img 2> /dev/null)" = "M  /lnk" ]; then
+        echo "✓ A retargeted short link with an attribute block is found"
+    else
+        echo "✗ diff missed or misread a short link with an attribute block"
+        exit 1
+    fi
+    rm -f test_link_a.img test_link_b.img
+fi
+echo ""
+
+echo "Test 18: Reader Library"
+echo "Command: make libext2reader.a ext2reader_test"
+make -s libext2reader.a
+if nm -u libext2reader.a | grep -qE " (printf|fprintf|puts|perror|lseek|read)$"; then
+    echo "✗ libext2reader.a prints or moves the file offset"
+    exit 1
+fi
+echo "✓ libext2reader.a reads with pread only and prints nothing"
+echo "Command: ./ext2reader_test my_partition.img cat /largefile.bin; ls /docs"
+make -s ext2reader_test
+./ext2reader_test my_partition.img cat /largefile.bin > test_lib_cat.bin
+./ext2reader_test my_partition.img ls /docs | tee test_lib_ls.txt
+if cmp -s test_lib_cat.bin test_large.bin && grep -qE "^[0-9]+ 1 info\.txt$" test_lib_ls.txt; then
+    echo "✓ ext2r_resolve, ext2r_pread and ext2r_dir_next match the tool"
+else
+    echo "✗ Library reads differ from the tool"
+    exit 1
+fi
+if command -v mkfs.ext2 > /dev/null 2>&1 && command -v debugfs > /dev/null 2>&1; then
+    # 128-byte inodes push the attribute out to a block of its own, which
+    # i_blocks counts although the target still lives in i_block
+    STAGING=$(mktemp -d)
+    ln -s target_file "$STAGING/lnk"
+    mkfs.ext2 -q -F -b 1024 -I 128 -d "$STAGING" test_symlink.img 8M > /dev/null 2>&1
+    rm -rf "$STAGING"
+    debugfs -w -R "ea_set /lnk user.note value" test_symlink.img > /dev/null 2>&1
+    if [ "$(./ext2reader_test test_symlink.img readlink /lnk 2> /dev/null)" = "target_file" ]; then
+        echo "✓ ext2r_readlink reads a short link that has an attribute block"
+    else
+        echo "✗ ext2r_readlink misread a short link with an attribute block"
+        exit 1
+    fi
+fi
+echo ""
+
+echo "Test 19: Sparse Extraction"
+echo "Command: ./myfs test_sparse.img cp /sparse.bin ./test_sparse.bin"
+if command -v mkfs.ext2 > /dev/null 2>&1; then
+    # A 64 MiB file with three small extents: only those may take space
+    STAGING=$(mktemp -d)
+    truncate -s 64M "$STAGING/sparse.bin"
+    for seek in 3 700 1000; do
+        dd if=/dev/urandom of="$STAGING/sparse.bin" bs=4k count=2 seek=$seek conv=notrunc 2> /dev/null
+    done
+    mkfs.ext2 -q -F -b 1024 -d "$STAGING" test_sparse.img 80M > /dev/null 2>&1
+    cp "$STAGING/sparse.bin" test_sparse_src.bin
+    rm -rf "$STAGING"
+    ./myfs test_sparse.img cp /sparse.bin ./test_sparse.bin 2>&1 | grep "File copied"
+    if cmp -s test_sparse.bin test_sparse_src.bin && [ "$(du -k test_sparse.bin | cut -f1)" -lt 1024 ]; then
+        echo "✓ The copy matches and keeps its holes ($(du -k test_sparse.bin | cut -f1)K on disk)"
+    else
+        echo "✗ The copy differs or its holes were filled in"
+        exit 1
+    fi
+else
+    echo "mkfs.ext2 not found; skipped"
+fi
+echo ""
+
+echo "Test 20: io_uring Copy"
+echo "Command: ./myfs --uring 8 my_partition.img cp /largefile.bin ./test_uring.bin"
+./myfs --uring 8 my_partition.img cp /largefile.bin ./test_uring.bin 2>&1 | grep "File copied"
+if ! cmp -s test_uring.bin test_large.bin; then
+    echo "✗ io_uring copy differs from the copied file"
+    exit 1
+fi
+if [ -f test_sparse.img ]; then
+    # 64 MiB is well past the io_uring threshold
+    ./myfs --uring 8 test_sparse.img cp /sparse.bin ./test_uring_sparse.bin 2>&1 | grep "File copied"
+    if ! cmp -s test_uring_sparse.bin test_sparse_src.bin || \
+       [ "$(du -k test_uring_sparse.bin | cut -f1)" -ge 1024 ]; then
+        echo "✗ io_uring copy of a sparse file differs or lost its holes"
+        exit 1
+    fi
+fi
+echo "✓ io_uring copies match and stay sparse"
+echo ""
+
+echo "Test 21: Hash-Indexed Directories"
+echo "Command: ./myfs test_htree.img batch (cat /one/<name>; cat /two/<name>; ...)"
+if command -v mkfs.ext2 > /dev/null 2>&1 && command -v e2fsck > /dev/null 2>&1; then
+    # /one: 3000 short names, a one-level tree; /two: 1500 names of 190
+    # characters, enough leaves at 1K blocks for a two-level tree
+    STAGING=$(mktemp -d)
+    LONG=$(printf 'x%.0s' $(seq 1 184))
+    mkdir "$STAGING/one" "$STAGING/two"
+    (cd "$STAGING/one" && seq -f "entry_%05g" 1 3000 | xargs touch)
+    (cd "$STAGING/two" && seq -f "${LONG}_%05g" 1 1500 | xargs touch)
+    echo "found" > "$STAGING/two/${LONG}_00777"
+    mkfs.ext2 -q -F -b 1024 -N 6000 -d "$STAGING" test_htree.img 16M > /dev/null 2>&1
+    rm -rf "$STAGING"
+    e2fsck -fyD test_htree.img > /dev/null 2>&1 || true
+    if ! debugfs -R "htree /two" test_htree.img 2> /dev/null | grep -q "Indirect levels: 1"; then
+        echo "✗ e2fsck did not build a two-level index"
+        exit 1
+    fi
+    # Every 37th name of each directory, then one that does not exist
+    { seq -f "cat /one/entry_%05g" 1 37 3000
+      seq -f "cat /two/${LONG}_%05g" 1 37 1500
+      echo "cat /one/entry_99999"; } > test_htree.txt
+    EXPECTED=$(( $(wc -l < test_htree.txt) - 1 ))
+    OK=$(./myfs test_htree.img batch test_htree.txt 2> /dev/null | grep -c "^\[ok\]")
+    if [ "$OK" -eq "$EXPECTED" ] && \
+       ! ./myfs test_htree.img cat /one/entry_99999 > /dev/null 2>&1 && \
+       [ "$(./myfs test_htree.img cat "/two/${LONG}_00777" 2> /dev/null)" = "found" ] && \
+       [ "$(./ext2reader_test test_htree.img cat "/two/${LONG}_00777" 2> /dev/null)" = "found" ]; then
+        echo "✓ $OK names found through one- and two-level indexes, the missing one is not"
+    else
+        echo "✗ Indexed lookups failed ($OK of $EXPECTED found)"
+        exit 1
+    fi
+else
+    echo "mkfs.ext2 or e2fsck not found; skipped"
+fi
 echo ""
 
 echo "========================================="